@@ -0,0 +1,293 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Process-wide pool of idle keep-alive connections, keyed by host:port.
+
+#include "ConnectionPool.h"
+
+#include "TimerWheel.h"
+#include "TlsConnection.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include <poll.h>
+#include <unistd.h>
+
+
+// Keep the defaults under the 5 second keep-alive timeout common on servers,
+// so a pooled connection is rarely closed by the other end while idle.
+static const int DefaultMaxIdlePerHost = 4;
+static const int DefaultIdleTimeout = 4000;
+
+
+//-----------------------------------------------------------------------------
+ConnectionPool& ConnectionPool::instance()
+{
+  static ConnectionPool pool;
+  return pool;
+}
+
+
+//-----------------------------------------------------------------------------
+ConnectionPool::ConnectionPool() :
+  _maxIdlePerHost(DefaultMaxIdlePerHost),
+  _idleTimeout(DefaultIdleTimeout),
+  _idleCount(0),
+  _lastPrune(0)
+{
+  pthread_mutex_init(&_mutex, 0);
+}
+
+
+//-----------------------------------------------------------------------------
+ConnectionPool::~ConnectionPool()
+{
+  closeIdle();
+  pthread_mutex_destroy(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+int ConnectionPool::acquire(const std::string &host, int port, TlsConnection **tls)
+{
+  pthread_mutex_lock(&_mutex);
+
+  long long now = TimerWheel::now();
+  prune(now);
+
+  int socket = -1;
+
+  std::map<std::string, IdleList>::iterator itr = _idle.find(key(host, port, tls != 0));
+
+  if (itr != _idle.end())
+  {
+    IdleList &list = itr->second;
+
+    // Most recently used first, it is the least likely to be closed.
+    while (socket < 0 && !list.empty())
+    {
+      Idle idle = list.back();
+      list.pop_back();
+      _idleCount--;
+
+      if (now - idle.since < _idleTimeout && isAlive(idle.socket))
+      {
+        socket = idle.socket;
+
+        if (tls)
+        {
+          *tls = idle.tls;
+        }
+      }
+      else
+      {
+        close(idle);
+      }
+    }
+
+    if (list.empty())
+    {
+      _idle.erase(itr);
+    }
+  }
+
+  pthread_mutex_unlock(&_mutex);
+
+  return socket;
+}
+
+
+//-----------------------------------------------------------------------------
+void ConnectionPool::release(const std::string &host, int port, int socket, TlsConnection *tls)
+{
+  pthread_mutex_lock(&_mutex);
+
+  long long now = TimerWheel::now();
+  prune(now);
+
+  Idle idle;
+  idle.socket = socket;
+  idle.tls = tls;
+  idle.since = now;
+
+  IdleList &list = _idle[key(host, port, tls != 0)];
+
+  if ((int)list.size() < _maxIdlePerHost)
+  {
+    list.push_back(idle);
+    _idleCount++;
+    idle.socket = -1;
+  }
+  else if (list.empty())
+  {
+    _idle.erase(key(host, port, tls != 0));
+  }
+
+  pthread_mutex_unlock(&_mutex);
+
+  if (idle.socket >= 0)
+  {
+    close(idle);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void ConnectionPool::setMaxIdlePerHost(int maxIdle)
+{
+  pthread_mutex_lock(&_mutex);
+  _maxIdlePerHost = maxIdle;
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+void ConnectionPool::setIdleTimeout(int timeoutMs)
+{
+  pthread_mutex_lock(&_mutex);
+  _idleTimeout = timeoutMs;
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+void ConnectionPool::closeIdle()
+{
+  pthread_mutex_lock(&_mutex);
+
+  std::map<std::string, IdleList>::iterator itr;
+
+  for (itr = _idle.begin(); itr != _idle.end(); itr++)
+  {
+    IdleList::iterator idle;
+
+    for (idle = itr->second.begin(); idle != itr->second.end(); idle++)
+    {
+      close(*idle);
+    }
+  }
+
+  _idle.clear();
+  _idleCount = 0;
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+int ConnectionPool::closeExpired()
+{
+  pthread_mutex_lock(&_mutex);
+
+  long long now = TimerWheel::now();
+  prune(now);
+
+  long long next = -1;
+
+  std::map<std::string, IdleList>::iterator itr;
+
+  for (itr = _idle.begin(); itr != _idle.end(); itr++)
+  {
+    long long due = itr->second.front().since + _idleTimeout;
+
+    if (next < 0 || due < next)
+    {
+      next = due;
+    }
+  }
+
+  // prune() runs at most once a second
+  if (next >= 0)
+  {
+    next = std::max(next, _lastPrune + 1000) - now;
+  }
+
+  pthread_mutex_unlock(&_mutex);
+
+  return (int)next;
+}
+
+
+//-----------------------------------------------------------------------------
+int ConnectionPool::idleCount()
+{
+  pthread_mutex_lock(&_mutex);
+  int count = _idleCount;
+  pthread_mutex_unlock(&_mutex);
+
+  return count;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Close expired connections of all hosts, at most once a second.
+// Called with the mutex held.
+void ConnectionPool::prune(long long now)
+{
+  if (now - _lastPrune < 1000)
+  {
+    return;
+  }
+
+  _lastPrune = now;
+
+  std::map<std::string, IdleList>::iterator itr = _idle.begin();
+
+  while (itr != _idle.end())
+  {
+    IdleList &list = itr->second;
+
+    // Oldest first
+    while (!list.empty() && now - list.front().since >= _idleTimeout)
+    {
+      close(list.front());
+      list.pop_front();
+      _idleCount--;
+    }
+
+    if (list.empty())
+    {
+      _idle.erase(itr++);
+    }
+    else
+    {
+      itr++;
+    }
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+std::string ConnectionPool::key(const std::string &host, int port, bool tls)
+{
+  char portStr[16];
+  sprintf(portStr, tls ? ":%d/tls" : ":%d", port);
+
+  return host + portStr;
+}
+
+
+//-----------------------------------------------------------------------------
+// An idle connection should have nothing to read. If it is readable the
+// server either closed it or sent something unexpected, so it can't be used.
+bool ConnectionPool::isAlive(int socket)
+{
+  struct pollfd pfd;
+  pfd.fd = socket;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  return (poll(&pfd, 1, 0) == 0);
+}
+
+
+//-----------------------------------------------------------------------------
+void ConnectionPool::close(Idle &idle)
+{
+  delete idle.tls;
+  ::close(idle.socket);
+}
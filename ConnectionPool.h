@@ -0,0 +1,95 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Process-wide pool of idle keep-alive connections, keyed by host:port.
+//
+// HttpRequest::cleanUp() gives its socket back to the pool when the last
+// response left the connection open, and HttpRequest::initSocket() takes a
+// socket from the pool before dialing a new one. So short-lived HttpRequest
+// objects talking to the same server share connections.
+//
+// TLS connections are pooled apart from plain ones, together with their
+// TlsConnection.
+//
+// The pool is safe to use from several threads.
+
+#ifndef CONNECTION_POOL_H
+#define CONNECTION_POOL_H
+
+#include <deque>
+#include <map>
+#include <string>
+
+#include <pthread.h>
+
+class TlsConnection;
+
+class ConnectionPool
+{
+public:
+
+  static ConnectionPool& instance();
+
+  // Take an idle connection to host:port. Return -1 if there is none.
+  // Pass tls to get a TLS connection, its TlsConnection is stored there.
+  int acquire(const std::string &host, int port, TlsConnection **tls = 0);
+
+  // Hand over an idle connection, with its TlsConnection if it uses TLS.
+  // It is closed instead if the host already has the maximum number of
+  // idle connections.
+  void release(const std::string &host, int port, int socket, TlsConnection *tls = 0);
+
+  // Maximum idle connections kept per host:port. 0 disables pooling.
+  void setMaxIdlePerHost(int maxIdle);
+
+  // Idle connections older than this are closed.
+  void setIdleTimeout(int timeoutMs);
+
+  // Close all idle connections.
+  void closeIdle();
+
+  // Close idle connections past the idle timeout, as acquire() and release()
+  // do. Return the milliseconds until the next ones are due, -1 if none are
+  // idle. EventLoop::run() calls it, so they don't outstay the timeout
+  // while nothing is acquired or released.
+  int closeExpired();
+
+  // Number of idle connections in the pool.
+  int idleCount();
+
+
+private:
+
+  struct Idle
+  {
+    int socket;
+    TlsConnection *tls;
+    long long since; // When the connection became idle (TimerWheel::now())
+  };
+
+  typedef std::deque<Idle> IdleList;
+
+  std::map<std::string, IdleList> _idle;
+
+  pthread_mutex_t _mutex;
+
+  int _maxIdlePerHost;
+  int _idleTimeout;
+  int _idleCount;
+  long long _lastPrune;
+
+  ConnectionPool();
+  ~ConnectionPool();
+
+  void prune(long long now);
+
+  static std::string key(const std::string &host, int port, bool tls);
+  static bool isAlive(int socket);
+  static void close(Idle &idle);
+
+  ConnectionPool(const ConnectionPool&);
+  ConnectionPool& operator=(const ConnectionPool&);
+};
+
+#endif
@@ -0,0 +1,223 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Establish a TCP connection to one of several addresses.
+
+#include "Connector.h"
+
+#include "HttpException.h"
+#include "TimerWheel.h"
+
+#include <cstring>
+#include <vector>
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+//-----------------------------------------------------------------------------
+// HttpRequest writes each request with a single sendmsg(), so Nagle's
+// algorithm would only delay requests sent while a response is pending.
+static int connected(int socket)
+{
+  int on = 1;
+  setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  return socket;
+}
+
+
+//-----------------------------------------------------------------------------
+int Connector::connect(const SocketAddressList &addresses, int port, int timeoutMs, HttpError &error)
+{
+  SocketAddressList ordered = interleave(addresses);
+
+  long long now = TimerWheel::now();
+  long long deadline = now + timeoutMs;
+  long long nextAttempt = now;
+
+  size_t next = 0;      // Next address to try
+  int lastError = EHOSTUNREACH;
+
+  std::vector<struct pollfd> attempts;
+
+  while (true)
+  {
+    now = TimerWheel::now();
+
+    // Start the next attempt
+    if (next < ordered.size() && now >= nextAttempt)
+    {
+      SocketAddress address = ordered[next++];
+      address.setPort(port);
+
+      int s = socket(address.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+      if (s < 0)
+      {
+        lastError = errno;
+        continue;
+      }
+
+      if (::connect(s, (sockaddr const*)&address.address, address.length) == 0)
+      {
+        for (size_t i = 0; i < attempts.size(); i++)
+        {
+          ::close(attempts[i].fd);
+        }
+
+        return connected(s);
+      }
+
+      if (errno != EINPROGRESS)
+      {
+        // Failed right away, move on to the next address without waiting.
+        lastError = errno;
+        ::close(s);
+        continue;
+      }
+
+      struct pollfd pfd;
+      pfd.fd = s;
+      pfd.events = POLLOUT;
+      pfd.revents = 0;
+      attempts.push_back(pfd);
+
+      nextAttempt = now + ConnectionAttemptDelay;
+      continue;
+    }
+
+    if (attempts.empty())
+    {
+      if (next >= ordered.size()) break;
+
+      // Nothing in flight, don't wait to start the next attempt.
+      nextAttempt = now;
+      continue;
+    }
+
+    // Sleep until an attempt completes, the next one is due or time is up.
+    long long wake = -1;
+
+    if (next < ordered.size())
+    {
+      wake = nextAttempt;
+    }
+
+    if (timeoutMs >= 0 && (wake < 0 || deadline < wake))
+    {
+      wake = deadline;
+    }
+
+    int wait = -1;
+
+    if (wake >= 0)
+    {
+      wait = (wake > now) ? (int)(wake - now) : 0;
+    }
+
+    if (timeoutMs >= 0 && now >= deadline)
+    {
+      for (size_t i = 0; i < attempts.size(); i++)
+      {
+        ::close(attempts[i].fd);
+      }
+
+      error.set(HttpError::Timeout, "connect(): timed out after %d ms", timeoutMs);
+      return -1;
+    }
+
+    int r = poll(&attempts[0], attempts.size(), wait);
+
+    if (r < 0 && errno != EINTR)
+    {
+      lastError = errno;
+      break;
+    }
+
+    for (size_t i = 0; r > 0 && i < attempts.size(); )
+    {
+      if (!attempts[i].revents)
+      {
+        i++;
+        continue;
+      }
+
+      int status = 0;
+      socklen_t length = sizeof(status);
+
+      if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &status, &length) < 0)
+      {
+        status = errno;
+      }
+
+      if (status == 0)
+      {
+        int s = attempts[i].fd;
+
+        for (size_t j = 0; j < attempts.size(); j++)
+        {
+          if (j != i) ::close(attempts[j].fd);
+        }
+
+        return connected(s);
+      }
+
+      // This attempt failed, the next one may start right away.
+      lastError = status;
+      ::close(attempts[i].fd);
+      attempts.erase(attempts.begin() + i);
+      nextAttempt = now;
+    }
+  }
+
+  for (size_t i = 0; i < attempts.size(); i++)
+  {
+    ::close(attempts[i].fd);
+  }
+
+  error.set(HttpError::Connect, "connect(): %s", strerror(lastError));
+  return -1;
+}
+
+
+//-----------------------------------------------------------------------------
+SocketAddressList Connector::interleave(const SocketAddressList &addresses)
+{
+  if (addresses.empty())
+  {
+    return addresses;
+  }
+
+  int preferred = addresses[0].family();
+
+  SocketAddressList first;
+  SocketAddressList second;
+
+  for (size_t i = 0; i < addresses.size(); i++)
+  {
+    if (addresses[i].family() == preferred)
+    {
+      first.push_back(addresses[i]);
+    }
+    else
+    {
+      second.push_back(addresses[i]);
+    }
+  }
+
+  SocketAddressList ordered;
+
+  for (size_t i = 0; i < first.size() || i < second.size(); i++)
+  {
+    if (i < first.size()) ordered.push_back(first[i]);
+    if (i < second.size()) ordered.push_back(second[i]);
+  }
+
+  return ordered;
+}
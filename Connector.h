@@ -0,0 +1,39 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Establish a TCP connection to one of several addresses.
+//
+// Connections are made with non-blocking sockets so a deadline can be
+// enforced. When a host has several addresses they race each other as
+// described in RFC 8305 (Happy Eyeballs): attempts start a short delay
+// apart, alternating between IPv6 and IPv4, and the first attempt to
+// complete the handshake wins.
+
+#ifndef CONNECTOR_H
+#define CONNECTOR_H
+
+#include "Resolver.h"
+
+class HttpError;
+
+class Connector
+{
+public:
+
+  // Delay before starting the next attempt (RFC 8305 recommends 250ms).
+  static const int ConnectionAttemptDelay = 250;
+
+
+  // Connect to port on the first address that answers.
+  // timeoutMs limits the whole operation (-1 leaves it to the kernel).
+  // Return the connected socket, which is left in non-blocking mode.
+  // Return -1, with error set, if no address could be reached.
+  static int connect(const SocketAddressList &addresses, int port, int timeoutMs, HttpError &error);
+
+  // Order addresses for racing: keep the preferred family first and
+  // alternate between families after that.
+  static SocketAddressList interleave(const SocketAddressList &addresses);
+};
+
+#endif
@@ -0,0 +1,181 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Streaming decompression of a response body (Content-Encoding).
+
+#include "ContentDecoder.h"
+
+#include "HttpException.h"
+
+#include <cstring>
+#include <strings.h>
+
+
+//-----------------------------------------------------------------------------
+ContentDecoder::Encoding ContentDecoder::encoding(const char *contentEncoding)
+{
+  if (!contentEncoding)
+  {
+    return Identity;
+  }
+
+  if (0 == strcasecmp(contentEncoding, "gzip") ||
+      0 == strcasecmp(contentEncoding, "x-gzip"))
+  {
+    return Gzip;
+  }
+
+  if (0 == strcasecmp(contentEncoding, "deflate"))
+  {
+    return Deflate;
+  }
+
+  return Identity;
+}
+
+
+//-----------------------------------------------------------------------------
+ContentDecoder::ContentDecoder(Encoding encoding) :
+  _encoding(encoding),
+  _initialized(false),
+  _started(false),
+  _finished(false),
+  _full(false)
+{
+  memset(&_stream, 0, sizeof(_stream));
+}
+
+
+//-----------------------------------------------------------------------------
+ContentDecoder::~ContentDecoder()
+{
+  if (_initialized)
+  {
+    inflateEnd(&_stream);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void ContentDecoder::reset(Encoding encoding)
+{
+  _encoding = encoding;
+  _started = false;
+  _finished = false;
+  _full = false;
+
+  _stream.avail_in = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+bool ContentDecoder::input(const unsigned char *data, int sizeOfData, HttpError &error)
+{
+  if (_finished || sizeOfData <= 0)
+  {
+    return true;
+  }
+
+  if (!_started && !start(data, sizeOfData, error))
+  {
+    return false;
+  }
+
+  _stream.next_in = (Bytef*)data;
+  _stream.avail_in = sizeOfData;
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+int ContentDecoder::output(const unsigned char *&data, HttpError &error)
+{
+  data = _buffer;
+
+  // A full buffer last time means inflate may still hold more output.
+  while (!_finished && (_stream.avail_in > 0 || _full))
+  {
+    _stream.next_out = _buffer;
+    _stream.avail_out = BufferSize;
+
+    int r = inflate(&_stream, Z_NO_FLUSH);
+
+    if (r == Z_STREAM_END)
+    {
+      // Anything after the end of the stream is ignored.
+      _finished = true;
+      _stream.avail_in = 0;
+    }
+    else if (r != Z_OK && r != Z_BUF_ERROR)
+    {
+      error.set(HttpError::Protocol, "Invalid %s data: %s",
+        (_encoding == Gzip) ? "gzip" : "deflate",
+        _stream.msg ? _stream.msg : "inflate() failed");
+
+      return -1;
+    }
+
+    int produced = BufferSize - _stream.avail_out;
+
+    _full = (_stream.avail_out == 0);
+
+    if (produced > 0)
+    {
+      return produced;
+    }
+
+    if (r == Z_BUF_ERROR)
+    {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// "deflate" should be zlib wrapped, but some servers send raw deflate data.
+// Tell them apart by the zlib header in the first two bytes.
+bool ContentDecoder::start(const unsigned char *data, int sizeOfData, HttpError &error)
+{
+  int windowBits = 15 + 16;
+
+  if (_encoding == Deflate)
+  {
+    windowBits = 15;
+
+    if (sizeOfData < 2 ||
+        (data[0] & 0x0f) != Z_DEFLATED ||
+        ((data[0] << 8) | data[1]) % 31 != 0)
+    {
+      windowBits = -15;
+    }
+  }
+
+  int r;
+
+  if (_initialized)
+  {
+    r = inflateReset2(&_stream, windowBits);
+  }
+  else
+  {
+    r = inflateInit2(&_stream, windowBits);
+    _initialized = (r == Z_OK);
+  }
+
+  if (r != Z_OK)
+  {
+    return error.set(HttpError::System, "inflateInit2(): %s",
+      _stream.msg ? _stream.msg : "failed");
+  }
+
+  _started = true;
+
+  return true;
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Streaming decompression of a response body (Content-Encoding).
+//
+// Compressed data is fed in as it arrives and decompressed into a fixed
+// size buffer, so memory use doesn't depend on the size of the body.
+//
+// Basic Usage:
+//
+//   decoder.input(data, sizeOfData, error);
+//
+//   const unsigned char *out;
+//   int sizeOfOut;
+//
+//   while ((sizeOfOut = decoder.output(out, error)) > 0)
+//   {
+//     ...use out...
+//   }
+//
+//   if (sizeOfOut < 0) ...invalid data, see error...
+//
+
+#ifndef CONTENT_DECODER_H
+#define CONTENT_DECODER_H
+
+#include <zlib.h>
+
+class HttpError;
+
+class ContentDecoder
+{
+public:
+
+  static const int BufferSize = 16384;
+
+  enum Encoding { Identity, Gzip, Deflate };
+
+  // Encoding named by a Content-Encoding header. Identity if it is
+  // missing or not supported.
+  static Encoding encoding(const char *contentEncoding);
+
+  explicit ContentDecoder(Encoding encoding);
+
+  ~ContentDecoder();
+
+  // Start over on a new body. The zlib state is reused.
+  void reset(Encoding encoding);
+
+  // Supply compressed data. It must stay valid until output() returns 0.
+  // Return false, with error set, if zlib can't be set up.
+  bool input(const unsigned char *data, int sizeOfData, HttpError &error);
+
+  // Decompress into the internal buffer. Return the number of bytes
+  // available at data, 0 when all input has been used, or -1 with error
+  // set if the data is invalid.
+  int output(const unsigned char *&data, HttpError &error);
+
+  // Has the end of the compressed stream been reached?
+  bool finished() const { return _finished; }
+
+
+private:
+
+  Encoding _encoding;
+  z_stream _stream;
+  bool _initialized; // _stream holds zlib state
+  bool _started;     // Input for the current body has been seen
+  bool _finished;
+  bool _full;        // The last output() filled the buffer
+
+  unsigned char _buffer[BufferSize];
+
+  bool start(const unsigned char *data, int sizeOfData, HttpError &error);
+
+  ContentDecoder(const ContentDecoder&);
+  ContentDecoder& operator=(const ContentDecoder&);
+};
+
+#endif
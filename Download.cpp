@@ -0,0 +1,843 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Download one large resource over several connections at once.
+
+#include "Download.h"
+
+#include "HttpException.h"
+#include "HttpRequest.h"
+#include "HttpStats.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+
+//-----------------------------------------------------------------------------
+// A connection fetching one segment at a time.
+class Download::Connection : public HttpRequest
+{
+public:
+
+  Connection(Download &download, const std::string &host, int port) :
+    HttpRequest(host.c_str(), port),
+    download(download),
+    segment(-1),
+    busy(false)
+  {
+  }
+
+  Download &download;
+  int segment; // Being fetched, -1 for the first request or none
+  bool busy;
+};
+
+
+
+
+//-----------------------------------------------------------------------------
+Download::Download(const char *host, int port, const char *url) :
+  _host(host),
+  _port(port),
+  _url(url),
+  _tls(false),
+  _connections(DefaultConnections),
+  _segmentSize(DefaultSegmentSize),
+  _fd(-1),
+  _receiveData(0),
+  _additionalParams(0),
+  _length(-1),
+  _ranges(false),
+  _probing(false),
+  _probeAttempts(0),
+  _complete(false),
+  _next(0),
+  _delivered(0),
+  _changed(false)
+{
+  _loop.initErrorHandler(requestError, this);
+}
+
+
+//-----------------------------------------------------------------------------
+Download::~Download()
+{
+  for (size_t i = 0; i < _pool.size(); i++)
+  {
+    delete _pool[i];
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void Download::setConnections(int connections)
+{
+  _connections = std::max(connections, 1);
+}
+
+
+//-----------------------------------------------------------------------------
+void Download::setSegmentSize(long long bytes)
+{
+  _segmentSize = std::max(bytes, 1LL);
+}
+
+
+//-----------------------------------------------------------------------------
+void Download::setFile(int fd, const char *progressPath)
+{
+  _fd = fd;
+  _progressPath.assign(progressPath ? progressPath : "");
+}
+
+
+//-----------------------------------------------------------------------------
+void Download::initCallbacks(DownloadData receiveData, void *additionalParams)
+{
+  _receiveData = receiveData;
+  _additionalParams = additionalParams;
+}
+
+
+//-----------------------------------------------------------------------------
+long long Download::received() const
+{
+  long long bytes = 0;
+
+  for (size_t i = 0; i < _segments.size(); i++)
+  {
+    bytes += _segments[i].received;
+  }
+
+  return bytes;
+}
+
+
+//-----------------------------------------------------------------------------
+bool Download::run(HttpError &error, int timeoutMs)
+{
+  if (_complete)
+    return true;
+
+  long long deadline = HttpStats::now() + timeoutMs * 1000000LL;
+
+  while ((int)_pool.size() < _connections)
+  {
+    Connection *connection = new Connection(*this, _host, _port);
+
+    connection->setTls(_tls);
+    connection->initCallbacks(headersReady, receiveData, responseComplete, connection);
+    _pool.push_back(connection);
+
+    if (!_loop.add(_error, *connection))
+    {
+      stop();
+      error = _error;
+      return false;
+    }
+  }
+
+  if (_segments.empty() && !_progressPath.empty())
+  {
+    loadProgress();
+  }
+
+  // A new run gets new attempts
+  _error.clear();
+  _probeAttempts = 0;
+
+  for (size_t i = 0; i < _segments.size(); i++)
+  {
+    _segments[i].attempts = 0;
+  }
+
+  while (true)
+  {
+    // The body has to be fetched again from the start.
+    if (_changed)
+    {
+      stop();
+
+      if (_fd < 0 && _delivered > 0)
+      {
+        _error.set(HttpError::Protocol, "Resource changed during download: %s", _url.c_str());
+      }
+      else
+      {
+        reset();
+      }
+    }
+
+    int busy = _error.failed() ? 0 : schedule();
+
+    if (_complete)
+      return true;
+
+    if (_error.failed())
+    {
+      stop();
+      error = _error;
+      return false;
+    }
+
+    // Every request failed to go out, try again. The attempts are counted,
+    // see start(), and schedule() fails when it can't start any.
+    if (busy == 0)
+      continue;
+
+    int waitMs = -1;
+
+    if (timeoutMs >= 0)
+    {
+      waitMs = (int)std::max((deadline - HttpStats::now()) / 1000000, 0LL);
+
+      if (waitMs == 0)
+      {
+        _error.set(HttpError::Timeout, "Download timed out: %s", _url.c_str());
+        continue;
+      }
+    }
+
+    // Failed requests go to requestError(), only the loop itself fails here.
+    if (_loop.run(error, waitMs) < 0)
+    {
+      stop();
+      return false;
+    }
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// Put idle connections to work: on the first request while the length
+// isn't known, then on the missing segments in order. Return the number of
+// connections at work.
+int Download::schedule()
+{
+  if (_probing)
+    return 1;
+
+  if (_segments.empty() && _length < 0)
+  {
+    if (_probeAttempts >= MaxAttempts)
+    {
+      _error.set(HttpError::Other, "Download failed: %s", _url.c_str());
+      return 0;
+    }
+
+    Connection &connection = *_pool[0];
+
+    _probing = true;
+    _probeAttempts++;
+
+    connection.busy = true;
+    connection.segment = -1;
+
+    send(connection, 0, _segmentSize);
+    return connection.busy ? 1 : 0;
+  }
+
+  // Skip what the callback already has
+  size_t first = (_fd < 0) ? _next : 0;
+  size_t limit = _segments.size();
+
+  if (_fd < 0)
+  {
+    limit = std::min(limit, first + SegmentsAhead * _connections);
+  }
+
+  bool done = true;
+  int started = 0;
+  size_t s = first;
+
+  for (int i = 0; i < _connections && !_error.failed(); i++)
+  {
+    Connection &connection = *_pool[i];
+
+    if (connection.busy)
+      continue;
+
+    while (s < limit && (_segments[s].active || (_segments[s].end >= 0 &&
+           _segments[s].received == _segments[s].end - _segments[s].start)))
+    {
+      s++;
+    }
+
+    if (s == limit)
+      break;
+
+    start(connection, s);
+    started++;
+  }
+
+  for (size_t i = first; i < _segments.size() && done; i++)
+  {
+    const Segment &segment = _segments[i];
+
+    done = (segment.end >= 0 && segment.received == segment.end - segment.start);
+  }
+
+  if (done && !_error.failed())
+  {
+    _complete = true;
+
+    if (!_progressPath.empty())
+    {
+      unlink(_progressPath.c_str());
+    }
+  }
+
+  int busy = 0;
+
+  for (int i = 0; i < _connections; i++)
+  {
+    busy += _pool[i]->busy ? 1 : 0;
+  }
+
+  // Nothing in flight and nothing left to ask for: run() would spin.
+  if (busy == 0 && started == 0 && !_complete && !_error.failed())
+  {
+    _error.set(HttpError::Other, "Download stalled with segments missing: %s", _url.c_str());
+  }
+
+  return busy;
+}
+
+
+//-----------------------------------------------------------------------------
+void Download::start(Connection &connection, int index)
+{
+  Segment &segment = _segments[index];
+
+  if (segment.attempts >= MaxAttempts)
+  {
+    _error.set(HttpError::Other, "Download failed %d times at %lld: %s",
+               segment.attempts, segment.start + segment.received, _url.c_str());
+    return;
+  }
+
+  // Without ranges a stream cut short starts over.
+  if (!_ranges && segment.received > 0)
+  {
+    if (_delivered > 0)
+    {
+      _error.set(HttpError::Protocol, "Download cut short, server doesn't support ranges: %s", _url.c_str());
+      return;
+    }
+
+    segment.received = 0;
+  }
+
+  segment.active = true;
+  segment.attempts++;
+
+  connection.busy = true;
+  connection.segment = index;
+
+  send(connection, segment.start + segment.received, segment.end);
+}
+
+
+//-----------------------------------------------------------------------------
+// GET bytes from up to (not including) to of the body, all of it without
+// ranges. -1 for to is up to the end.
+void Download::send(Connection &connection, long long from, long long to)
+{
+  HttpError error;
+
+  bool sent = connection.initRequest(error, "GET", _url.c_str());
+
+  if (sent && (_ranges || _probing))
+  {
+    char range[64];
+
+    if (to >= 0)
+    {
+      snprintf(range, sizeof(range), "bytes=%lld-%lld", from, to - 1);
+    }
+    else
+    {
+      snprintf(range, sizeof(range), "bytes=%lld-", from);
+    }
+
+    sent = connection.addHeader(error, "Range", range) &&
+           (_validator.empty() || connection.addHeader(error, "If-Range", _validator.c_str()));
+  }
+
+  if (!sent || !connection.sendHeaders(error))
+  {
+    connection.cleanUp();
+    failed(connection);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// Leave nothing in flight.
+void Download::stop()
+{
+  for (size_t i = 0; i < _pool.size(); i++)
+  {
+    _pool[i]->cleanUp();
+    _pool[i]->busy = false;
+    _pool[i]->segment = -1;
+  }
+
+  for (size_t i = 0; i < _segments.size(); i++)
+  {
+    _segments[i].active = false;
+  }
+
+  _probing = false;
+}
+
+
+//-----------------------------------------------------------------------------
+// Start over, the resource isn't what was fetched so far.
+void Download::reset()
+{
+  _length = -1;
+  _validator.clear();
+  _ranges = false;
+  _segments.clear();
+  _next = 0;
+  _delivered = 0;
+  _changed = false;
+
+  if (!_progressPath.empty())
+  {
+    unlink(_progressPath.c_str());
+  }
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Status of a response. Anything unexpected fails the response, see
+// HttpRequest::failResponse(), which passes the connection to failed().
+void Download::headers(Connection &connection, const HttpResponse &response)
+{
+  int status = response.getStatus();
+  const char *contentRange = response.getHeader(HeaderContentRange);
+
+  long long first = -1;
+  long long last = -1;
+  long long total = -1;
+
+  if (contentRange)
+  {
+    sscanf(contentRange, "bytes %lld-%lld/%lld", &first, &last, &total);
+  }
+
+  if (connection.segment < 0)
+  {
+    _probing = false;
+
+    // A weak ETag can't be used with If-Range
+    const char *etag = response.getHeader(HeaderETag);
+    const char *lastModified = response.getHeader(HeaderLastModified);
+
+    if (etag && 0 != strncmp(etag, "W/", 2))
+    {
+      _validator = etag;
+    }
+    else if (lastModified)
+    {
+      _validator = lastModified;
+    }
+
+    if (status == 206 && first == 0 && total >= 0)
+    {
+      _ranges = true;
+      split(total);
+    }
+    else if (status == 200)
+    {
+      // The one segment is the whole body. Without a Content-Length (-1) it
+      // ends with the response.
+      _ranges = false;
+      _length = response.getContentLength();
+
+      if (_length < 0 && response.getHeader(HeaderContentLength))
+      {
+        _error.set(HttpError::Protocol, "Download of %s: invalid Content-Length", _url.c_str());
+
+        connection.failResponse(&response, "%s", _error.message());
+        return;
+      }
+
+      Segment segment = { 0, _length, 0, 0, false, std::string() };
+      _segments.push_back(segment);
+    }
+    else
+    {
+      _error.set(HttpError::Protocol, "Download of %s: HTTP %d %s", _url.c_str(),
+                 status, response.getReason());
+
+      connection.failResponse(&response, "%s", _error.message());
+      return;
+    }
+
+    if (!truncateFile())
+    {
+      connection.failResponse(&response, "%s", _error.message());
+      return;
+    }
+
+    if (_segments.empty())
+      return; // Nothing to fetch
+
+    connection.segment = 0;
+    _segments[0].active = true;
+    _segments[0].attempts = 1;
+    return;
+  }
+
+  const Segment &segment = _segments[connection.segment];
+
+  if (_ranges && status == 200)
+  {
+    _changed = true;
+    connection.failResponse(&response, "Resource changed during download: %s", _url.c_str());
+    return;
+  }
+
+  if (_ranges && (status != 206 || first != segment.start + segment.received || total != _length))
+  {
+    _error.set(HttpError::Protocol, "Download of %s: HTTP %d, range %s", _url.c_str(),
+               status, contentRange ? contentRange : "-");
+
+    connection.failResponse(&response, "%s", _error.message());
+    return;
+  }
+
+  if (!_ranges && status != 200)
+  {
+    connection.failResponse(&response, "Download of %s: HTTP %d", _url.c_str(), status);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void Download::data(Connection &connection, const HttpResponse &response,
+                    const unsigned char *data, int sizeOfData)
+{
+  Segment &segment = _segments[connection.segment];
+  long long offset = segment.start + segment.received;
+
+  if (segment.end >= 0 && offset + sizeOfData > segment.end)
+  {
+    connection.failResponse(&response, "Download of %s: more data than asked for", _url.c_str());
+    return;
+  }
+
+  if (_fd >= 0)
+  {
+    while (sizeOfData > 0)
+    {
+      ssize_t written = pwrite(_fd, data, sizeOfData, offset);
+
+      if (written < 0 && errno == EINTR)
+        continue;
+
+      if (written <= 0)
+      {
+        _error.set(HttpError::System, "pwrite(): %s", strerror(errno));
+        connection.failResponse(&response, "%s", _error.message());
+        return;
+      }
+
+      data += written;
+      sizeOfData -= written;
+      offset += written;
+      segment.received += written;
+    }
+
+    return;
+  }
+
+  if (connection.segment == _next)
+  {
+    deliver(offset, data, sizeOfData);
+  }
+  else
+  {
+    segment.buffer.append((const char*)data, sizeOfData);
+  }
+
+  segment.received += sizeOfData;
+}
+
+
+//-----------------------------------------------------------------------------
+void Download::finished(Connection &connection)
+{
+  int index = connection.segment;
+
+  connection.busy = false;
+  connection.segment = -1;
+
+  if (index < 0)
+    return;
+
+  Segment &segment = _segments[index];
+
+  segment.active = false;
+
+  // Without a length the body ends with the response.
+  if (segment.end < 0)
+  {
+    segment.end = segment.start + segment.received;
+    _length = segment.end;
+
+    truncateFile();
+  }
+
+  // Cut short: the rest is asked for by schedule().
+  if (segment.received < segment.end - segment.start)
+    return;
+
+  if (_fd >= 0)
+  {
+    saveProgress();
+  }
+  else
+  {
+    flush();
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// The request of connection failed, the segment is tried again by
+// schedule().
+void Download::failed(Connection &connection)
+{
+  if (connection.segment >= 0)
+  {
+    _segments[connection.segment].active = false;
+  }
+
+  if (connection.segment < 0 && _probing)
+  {
+    _probing = false;
+  }
+
+  connection.busy = false;
+  connection.segment = -1;
+}
+
+
+//-----------------------------------------------------------------------------
+// Segments of the body, now that its length is known.
+void Download::split(long long length)
+{
+  _length = length;
+  _segments.clear();
+
+  for (long long start = 0; start < length; start += _segmentSize)
+  {
+    Segment segment = { start, std::min(start + _segmentSize, length), 0, 0, false, std::string() };
+    _segments.push_back(segment);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// Cut the file to the length of the body, once it is known. The file may
+// hold an older, longer copy. Return false if that failed.
+bool Download::truncateFile()
+{
+  if (_fd < 0 || _length < 0)
+    return true;
+
+  if (ftruncate(_fd, _length) < 0)
+  {
+    return _error.set(HttpError::System, "ftruncate(): %s", strerror(errno));
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+void Download::deliver(long long offset, const unsigned char *data, int sizeOfData)
+{
+  _delivered += sizeOfData;
+
+  if (_receiveData)
+  {
+    (_receiveData)(_additionalParams, offset, data, sizeOfData);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// Pass on the segments whose turn has come: those received ahead of it, and
+// the start of the one now first.
+void Download::flush()
+{
+  while (_next < (int)_segments.size())
+  {
+    Segment &segment = _segments[_next];
+
+    if (!segment.buffer.empty())
+    {
+      deliver(segment.start, (const unsigned char*)segment.buffer.data(), segment.buffer.size());
+      std::string().swap(segment.buffer);
+    }
+
+    if (segment.end < 0 || segment.received < segment.end - segment.start)
+      break;
+
+    _next++;
+  }
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Progress file: the url, the length and segment size, the validator, then
+// the numbers of the completed segments.
+bool Download::loadProgress()
+{
+  FILE *file = fopen(_progressPath.c_str(), "r");
+
+  if (!file)
+    return false;
+
+  char url[4096];
+  char validator[1024];
+  long long length = -1;
+  long long segmentSize = 0;
+
+  bool valid = fgets(url, sizeof(url), file) &&
+               fscanf(file, "%lld %lld\n", &length, &segmentSize) == 2 &&
+               fgets(validator, sizeof(validator), file);
+
+  url[strcspn(url, "\n")] = '\0';
+
+  if (!valid || _url != url || length < 0 || segmentSize <= 0)
+  {
+    fclose(file);
+    return false;
+  }
+
+  validator[strcspn(validator, "\n")] = '\0';
+
+  _segmentSize = segmentSize;
+  _validator = validator;
+  _ranges = true;
+  split(length);
+
+  int index;
+
+  while (fscanf(file, "%d", &index) == 1)
+  {
+    if (index >= 0 && index < (int)_segments.size())
+    {
+      _segments[index].received = _segments[index].end - _segments[index].start;
+    }
+  }
+
+  fclose(file);
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Record the completed segments, once their data is on disk. Written aside
+// and renamed, so that a crash leaves the old or the new one.
+void Download::saveProgress()
+{
+  if (_progressPath.empty() || !_ranges)
+    return;
+
+  if (fdatasync(_fd) != 0)
+    return;
+
+  std::string newPath = _progressPath + ".new";
+  FILE *file = fopen(newPath.c_str(), "w");
+
+  if (!file)
+    return;
+
+  fprintf(file, "%s\n%lld %lld\n%s\n", _url.c_str(), _length, _segmentSize, _validator.c_str());
+
+  for (size_t i = 0; i < _segments.size(); i++)
+  {
+    if (_segments[i].received == _segments[i].end - _segments[i].start)
+    {
+      fprintf(file, "%d\n", (int)i);
+    }
+  }
+
+  bool written = (fflush(file) == 0 && fsync(fileno(file)) == 0);
+
+  fclose(file);
+
+  if (!written || rename(newPath.c_str(), _progressPath.c_str()) != 0)
+  {
+    unlink(newPath.c_str());
+  }
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+void Download::headersReady(const HttpResponse *response, void *connection)
+{
+  Connection *c = (Connection*)connection;
+  c->download.headers(*c, *response);
+}
+
+
+//-----------------------------------------------------------------------------
+void Download::receiveData(const HttpResponse *response, void *connection,
+                           const unsigned char *data, int sizeOfData)
+{
+  Connection *c = (Connection*)connection;
+  c->download.data(*c, *response, data, sizeOfData);
+}
+
+
+//-----------------------------------------------------------------------------
+void Download::responseComplete(const HttpResponse*, void *connection)
+{
+  Connection *c = (Connection*)connection;
+  c->download.finished(*c);
+}
+
+
+//-----------------------------------------------------------------------------
+void Download::requestError(HttpRequest *request, const HttpException&, void *download)
+{
+  ((Download*)download)->failed(*(Connection*)request);
+}
+
+
+
+
+#ifndef HTTP_NO_EXCEPTIONS
+
+//-----------------------------------------------------------------------------
+void Download::run(int timeoutMs)
+{
+  HttpError error;
+
+  if (!run(error, timeoutMs))
+  {
+    throw HttpException(error);
+  }
+}
+
+#endif
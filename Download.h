@@ -0,0 +1,189 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Download one large resource over several connections at once.
+//
+// The first request is a GET for the first segment of the body (Range).
+// If the server answers 206 Partial Content, the length it gives is split
+// into segments that the connections fetch side by side, each taking the
+// next one missing as it finishes. If it answers 200, ranges aren't
+// supported and the body comes over that one connection.
+//
+// A segment cut short by a failed connection is asked for again from where
+// it stopped, up to MaxAttempts times. If run() fails, calling it again
+// fetches only what is still missing. With a progress file the completed
+// segments are remembered across restarts too. Requests carry If-Range with
+// the ETag (or Last-Modified) of the first response, so a resource that
+// changed in the meantime is started over rather than pieced together.
+//
+// The body goes either to a file, written in place with pwrite() in
+// whatever order segments arrive, or to a callback that gets it in order.
+// Segments received ahead of their turn are then held in memory, so they
+// are only fetched a few ahead of the one being passed on.
+//
+// Basic Usage:
+//
+//   int fd = open("firmware.bin", O_WRONLY | O_CREAT, 0644);
+//
+//   Download download("www.hyperceptive.org", 80, "/firmware.bin");
+//   download.setFile(fd, "firmware.bin.progress");
+//   download.run(60000);
+//
+
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#include "EventLoop.h"
+#include "HttpException.h"
+
+#include <string>
+#include <vector>
+
+class HttpResponse;
+
+
+// Prototype for callback that gets the body in order. offset is where data
+// starts in the body.
+typedef void (*DownloadData)(void *additionalParams, long long offset,
+                             const unsigned char *data, int sizeOfData);
+
+
+class Download
+{
+public:
+
+  static const int DefaultConnections = 4;
+  static const long long DefaultSegmentSize = 1 << 20;
+
+  // Times a segment is asked for before run() gives up.
+  static const int MaxAttempts = 3;
+
+  // Segments fetched ahead of the one being passed to the callback, per
+  // connection.
+  static const int SegmentsAhead = 2;
+
+
+  Download(const char *host, int port, const char *url);
+
+  ~Download();
+
+  // Connections used at once. Takes effect with the next run().
+  void setConnections(int connections);
+
+  // Size of a segment. Takes effect before the length is known.
+  void setSegmentSize(long long bytes);
+
+  // Connect with TLS (https), see HttpRequest::setTls().
+  void setTls(bool tls) { _tls = tls; }
+
+  // Write the body to fd at its offset in the body. With progressPath the
+  // completed segments are recorded there (after the data is flushed to
+  // disk), so that a Download of the same url and file in a later run
+  // fetches only the rest. The file is removed when the body is complete.
+  // fd is cut to the length of the body, so it is opened without O_TRUNC,
+  // which would lose what a resume needs.
+  void setFile(int fd, const char *progressPath = 0);
+
+  // Pass the body, in order, to receiveData instead.
+  void initCallbacks(DownloadData receiveData, void *additionalParams);
+
+  // Fetch what is missing of the body, waiting up to timeoutMs (-1 waits
+  // forever). Return false, with error set, on a status other than 200 or
+  // 206, when a segment failed MaxAttempts times, or at the timeout.
+  bool run(HttpError &error, int timeoutMs = -1);
+
+#ifndef HTTP_NO_EXCEPTIONS
+  // The same, throwing HttpException.
+  void run(int timeoutMs = -1);
+#endif
+
+  // Length of the body, -1 until known (or if the server doesn't say).
+  long long length() const { return _length; }
+
+  // Bytes of the body received so far, those of earlier runs included.
+  long long received() const;
+
+  // Did the server answer the first request with 206?
+  bool rangesSupported() const { return _ranges; }
+
+  bool complete() const { return _complete; }
+
+
+private:
+
+  class Connection;
+
+  struct Segment
+  {
+    long long start;
+    long long end;      // Past the last byte, -1 if the length is unknown
+    long long received; // From start
+    int attempts;
+    bool active;        // Being fetched
+    std::string buffer; // Received ahead of its turn, for the callback
+  };
+
+  std::string _host;
+  int _port;
+  std::string _url;
+  bool _tls;
+
+  int _connections;
+  long long _segmentSize;
+
+  int _fd;
+  std::string _progressPath;
+
+  DownloadData _receiveData;
+  void *_additionalParams;
+
+  long long _length;
+  std::string _validator; // For If-Range, "" if none
+  bool _ranges;
+  bool _probing;  // First request out, length not known yet
+  int _probeAttempts;
+  bool _complete;
+
+  std::vector<Segment> _segments;
+  int _next;            // First segment not passed on to the callback
+  long long _delivered; // Passed on to the callback
+
+  std::vector<Connection*> _pool;
+  EventLoop _loop;
+
+  HttpError _error;     // Set when run() has to give up
+  bool _changed;        // The resource changed, start over
+
+  int schedule();
+  void start(Connection &connection, int index);
+  void send(Connection &connection, long long from, long long to);
+  void stop();
+  void reset();
+
+  // Called by the Connection callbacks
+  void headers(Connection &connection, const HttpResponse &response);
+  void data(Connection &connection, const HttpResponse &response,
+            const unsigned char *data, int sizeOfData);
+  void finished(Connection &connection);
+  void failed(Connection &connection);
+
+  void split(long long length);
+  bool truncateFile();
+  void deliver(long long offset, const unsigned char *data, int sizeOfData);
+  void flush();
+
+  bool loadProgress();
+  void saveProgress();
+
+  static void headersReady(const HttpResponse *response, void *connection);
+  static void receiveData(const HttpResponse *response, void *connection,
+                          const unsigned char *data, int sizeOfData);
+  static void responseComplete(const HttpResponse *response, void *connection);
+  static void requestError(HttpRequest *request, const HttpException &e, void *download);
+
+  Download(const Download&);
+  Download& operator=(const Download&);
+};
+
+#endif
@@ -0,0 +1,438 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Drive many HttpRequest connections from a single thread.
+
+#include "EventLoop.h"
+
+#include "ConnectionPool.h"
+#include "HttpRequest.h"
+#include "HttpException.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+//-----------------------------------------------------------------------------
+EventLoop::EventLoop() :
+  _requestsPending(0),
+  _requestError(0),
+  _additionalParams(0),
+  _eventIndex(0),
+  _eventCount(0)
+{
+  _epoll = epoll_create1(EPOLL_CLOEXEC);
+  _wakeup = (_epoll < 0) ? -1 : eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  // Without exceptions, run() reports it.
+  if (_wakeup < 0)
+  {
+    _error.set(HttpError::System, "%s: %s", (_epoll < 0) ? "epoll_create1()" : "eventfd()", strerror(errno));
+
+    if (_epoll >= 0)
+    {
+      ::close(_epoll);
+      _epoll = -1;
+    }
+
+#ifndef HTTP_NO_EXCEPTIONS
+    throw HttpException(_error);
+#else
+    return;
+#endif
+  }
+
+  // Told apart from the requests by its data.ptr
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = &_wakeup;
+
+  epoll_ctl(_epoll, EPOLL_CTL_ADD, _wakeup, &ev);
+}
+
+
+//-----------------------------------------------------------------------------
+EventLoop::~EventLoop()
+{
+  while (!_requests.empty())
+  {
+    remove(**_requests.begin());
+  }
+
+  if (_epoll >= 0)
+  {
+    ::close(_wakeup);
+    ::close(_epoll);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+bool EventLoop::add(HttpError &error, HttpRequest &request)
+{
+  if (request._loop == this)
+  {
+    return true;
+  }
+
+  if (request._loop)
+  {
+    request._loop->remove(request);
+  }
+
+  moveTimers(request, _timers);
+
+  request._loop = this;
+  _requests.insert(&request);
+
+  if (request.responsesPending())
+  {
+    _requestsPending++;
+  }
+
+  return (request._socket < 0 || watch(request, error));
+}
+
+
+//-----------------------------------------------------------------------------
+void EventLoop::remove(HttpRequest &request)
+{
+  if (request._loop != this)
+  {
+    return;
+  }
+
+  if (request._socket >= 0)
+  {
+    unwatch(request);
+  }
+
+  if (request.responsesPending())
+  {
+    _requestsPending--;
+  }
+
+  _timedOut.erase(std::remove(_timedOut.begin(), _timedOut.end(), &request), _timedOut.end());
+
+  _requests.erase(&request);
+  request._loop = 0;
+
+  if (request.responsesPending())
+  {
+    moveTimers(request, request.timers());
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void EventLoop::initErrorHandler(RequestError requestError, void *additionalParams)
+{
+  _requestError = requestError;
+  _additionalParams = additionalParams;
+}
+
+
+//-----------------------------------------------------------------------------
+int EventLoop::run(HttpError &error, int timeoutMs)
+{
+  if (_epoll < 0)
+  {
+    error = _error;
+    return -1;
+  }
+
+  int next = _timers.nextTimeout();
+
+  if (next >= 0 && (timeoutMs < 0 || next < timeoutMs))
+  {
+    timeoutMs = next;
+  }
+
+  // Idle pooled connections expire while the loop waits, too.
+  next = ConnectionPool::instance().closeExpired();
+
+  if (next >= 0 && (timeoutMs < 0 || next < timeoutMs))
+  {
+    timeoutMs = next;
+  }
+
+  int n;
+
+  // The last run() stopped at a failed request. The sockets are edge
+  // triggered, so the rest of its events come first and won't come again.
+  if (_eventIndex + 1 < _eventCount)
+  {
+    _eventIndex++;
+    n = _eventCount - _eventIndex;
+  }
+  else
+  {
+    n = epoll_wait(_epoll, _events, MaxEvents, timeoutMs);
+
+    if (n < 0)
+    {
+      if (errno == EINTR) return 0;
+
+      error.set(HttpError::System, "epoll_wait(): %s", strerror(errno));
+      return -1;
+    }
+
+    _eventIndex = 0;
+    _eventCount = n;
+  }
+
+  for (; _eventIndex < _eventCount; _eventIndex++)
+  {
+    if (_events[_eventIndex].data.ptr == &_wakeup)
+    {
+      uint64_t count;
+      ssize_t r = ::read(_wakeup, &count, sizeof(count));
+      (void)r;
+      continue;
+    }
+
+    // Cleared by unwatch() if the request went away during this batch.
+    HttpRequest *request = (HttpRequest*)_events[_eventIndex].data.ptr;
+
+    if (!request) continue;
+
+    bool peerClosed = (_events[_eventIndex].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+
+    // The events after this one are kept for the next run().
+    if (!dispatch(*request, peerClosed, error))
+    {
+      return -1;
+    }
+  }
+
+  _eventCount = 0;
+
+  return expireRequests(error) ? n : -1;
+}
+
+
+//-----------------------------------------------------------------------------
+void EventLoop::wake()
+{
+  uint64_t one = 1;
+
+  // Only fails when the counter is full, which wakes the loop anyway.
+  ssize_t r = ::write(_wakeup, &one, sizeof(one));
+  (void)r;
+}
+
+
+//-----------------------------------------------------------------------------
+bool EventLoop::runUntilComplete(HttpError &error)
+{
+  while (responsesPending())
+  {
+    if (run(error) < 0)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Process the events of a request. Return false if it failed and there is
+// no error handler to take it: error says why.
+bool EventLoop::dispatch(HttpRequest &request, bool peerClosed, HttpError &error)
+{
+#ifndef HTTP_NO_EXCEPTIONS
+  // Thrown by a callback
+  try
+  {
+    if (request.processEvents(peerClosed)) return true;
+  }
+  catch (HttpException &e)
+  {
+    if (!_requestError)
+    {
+      throw;
+    }
+
+    request.cleanUp();
+    (_requestError)(&request, e, _additionalParams);
+    return true;
+  }
+#else
+  if (request.processEvents(peerClosed)) return true;
+#endif
+
+  return failed(request, error);
+}
+
+
+//-----------------------------------------------------------------------------
+// A request failed: clean it up (see HttpRequest::report()) and pass the
+// error to the error handler. Without one return false, with error set.
+bool EventLoop::failed(HttpRequest &request, HttpError &error)
+{
+  HttpError failure;
+  request.report(failure);
+
+  if (!_requestError)
+  {
+    error = failure;
+    return false;
+  }
+
+  (_requestError)(&request, HttpException(failure), _additionalParams);
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+bool EventLoop::watch(HttpRequest &request, HttpError &error)
+{
+  int flags = fcntl(request._socket, F_GETFL, 0);
+
+  if (flags < 0 || fcntl(request._socket, F_SETFL, flags | O_NONBLOCK) < 0)
+  {
+    return error.set(HttpError::System, "fcntl(): %s", strerror(errno));
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = &request;
+
+  if (epoll_ctl(_epoll, EPOLL_CTL_ADD, request._socket, &ev) < 0)
+  {
+    return error.set(HttpError::System, "epoll_ctl(): %s", strerror(errno));
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+void EventLoop::unwatch(HttpRequest &request)
+{
+  epoll_ctl(_epoll, EPOLL_CTL_DEL, request._socket, 0);
+
+  // Drop events for this request that run() has not dispatched yet.
+  for (int i = _eventIndex + 1; i < _eventCount; i++)
+  {
+    if (_events[i].data.ptr == &request)
+    {
+      _events[i].data.ptr = 0;
+    }
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void EventLoop::pendingChanged(bool pending)
+{
+  if (pending)
+  {
+    _requestsPending++;
+  }
+  else
+  {
+    _requestsPending--;
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// Reschedule the response deadlines of a request on another wheel.
+void EventLoop::moveTimers(HttpRequest &request, TimerWheel &timers)
+{
+  HttpResponse *response;
+
+  for (response = request._pendingResponses.front(); response; response = ResponseQueue::next(response))
+  {
+    TimerWheel::Timer &timer = *response;
+
+    if (timer.scheduled())
+    {
+      timers.schedule(timer, timer.remaining());
+    }
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+bool EventLoop::expireRequests(HttpError &error)
+{
+  _timers.advance();
+
+  while (!_timedOut.empty())
+  {
+    HttpRequest *request = _timedOut.back();
+    _timedOut.pop_back();
+
+    request->_timedOut = false;
+    request->fail(HttpError::Timeout, "Response timed out: %s:%d", request->_host.c_str(), request->_port);
+
+    if (!failed(*request, error))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+
+
+#ifndef HTTP_NO_EXCEPTIONS
+
+//-----------------------------------------------------------------------------
+void EventLoop::add(HttpRequest &request)
+{
+  HttpError error;
+
+  if (!add(error, request))
+  {
+    throw HttpException(error);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+int EventLoop::run(int timeoutMs)
+{
+  HttpError error;
+
+  int n = run(error, timeoutMs);
+
+  if (n < 0)
+  {
+    throw HttpException(error);
+  }
+
+  return n;
+}
+
+
+//-----------------------------------------------------------------------------
+void EventLoop::runUntilComplete()
+{
+  HttpError error;
+
+  if (!runUntilComplete(error))
+  {
+    throw HttpException(error);
+  }
+}
+
+#endif
@@ -0,0 +1,142 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Drive many HttpRequest connections from a single thread.
+//
+// Sockets of the registered requests are watched with epoll (edge-triggered)
+// and are switched to non-blocking mode. A request's pending responses are
+// only processed when its socket becomes readable, so waiting for many slow
+// servers costs no CPU.
+//
+// Basic Usage:
+//
+//   EventLoop loop;
+//
+//   HttpRequest a("www.hyperceptive.org", 80);
+//   HttpRequest b("codebones.com", 80);
+//   loop.add(a);
+//   loop.add(b);
+//
+//   a.sendRequest("GET", "/", 0, 0, 0);
+//   b.sendRequest("GET", "/", 0, 0, 0);
+//
+//   while(loop.responsesPending())
+//   {
+//     loop.run();
+//   }
+//
+// Without exceptions, run(error) returns -1 instead of throwing, unless an
+// error handler takes the failure.
+//
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "HttpException.h"
+#include "TimerWheel.h"
+
+#include <set>
+#include <vector>
+
+#include <sys/epoll.h>
+
+class HttpRequest;
+
+
+// Prototype for callback used to report a failed request.
+// The request has already been cleaned up when this is called.
+typedef void (*RequestError)(HttpRequest *request, const HttpException &e, void *additionalParams);
+
+
+class EventLoop
+{
+  friend class HttpRequest;
+
+public:
+
+  static const int MaxEvents = 256;
+
+
+  EventLoop();
+
+  ~EventLoop();
+
+  // Register a request with this loop. Its socket is watched as soon as it
+  // is connected (now, or later by sendRequest()). Return false, with error
+  // set, if it can't be watched.
+  bool add(HttpError &error, HttpRequest &request);
+
+  // Stop watching a request. Pending responses are left untouched.
+  void remove(HttpRequest &request);
+
+  // Called when processing a request fails.
+  // Without an error handler the error is passed on to the caller of run().
+  void initErrorHandler(RequestError requestError, void *additionalParams);
+
+  // Wait up to timeoutMs (-1 waits forever) for sockets to become readable
+  // and process the data on them. Response deadlines are checked on return,
+  // and idle connections of the ConnectionPool closed once they expire.
+  // Return the number of sockets serviced, -1 with error set if it failed.
+  // Sockets that were ready along with a failed one are serviced by the
+  // next run(), which doesn't wait then.
+  int run(HttpError &error, int timeoutMs = -1);
+
+  // Call run() until every registered request has received its responses.
+  bool runUntilComplete(HttpError &error);
+
+#ifndef HTTP_NO_EXCEPTIONS
+  // The calls above that throw HttpException instead.
+  void add(HttpRequest &request);
+  int run(int timeoutMs = -1);
+  void runUntilComplete();
+#endif
+
+  // Do any registered requests have responses pending?
+  bool responsesPending() const { return _requestsPending > 0; }
+
+  // Make run() return early. Unlike the rest of the class this may be
+  // called from any thread.
+  void wake();
+
+
+private:
+
+  int _epoll;
+  int _wakeup; // eventfd written by wake()
+
+  HttpError _error; // Why the constructor failed, see run()
+
+  std::set<HttpRequest*> _requests;
+
+  // Number of registered requests with responses pending
+  int _requestsPending;
+
+  RequestError _requestError;
+  void *_additionalParams;
+
+  // Response deadlines of all registered requests
+  TimerWheel _timers;
+  std::vector<HttpRequest*> _timedOut;
+
+  // Events currently being dispatched by run(). After a failed request
+  // those after _eventIndex are left for the next run().
+  struct epoll_event _events[MaxEvents];
+  int _eventIndex;
+  int _eventCount;
+
+  bool dispatch(HttpRequest &request, bool peerClosed, HttpError &error);
+  bool failed(HttpRequest &request, HttpError &error);
+
+  // Used by HttpRequest
+  bool watch(HttpRequest &request, HttpError &error);
+  void unwatch(HttpRequest &request);
+  void pendingChanged(bool pending);
+  void moveTimers(HttpRequest &request, TimerWheel &timers);
+  bool expireRequests(HttpError &error);
+
+  EventLoop(const EventLoop&);
+  EventLoop& operator=(const EventLoop&);
+};
+
+#endif
@@ -0,0 +1,696 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// HPACK header compression for HTTP/2 (RFC 7541).
+
+#include "Hpack.h"
+
+#include "HttpHeaders.h"
+
+#include <cstring>
+
+
+struct StaticEntry
+{
+  const char *name;
+  const char *value;
+};
+
+static const int StaticTableSize = 61;
+
+// RFC 7541, Appendix A
+static const StaticEntry StaticTable[StaticTableSize] =
+{
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" }
+};
+
+
+// RFC 7541, Appendix B. The code is canonical: codes of the same length
+// are consecutive, in symbol order. The 30 bit EOS code (all ones) is not
+// listed, it must never be decoded.
+static const unsigned int HuffmanCodes[256] =
+{
+  0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+  0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+  0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+  0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+  0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+  0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+  0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+  0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+  0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+  0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+  0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+  0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+  0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+  0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+  0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+  0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+  0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+  0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+  0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+  0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+  0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+  0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+  0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+  0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+  0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+  0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+  0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+  0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+  0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+  0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+  0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+  0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee
+};
+
+static const unsigned char HuffmanLengths[256] =
+{
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26
+};
+
+
+
+//-----------------------------------------------------------------------------
+// Integer with an N bit prefix (RFC 7541, 5.1). first holds the bits above
+// the prefix.
+static void encodeInteger(std::string &out, unsigned char first, int prefixBits, unsigned int value)
+{
+  unsigned int max = (1u << prefixBits) - 1;
+
+  if (value < max)
+  {
+    out += (char)(first | value);
+    return;
+  }
+
+  out += (char)(first | max);
+  value -= max;
+
+  while (value >= 128)
+  {
+    out += (char)((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+
+  out += (char)value;
+}
+
+
+//-----------------------------------------------------------------------------
+static bool decodeInteger(const unsigned char *&c, const unsigned char *end, int prefixBits, int &value)
+{
+  if (c >= end)
+  {
+    return false;
+  }
+
+  unsigned int max = (1u << prefixBits) - 1;
+  unsigned int v = *c++ & max;
+
+  if (v == max)
+  {
+    for (int shift = 0; ; shift += 7)
+    {
+      // Nothing here needs more than 28 bits
+      if (c >= end || shift > 21)
+      {
+        return false;
+      }
+
+      unsigned char b = *c++;
+      v += (unsigned int)(b & 0x7f) << shift;
+
+      if (!(b & 0x80)) break;
+    }
+  }
+
+  value = (int)v;
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// String literal (RFC 7541, 5.2), Huffman coded if that is shorter.
+static void encodeString(std::string &out, const char *data, int length)
+{
+  int huffmanLength = HpackHuffman::encodedLength(data, length);
+
+  if (huffmanLength < length)
+  {
+    encodeInteger(out, 0x80, 7, huffmanLength);
+    HpackHuffman::encode(out, data, length);
+  }
+  else
+  {
+    encodeInteger(out, 0, 7, length);
+    out.append(data, length);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+static bool decodeString(const unsigned char *&c, const unsigned char *end, std::string &out)
+{
+  if (c >= end)
+  {
+    return false;
+  }
+
+  bool huffman = (*c & 0x80) != 0;
+  int length;
+
+  if (!decodeInteger(c, end, 7, length) ||
+      length > end - c ||
+      length > HpackDecoder::MaxStringLength)
+  {
+    return false;
+  }
+
+  out.clear();
+
+  if (huffman)
+  {
+    if (!HpackHuffman::decode(out, c, length)) return false;
+  }
+  else
+  {
+    out.assign((const char*)c, length);
+  }
+
+  c += length;
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Static index of name with value, or 0. If only the name is found its
+// index is stored in nameIndex.
+static int findStatic(const char *name, int nameLength, const char *value, int valueLength, int &nameIndex)
+{
+  for (int i = 0; i < StaticTableSize; i++)
+  {
+    const StaticEntry &entry = StaticTable[i];
+
+    if (entry.name[0] != name[0] ||
+        strncmp(entry.name, name, nameLength) != 0 ||
+        entry.name[nameLength] != 0)
+    {
+      continue;
+    }
+
+    if (nameIndex == 0)
+    {
+      nameIndex = i + 1;
+    }
+
+    if (strncmp(entry.value, value, valueLength) == 0 && entry.value[valueLength] == 0)
+    {
+      return i + 1;
+    }
+  }
+
+  return 0;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+void HpackTable::add(const char *name, int nameLength, const char *value, int valueLength)
+{
+  int size = nameLength + valueLength + EntryOverhead;
+
+  // Too big for the table: it ends up empty (RFC 7541, 4.4).
+  if (size > _maxSize)
+  {
+    evict(0);
+    return;
+  }
+
+  evict(_maxSize - size);
+
+  _entries.push_front(Entry());
+  _entries.front().name.assign(name, nameLength);
+  _entries.front().value.assign(value, valueLength);
+
+  _size += size;
+}
+
+
+//-----------------------------------------------------------------------------
+void HpackTable::setMaxSize(int maxSize)
+{
+  _maxSize = maxSize;
+  evict(maxSize);
+}
+
+
+//-----------------------------------------------------------------------------
+int HpackTable::find(const char *name, int nameLength, const char *value, int valueLength, int &nameIndex) const
+{
+  for (int i = 0; i < (int)_entries.size(); i++)
+  {
+    const Entry &entry = _entries[i];
+
+    if ((int)entry.name.size() != nameLength ||
+        entry.name.compare(0, nameLength, name, nameLength) != 0)
+    {
+      continue;
+    }
+
+    if (nameIndex == 0)
+    {
+      nameIndex = i + 1;
+    }
+
+    if ((int)entry.value.size() == valueLength &&
+        entry.value.compare(0, valueLength, value, valueLength) == 0)
+    {
+      return i + 1;
+    }
+  }
+
+  return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+void HpackTable::evict(int maxSize)
+{
+  while (_size > maxSize && !_entries.empty())
+  {
+    const Entry &entry = _entries.back();
+
+    _size -= entry.name.size() + entry.value.size() + EntryOverhead;
+    _entries.pop_back();
+  }
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+void HpackEncoder::setMaxTableSize(int maxSize)
+{
+  // Never more than the default, no need for a bigger one.
+  if (maxSize > HpackTable::DefaultSize)
+  {
+    maxSize = HpackTable::DefaultSize;
+  }
+
+  if (maxSize != _table.maxSize())
+  {
+    _table.setMaxSize(maxSize);
+    _sizeUpdate = maxSize;
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void HpackEncoder::beginBlock(std::string &block)
+{
+  if (_sizeUpdate >= 0)
+  {
+    encodeInteger(block, 0x20, 5, _sizeUpdate);
+    _sizeUpdate = -1;
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void HpackEncoder::encode(std::string &block, const char *name, int nameLength, const char *value, int valueLength)
+{
+  _name.assign(name, nameLength);
+
+  for (size_t i = 0; i < _name.size(); i++)
+  {
+    if (_name[i] >= 'A' && _name[i] <= 'Z') _name[i] += 'a' - 'A';
+  }
+
+  name = _name.data();
+
+  // Credentials stay out of the tables, where they could be probed for
+  // (RFC 7541, 7.1.3).
+  bool sensitive = (_name == "authorization" ||
+                    _name == "proxy-authorization" ||
+                    (_name == "cookie" && valueLength < 20));
+
+  int nameIndex = 0;
+  int index = findStatic(name, nameLength, value, valueLength, nameIndex);
+
+  if (index == 0)
+  {
+    int dynamicName = 0;
+    int dynamic = _table.find(name, nameLength, value, valueLength, dynamicName);
+
+    if (dynamic)
+    {
+      index = StaticTableSize + dynamic;
+    }
+
+    if (nameIndex == 0 && dynamicName)
+    {
+      nameIndex = StaticTableSize + dynamicName;
+    }
+  }
+
+  if (index && !sensitive)
+  {
+    encodeInteger(block, 0x80, 7, index);
+    return;
+  }
+
+  // Values that change with every request would only push the others out.
+  bool indexing = !sensitive &&
+                  _name != ":path" &&
+                  _name != "content-length" &&
+                  nameLength + valueLength + HpackTable::EntryOverhead <= _table.maxSize() / 2;
+
+  if (indexing)
+  {
+    encodeInteger(block, 0x40, 6, nameIndex);
+  }
+  else
+  {
+    encodeInteger(block, sensitive ? 0x10 : 0x00, 4, nameIndex);
+  }
+
+  if (nameIndex == 0)
+  {
+    encodeString(block, name, nameLength);
+  }
+
+  encodeString(block, value, valueLength);
+
+  if (indexing)
+  {
+    _table.add(name, nameLength, value, valueLength);
+  }
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+bool HpackDecoder::decode(const unsigned char *data, int size, HttpHeaders &headers, int &status)
+{
+  const unsigned char *c = data;
+  const unsigned char *end = data + size;
+
+  while (c < end)
+  {
+    unsigned char b = *c;
+
+    int index = 0;
+    bool indexing = false;
+
+    if (b & 0x80)
+    {
+      // Indexed header field
+      if (!decodeInteger(c, end, 7, index) || index == 0) break;
+
+      if (index <= StaticTableSize)
+      {
+        const StaticEntry &entry = StaticTable[index - 1];
+        header(entry.name, strlen(entry.name), entry.value, strlen(entry.value), headers, status);
+      }
+      else if (index - StaticTableSize <= _table.count())
+      {
+        const std::string &name = _table.name(index - StaticTableSize);
+        const std::string &value = _table.value(index - StaticTableSize);
+
+        header(name.data(), name.size(), value.data(), value.size(), headers, status);
+      }
+      else
+      {
+        break;
+      }
+
+      continue;
+    }
+
+    if (b & 0x40)
+    {
+      // Literal with incremental indexing
+      indexing = true;
+      if (!decodeInteger(c, end, 6, index)) break;
+    }
+    else if (b & 0x20)
+    {
+      // Dynamic table size update
+      int maxSize;
+
+      if (!decodeInteger(c, end, 5, maxSize) || maxSize > MaxTableSize) break;
+
+      _table.setMaxSize(maxSize);
+      continue;
+    }
+    else
+    {
+      // Literal without indexing, or never indexed
+      if (!decodeInteger(c, end, 4, index)) break;
+    }
+
+    // Name: by index or literal
+    if (index == 0)
+    {
+      if (!decodeString(c, end, _name)) break;
+    }
+    else if (index <= StaticTableSize)
+    {
+      _name.assign(StaticTable[index - 1].name);
+    }
+    else if (index - StaticTableSize <= _table.count())
+    {
+      _name.assign(_table.name(index - StaticTableSize));
+    }
+    else
+    {
+      break;
+    }
+
+    if (!decodeString(c, end, _value)) break;
+
+    header(_name.data(), _name.size(), _value.data(), _value.size(), headers, status);
+
+    if (indexing)
+    {
+      _table.add(_name.data(), _name.size(), _value.data(), _value.size());
+    }
+  }
+
+  return (c == end);
+}
+
+
+//-----------------------------------------------------------------------------
+void HpackDecoder::header(const char *name, int nameLength, const char *value, int valueLength,
+                          HttpHeaders &headers, int &status)
+{
+  if (nameLength > 0 && name[0] == ':')
+  {
+    if (nameLength == 7 && 0 == memcmp(name, ":status", 7))
+    {
+      status = 0;
+
+      for (int i = 0; i < valueLength && value[i] >= '0' && value[i] <= '9'; i++)
+      {
+        status = status * 10 + (value[i] - '0');
+      }
+    }
+
+    return;
+  }
+
+  headers.add(name, nameLength, value, valueLength);
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+int HpackHuffman::encodedLength(const char *data, int length)
+{
+  int bits = 0;
+
+  for (int i = 0; i < length; i++)
+  {
+    bits += HuffmanLengths[(unsigned char)data[i]];
+  }
+
+  return (bits + 7) / 8;
+}
+
+
+//-----------------------------------------------------------------------------
+void HpackHuffman::encode(std::string &out, const char *data, int length)
+{
+  unsigned long long bits = 0;
+  int count = 0; // Bits in bits not yet written
+
+  for (int i = 0; i < length; i++)
+  {
+    unsigned char symbol = data[i];
+
+    bits = (bits << HuffmanLengths[symbol]) | HuffmanCodes[symbol];
+    count += HuffmanLengths[symbol];
+
+    while (count >= 8)
+    {
+      count -= 8;
+      out += (char)(bits >> count);
+    }
+  }
+
+  // Pad with the start of EOS (ones)
+  if (count > 0)
+  {
+    out += (char)((bits << (8 - count)) | (0xff >> count));
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// The first code of each length and where its symbols start in a list of
+// all symbols ordered by code.
+struct HuffmanDecoding
+{
+  unsigned int firstCode[31];
+  int firstSymbol[31];
+  int count[31];
+  unsigned char symbols[256];
+
+  HuffmanDecoding()
+  {
+    int n = 0;
+    unsigned int code = 0;
+
+    for (int length = 1; length <= 30; length++)
+    {
+      firstCode[length] = code;
+      firstSymbol[length] = n;
+      count[length] = 0;
+
+      for (int symbol = 0; symbol < 256; symbol++)
+      {
+        if (HuffmanLengths[symbol] == length)
+        {
+          symbols[n++] = symbol;
+          count[length]++;
+        }
+      }
+
+      code = (code + count[length]) << 1;
+    }
+  }
+};
+
+
+//-----------------------------------------------------------------------------
+bool HpackHuffman::decode(std::string &out, const unsigned char *data, int length)
+{
+  static const HuffmanDecoding decoding;
+
+  unsigned int code = 0;
+  int bits = 0; // Length of code
+
+  for (int i = 0; i < length; i++)
+  {
+    for (int bit = 7; bit >= 0; bit--)
+    {
+      code = (code << 1) | ((data[i] >> bit) & 1);
+      bits++;
+
+      if (code - decoding.firstCode[bits] < (unsigned int)decoding.count[bits])
+      {
+        out += (char)decoding.symbols[decoding.firstSymbol[bits] + code - decoding.firstCode[bits]];
+        code = 0;
+        bits = 0;
+      }
+      else if (bits == 30)
+      {
+        return false; // EOS, or no such code
+      }
+    }
+  }
+
+  // Padding: fewer than 8 bits, all ones
+  return (bits < 8 && code == (1u << bits) - 1);
+}
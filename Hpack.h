@@ -0,0 +1,152 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// HPACK header compression for HTTP/2 (RFC 7541).
+//
+// The encoder sends a header as an index when it is in the static or
+// dynamic table, and adds the rest to the dynamic table so the next
+// request can send them as an index too. Values are Huffman coded when
+// that makes them shorter. Credentials are never indexed.
+//
+// Basic Usage:
+//
+//   HpackEncoder encoder;
+//   std::string block;
+//   encoder.encode(block, ":method", 7, "GET", 3);
+//
+//   HpackDecoder decoder;
+//   decoder.decode(data, size, headers, status); // false on bad input
+//
+
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <deque>
+#include <string>
+
+class HttpHeaders;
+
+
+// Dynamic table, shared in shape by encoder and decoder.
+class HpackTable
+{
+public:
+
+  // Bytes counted for an entry on top of its name and value.
+  static const int EntryOverhead = 32;
+
+  // Default table size (SETTINGS_HEADER_TABLE_SIZE).
+  static const int DefaultSize = 4096;
+
+
+  HpackTable() : _size(0), _maxSize(DefaultSize) {}
+
+  int count() const { return (int)_entries.size(); }
+
+  // Entry by dynamic index, 1 is the newest.
+  const std::string& name(int index) const { return _entries[index - 1].name; }
+  const std::string& value(int index) const { return _entries[index - 1].value; }
+
+  void add(const char *name, int nameLength, const char *value, int valueLength);
+
+  void setMaxSize(int maxSize);
+  int maxSize() const { return _maxSize; }
+
+  // Dynamic index of name with value, or 0. If only the name is found its
+  // index is stored in nameIndex.
+  int find(const char *name, int nameLength, const char *value, int valueLength, int &nameIndex) const;
+
+
+private:
+
+  struct Entry
+  {
+    std::string name;
+    std::string value;
+  };
+
+  std::deque<Entry> _entries; // Newest first
+  int _size;
+  int _maxSize;
+
+  void evict(int maxSize);
+};
+
+
+class HpackEncoder
+{
+public:
+
+  HpackEncoder() : _sizeUpdate(-1) {}
+
+  // Table size allowed by the peer's SETTINGS_HEADER_TABLE_SIZE. The
+  // change is announced at the start of the next header block.
+  void setMaxTableSize(int maxSize);
+
+  // Append a header to a header block. Call beginBlock() first for each
+  // block. The name is lowercased.
+  void beginBlock(std::string &block);
+  void encode(std::string &block, const char *name, int nameLength, const char *value, int valueLength);
+
+
+private:
+
+  HpackTable _table;
+  int _sizeUpdate; // Pending table size update, -1 if none
+  std::string _name; // Lowercased name
+
+  HpackEncoder(const HpackEncoder&);
+  HpackEncoder& operator=(const HpackEncoder&);
+};
+
+
+class HpackDecoder
+{
+public:
+
+  // Limit on the table size the peer may use, as sent in our SETTINGS.
+  static const int MaxTableSize = HpackTable::DefaultSize;
+
+  // Longest header name or value accepted.
+  static const int MaxStringLength = 65536;
+
+
+  HpackDecoder() {}
+
+  // Decode a complete header block, adding the headers to headers. The
+  // ":status" pseudo-header goes to status, other pseudo-headers are
+  // dropped. Return false if the block is invalid, after which the
+  // connection can't be used.
+  bool decode(const unsigned char *data, int size, HttpHeaders &headers, int &status);
+
+
+private:
+
+  HpackTable _table;
+  std::string _name;  // Decoded strings
+  std::string _value;
+
+  void header(const char *name, int nameLength, const char *value, int valueLength,
+              HttpHeaders &headers, int &status);
+
+  HpackDecoder(const HpackDecoder&);
+  HpackDecoder& operator=(const HpackDecoder&);
+};
+
+
+// Huffman code of RFC 7541, Appendix B.
+class HpackHuffman
+{
+public:
+
+  // Bytes needed to encode data.
+  static int encodedLength(const char *data, int length);
+
+  static void encode(std::string &out, const char *data, int length);
+
+  // Append the decoded data to out. Return false if it is invalid.
+  static bool decode(std::string &out, const unsigned char *data, int length);
+};
+
+#endif
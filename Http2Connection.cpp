@@ -0,0 +1,936 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// HTTP/2 on the connection of an HttpRequest.
+
+#include "Http2Connection.h"
+
+#include "HttpRequest.h"
+#include "LineScanner.h"
+#include "RingBuffer.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include <strings.h>
+
+
+// Sent first on every connection (RFC 9113, 3.4)
+static const char Preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// SETTINGS identifiers
+static const int SettingsHeaderTableSize   = 0x1;
+static const int SettingsEnablePush        = 0x2;
+static const int SettingsMaxStreams        = 0x3;
+static const int SettingsInitialWindowSize = 0x4;
+static const int SettingsMaxFrameSize      = 0x5;
+
+// Largest header block accepted, CONTINUATION frames included.
+static const int MaxHeaderBlock = 262144;
+
+
+//-----------------------------------------------------------------------------
+static unsigned int read32(const unsigned char *data)
+{
+  return ((unsigned int)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+
+//-----------------------------------------------------------------------------
+static void write32(unsigned char *data, unsigned int value)
+{
+  data[0] = value >> 24;
+  data[1] = value >> 16;
+  data[2] = value >> 8;
+  data[3] = value;
+}
+
+
+//-----------------------------------------------------------------------------
+// Next "Name: value" line of an HTTP/1.1 request head, false at its end.
+static bool nextHeader(const char *&c, const char *end, StringRef &name, StringRef &value)
+{
+  const char *newline = LineScanner::find(c, end, '\n');
+  const char *lineEnd = newline;
+
+  if (lineEnd > c && lineEnd[-1] == '\r') lineEnd--;
+
+  if (lineEnd == c)
+  {
+    return false; // Empty line
+  }
+
+  const char *colon = LineScanner::find(c, lineEnd, ':');
+  const char *v = (colon < lineEnd) ? colon + 1 : lineEnd;
+
+  while (v < lineEnd && (*v == ' ' || *v == '\t')) { v++; }
+
+  name = StringRef(c, colon - c);
+  value = StringRef(v, lineEnd - v);
+
+  c = (newline < end) ? newline + 1 : end;
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+static bool equals(const StringRef &name, const char *other)
+{
+  return ((int)strlen(other) == name.size && 0 == strncasecmp(name.data, other, name.size));
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+Http2Connection::Http2Connection(HttpRequest &request) :
+  _request(request),
+  _nextStreamId(1),
+  _openStreams(0),
+  _maxStreams(1),
+  _maxFrameSize(DefaultFrameSize),
+  _initialWindow(DefaultWindow),
+  _sendWindow(DefaultWindow),
+  _recvUnacked(0),
+  _settingsReceived(false),
+  _goingAway(false),
+  _lastStreamId(MaxStreamId),
+  _unprocessed(0),
+  _headerStream(0),
+  _headerEndStream(false)
+{
+  // Preface and our SETTINGS go out with the first request.
+  _output.assign(Preface, sizeof(Preface) - 1);
+
+  unsigned char settings[12];
+
+  settings[0] = 0;
+  settings[1] = SettingsEnablePush;
+  write32(settings + 2, 0);
+
+  settings[6] = 0;
+  settings[7] = SettingsInitialWindowSize;
+  write32(settings + 8, StreamWindow);
+
+  frame(Settings, 0, 0, settings, sizeof(settings));
+
+  windowUpdate(0, ConnectionWindow - DefaultWindow);
+}
+
+
+//-----------------------------------------------------------------------------
+bool Http2Connection::canStartStream() const
+{
+  return (!_goingAway && _openStreams < _maxStreams && _nextStreamId <= MaxStreamId);
+}
+
+
+//-----------------------------------------------------------------------------
+// Open a stream for response with the request in head, an HTTP/1.1 request
+// line and headers. Queued, it goes out with the next flush(). Return the
+// stream ID, 0 if the headers are invalid.
+int Http2Connection::startStream(HttpResponse *response, const std::string &head)
+{
+  const char *c = head.data();
+  const char *end = c + head.size();
+
+  // Request line: method and path
+  const char *lineEnd = LineScanner::find(c, end, '\n');
+  const char *space = LineScanner::find(c, lineEnd, ' ');
+  const char *path = (space < lineEnd) ? space + 1 : lineEnd;
+  const char *pathEnd = LineScanner::find(path, lineEnd, ' ');
+
+  const char *headers = (lineEnd < end) ? lineEnd + 1 : end;
+
+  // First pass: what the pseudo-headers and the stream need
+  StringRef authority(_request._host.data(), _request._host.size());
+  long long contentLength = -1;
+  bool chunked = false;
+
+  StringRef name;
+  StringRef value;
+
+  for (c = headers; nextHeader(c, end, name, value); )
+  {
+    if (equals(name, "host"))
+    {
+      authority = value;
+    }
+    else if (equals(name, "content-length"))
+    {
+      if (!HttpHeaders::parseLength(value.data, value.size, contentLength))
+      {
+        // Nothing went out: drop the response, the connection is fine.
+        _request.fail(HttpError::Usage, "Invalid Content-Length: (%.*s)", (int)value.size, value.data);
+        _request.removeResponse(response);
+        return 0;
+      }
+    }
+    else if (equals(name, "transfer-encoding"))
+    {
+      chunked = true;
+    }
+  }
+
+  _block.clear();
+  _encoder.beginBlock(_block);
+
+  _encoder.encode(_block, ":method", 7, head.data(), space - head.data());
+  _encoder.encode(_block, ":scheme", 7, _request._tls ? "https" : "http", _request._tls ? 5 : 4);
+  _encoder.encode(_block, ":authority", 10, authority.data, authority.size);
+  _encoder.encode(_block, ":path", 5, path, pathEnd - path);
+
+  // Connection-specific headers have no place in HTTP/2 (RFC 9113, 8.2.2).
+  for (c = headers; nextHeader(c, end, name, value); )
+  {
+    if (equals(name, "host")              ||
+        equals(name, "connection")        ||
+        equals(name, "keep-alive")        ||
+        equals(name, "proxy-connection")  ||
+        equals(name, "transfer-encoding") ||
+        equals(name, "upgrade")           ||
+        (equals(name, "te") && !(value.size == 8 && 0 == strncasecmp(value.data, "trailers", 8))))
+    {
+      continue;
+    }
+
+    _encoder.encode(_block, name.data, name.size, value.data, value.size);
+  }
+
+  // A body of unknown length (chunked) ends with sendData(last).
+  response->_streamRemaining = chunked ? -1 : (contentLength > 0 ? contentLength : 0);
+  response->_streamId = _nextStreamId;
+  response->_streamWindow = _initialWindow;
+  response->_streamUnacked = 0;
+
+  addStream(response);
+
+  _nextStreamId += 2;
+  _openStreams++;
+
+  int flags = (response->_streamRemaining == 0) ? EndStream : 0;
+
+  // HEADERS, then CONTINUATION for what doesn't fit
+  int size = _block.size();
+  int offset = 0;
+
+  do
+  {
+    int length = std::min(size - offset, _maxFrameSize);
+    int endHeaders = (offset + length == size) ? EndHeaders : 0;
+
+    frame(offset == 0 ? Headers : Continuation,
+          (offset == 0 ? flags : 0) | endHeaders,
+          response->_streamId, _block.data() + offset, length);
+
+    offset += length;
+  }
+  while (offset < size);
+
+  return response->_streamId;
+}
+
+
+//-----------------------------------------------------------------------------
+// Send as much of the request body as the flow control windows allow, along
+// with anything queued. The stream ends with the Content-Length of the
+// request, or after the last data for one of unknown length. Return the
+// bytes sent, -1 if it failed.
+int Http2Connection::sendData(int streamId, const unsigned char *data, int size, bool last)
+{
+  HttpResponse *response = find(streamId);
+
+  if (!response)
+  {
+    // Response complete, the server wants no more
+    return flush() ? size : -1;
+  }
+
+  long long &remaining = response->_streamRemaining;
+
+  if (remaining >= 0 && size > remaining)
+  {
+    _request.fail(HttpError::Usage, "HTTP/2: request body longer than its Content-Length");
+    return -1;
+  }
+
+  int sent = 0;
+
+  while (remaining != 0)
+  {
+    int length = std::min(size - sent, _maxFrameSize);
+
+    length = std::min(length, std::min(_sendWindow, response->_streamWindow));
+
+    if (length < 0)
+    {
+      length = 0;
+    }
+
+    bool end = (remaining > 0) ? (remaining == length) : (last && sent + length == size);
+
+    // Window closed, or nothing to send
+    if (length == 0 && !end)
+    {
+      break;
+    }
+
+    frameHeader(Data, end ? EndStream : 0, streamId, length);
+
+    if (!_request.send((const unsigned char*)_output.data(), _output.size(), data + sent, length))
+    {
+      return -1;
+    }
+
+    _output.clear();
+
+    _sendWindow -= length;
+    response->_streamWindow -= length;
+    sent += length;
+
+    remaining = end ? 0 : (remaining > 0 ? remaining - length : -1);
+
+    if (sent == size)
+    {
+      break;
+    }
+  }
+
+  return flush() ? sent : -1;
+}
+
+
+//-----------------------------------------------------------------------------
+void Http2Connection::resetStream(int streamId, ErrorCode error)
+{
+  unsigned char payload[4];
+  write32(payload, error);
+
+  frame(RstStream, 0, streamId, payload, sizeof(payload));
+}
+
+
+//-----------------------------------------------------------------------------
+// Process the complete frames in buffer, leaving a partial one for later.
+// Return false if the connection failed.
+bool Http2Connection::process(RingBuffer &buffer)
+{
+  while (true)
+  {
+    const unsigned char *data;
+    int available = buffer.readable(data);
+
+    int length = FrameHeaderSize;
+
+    if (available >= FrameHeaderSize)
+    {
+      length += (data[0] << 16) | (data[1] << 8) | data[2];
+
+      if (length - FrameHeaderSize > DefaultFrameSize)
+      {
+        return error(FrameSizeError, "frame larger than SETTINGS_MAX_FRAME_SIZE");
+      }
+    }
+
+    if (available < length)
+    {
+      // The frame wraps around the end of the buffer, or isn't all here.
+      if (buffer.size() > available)
+      {
+        buffer.linearize();
+        continue;
+      }
+
+      break;
+    }
+
+    int streamId = read32(data + 5) & MaxStreamId;
+
+    if (!processFrame(data[3], data[4], streamId, data + FrameHeaderSize, length - FrameHeaderSize))
+    {
+      return false;
+    }
+
+    buffer.consume(length);
+  }
+
+  // After a GOAWAY, give up once only the unprocessed streams are left.
+  if (_unprocessed > 0 && _openStreams == _unprocessed)
+  {
+    return _request.fail(HttpError::Closed, "HTTP/2 connection closed by server: %d streams not processed",
+                         _unprocessed);
+  }
+
+  // Acknowledgements and window updates
+  return flush();
+}
+
+
+//-----------------------------------------------------------------------------
+bool Http2Connection::flush()
+{
+  if (_output.empty()) return true;
+
+  if (!_request.send((const unsigned char*)_output.data(), _output.size(), 0, 0))
+  {
+    return false;
+  }
+
+  _output.clear();
+
+  return true;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Queue a frame.
+void Http2Connection::frame(FrameType type, int flags, int streamId, const void *payload, int length)
+{
+  frameHeader(type, flags, streamId, length);
+
+  _output.append((const char*)payload, length);
+}
+
+
+//-----------------------------------------------------------------------------
+void Http2Connection::frameHeader(FrameType type, int flags, int streamId, int length)
+{
+  unsigned char header[FrameHeaderSize];
+
+  header[0] = length >> 16;
+  header[1] = length >> 8;
+  header[2] = length;
+  header[3] = type;
+  header[4] = flags;
+  write32(header + 5, streamId);
+
+  _output.append((const char*)header, sizeof(header));
+}
+
+
+//-----------------------------------------------------------------------------
+void Http2Connection::windowUpdate(int streamId, int increment)
+{
+  unsigned char payload[4];
+  write32(payload, increment);
+
+  frame(WindowUpdate, 0, streamId, payload, sizeof(payload));
+}
+
+
+//-----------------------------------------------------------------------------
+bool Http2Connection::processFrame(int type, int flags, int streamId, const unsigned char *payload, int length)
+{
+  if (_headerStream && type != Continuation)
+  {
+    return error(ProtocolError, "header block not continued");
+  }
+
+  switch (type)
+  {
+    case Data:
+      return processData(flags, streamId, payload, length);
+
+    case Headers:
+      return processHeaders(flags, streamId, payload, length);
+
+    case Continuation:
+      if (streamId == 0 || streamId != _headerStream)
+      {
+        return error(ProtocolError, "unexpected CONTINUATION");
+      }
+
+      if (_headerBlock.size() + length > (size_t)MaxHeaderBlock)
+      {
+        return error(ProtocolError, "header block too large");
+      }
+
+      _headerBlock.append((const char*)payload, length);
+
+      if (flags & EndHeaders)
+      {
+        _headerStream = 0;
+        return headerBlockDone(streamId, _headerEndStream);
+      }
+      break;
+
+    case RstStream:
+      if (length != 4)
+      {
+        return error(FrameSizeError, "RST_STREAM");
+      }
+
+      // Streams already complete are closed on our side and not found.
+      // Unprocessed streams after a GOAWAY wait for the others.
+      if (find(streamId) && streamId <= _lastStreamId)
+      {
+        return _request.fail(HttpError::Closed, "HTTP/2 stream %d reset by server: error %u",
+                             streamId, read32(payload));
+      }
+      break;
+
+    case Settings:
+      if (streamId != 0)
+      {
+        return error(ProtocolError, "SETTINGS on a stream");
+      }
+
+      return processSettings(flags, payload, length);
+
+    case PushPromise:
+      return error(ProtocolError, "PUSH_PROMISE with push disabled");
+
+    case Ping:
+      if (length != 8)
+      {
+        return error(FrameSizeError, "PING");
+      }
+
+      if (!(flags & Ack))
+      {
+        frame(Ping, Ack, 0, payload, length);
+      }
+      break;
+
+    case GoAway:
+      return processGoAway(payload, length);
+
+    case WindowUpdate:
+      return processWindowUpdate(streamId, payload, length);
+
+    default:
+      break; // PRIORITY, and unknown frames are ignored
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+bool Http2Connection::processData(int flags, int streamId, const unsigned char *payload, int length)
+{
+  if (streamId == 0)
+  {
+    return error(ProtocolError, "DATA on stream 0");
+  }
+
+  // Padding counts against the windows too.
+  int received = length;
+
+  if (flags & Padded)
+  {
+    if (length < 1 || payload[0] >= length)
+    {
+      return error(ProtocolError, "invalid padding");
+    }
+
+    length -= 1 + payload[0];
+    payload++;
+  }
+
+  _recvUnacked += received;
+
+  HttpResponse *response = find(streamId);
+
+  if (response)
+  {
+    response->_streamUnacked += received;
+
+    response->dataReceived(payload, length);
+
+    if ((flags & EndStream) && !response->failed())
+    {
+      response->endOfStream();
+    }
+
+    if (response->failed())
+    {
+      return false;
+    }
+
+    if (response->completed())
+    {
+      closeStream(response);
+    }
+    else if (response->_streamUnacked >= StreamWindow / 2)
+    {
+      windowUpdate(streamId, response->_streamUnacked);
+      response->_streamUnacked = 0;
+    }
+  }
+
+  if (_recvUnacked >= ConnectionWindow / 2)
+  {
+    windowUpdate(0, _recvUnacked);
+    _recvUnacked = 0;
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+bool Http2Connection::processHeaders(int flags, int streamId, const unsigned char *payload, int length)
+{
+  if (streamId == 0)
+  {
+    return error(ProtocolError, "HEADERS on stream 0");
+  }
+
+  if (flags & Padded)
+  {
+    if (length < 1 || payload[0] >= length)
+    {
+      return error(ProtocolError, "invalid padding");
+    }
+
+    length -= 1 + payload[0];
+    payload++;
+  }
+
+  if (flags & PriorityFlag)
+  {
+    if (length < 5)
+    {
+      return error(FrameSizeError, "HEADERS");
+    }
+
+    payload += 5;
+    length -= 5;
+  }
+
+  _headerBlock.assign((const char*)payload, length);
+
+  if (flags & EndHeaders)
+  {
+    return headerBlockDone(streamId, flags & EndStream);
+  }
+
+  _headerStream = streamId;
+  _headerEndStream = (flags & EndStream);
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// A header block is complete: the response headers, informational (1xx)
+// headers before them or trailers after the body. Blocks of streams no
+// longer open are decoded all the same, to keep the HPACK table in step.
+bool Http2Connection::headerBlockDone(int streamId, bool endStream)
+{
+  HttpResponse *response = find(streamId);
+  bool responseHeaders = (response && response->_state == HttpResponse::StatusLine);
+
+  HttpHeaders &headers = responseHeaders ? response->_headers : _trailers;
+  int status = 0;
+
+  headers.clear();
+
+  if (!_decoder.decode((const unsigned char*)_headerBlock.data(), _headerBlock.size(), headers, status))
+  {
+    return error(CompressionError, "invalid HPACK header block");
+  }
+
+  if (!response)
+  {
+    return true;
+  }
+
+  if (responseHeaders)
+  {
+    response->headersReceived(status, endStream);
+  }
+  else if (endStream)
+  {
+    response->endOfStream();
+  }
+
+  if (response->failed())
+  {
+    return false;
+  }
+
+  if (response->completed())
+  {
+    closeStream(response);
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+bool Http2Connection::processSettings(int flags, const unsigned char *payload, int length)
+{
+  if (flags & Ack)
+  {
+    return true;
+  }
+
+  if (length % 6 != 0)
+  {
+    return error(FrameSizeError, "SETTINGS");
+  }
+
+  if (!_settingsReceived)
+  {
+    _settingsReceived = true;
+    _maxStreams = DefaultMaxStreams;
+  }
+
+  for (const unsigned char *c = payload; c < payload + length; c += 6)
+  {
+    int id = (c[0] << 8) | c[1];
+    unsigned int value = read32(c + 2);
+
+    switch (id)
+    {
+      case SettingsHeaderTableSize:
+        _encoder.setMaxTableSize(std::min(value, (unsigned int)HpackTable::DefaultSize));
+        break;
+
+      case SettingsMaxStreams:
+        _maxStreams = std::min(value, (unsigned int)MaxStreamId);
+        break;
+
+      case SettingsInitialWindowSize:
+      {
+        if (value > (unsigned int)MaxWindow)
+        {
+          return error(FlowControlError, "SETTINGS_INITIAL_WINDOW_SIZE");
+        }
+
+        // Applies to the open streams as well
+        int delta = (int)value - _initialWindow;
+
+        for (HttpResponse *r = _request._pendingResponses.front(); r; r = ResponseQueue::next(r))
+        {
+          if (r->_streamId) r->_streamWindow += delta;
+        }
+
+        _initialWindow = value;
+        break;
+      }
+
+      case SettingsMaxFrameSize:
+        if (value < (unsigned int)DefaultFrameSize || value > 0xffffff)
+        {
+          return error(ProtocolError, "SETTINGS_MAX_FRAME_SIZE");
+        }
+
+        _maxFrameSize = value;
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  frame(Settings, Ack, 0, 0, 0);
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// The server is shutting down the connection. Streams up to the last one it
+// processed still complete; if it left any out, they are lost.
+bool Http2Connection::processGoAway(const unsigned char *payload, int length)
+{
+  if (length < 8)
+  {
+    return error(FrameSizeError, "GOAWAY");
+  }
+
+  int lastStreamId = read32(payload) & MaxStreamId;
+  unsigned int code = read32(payload + 4);
+
+  _goingAway = true;
+
+  if (code != NoError)
+  {
+    return _request.fail(HttpError::Closed, "HTTP/2 connection closed by server: error %u", code);
+  }
+
+  // Streams after lastStreamId were not processed (RFC 9113 6.8), the
+  // others still complete. A second GOAWAY can only lower it.
+  _lastStreamId = std::min(_lastStreamId, lastStreamId);
+  _unprocessed = 0;
+
+  for (HttpResponse *r = _request._pendingResponses.front(); r; r = ResponseQueue::next(r))
+  {
+    if (r->_streamId > _lastStreamId)
+    {
+      _unprocessed++;
+    }
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+bool Http2Connection::processWindowUpdate(int streamId, const unsigned char *payload, int length)
+{
+  if (length != 4)
+  {
+    return error(FrameSizeError, "WINDOW_UPDATE");
+  }
+
+  int increment = read32(payload) & MaxWindow;
+
+  if (increment == 0)
+  {
+    return error(ProtocolError, "WINDOW_UPDATE of 0");
+  }
+
+  int *window = &_sendWindow;
+
+  if (streamId != 0)
+  {
+    HttpResponse *response = find(streamId);
+
+    if (!response) return true;
+
+    window = &response->_streamWindow;
+  }
+
+  if (*window > MaxWindow - increment)
+  {
+    return error(FlowControlError, "window larger than 2^31-1");
+  }
+
+  *window += increment;
+
+  return true;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+HttpResponse* Http2Connection::find(int streamId) const
+{
+  if (streamId == 0 || _streams.empty()) return 0;
+
+  size_t mask = _streams.size() - 1;
+
+  for (size_t i = (streamId >> 1) & mask; _streams[i]; i = (i + 1) & mask)
+  {
+    if (_streams[i]->_streamId == streamId)
+    {
+      return _streams[i];
+    }
+  }
+
+  return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+void Http2Connection::addStream(HttpResponse *response)
+{
+  // Double the table before it gets more than half full
+  if (2 * (_openStreams + 1) > (int)_streams.size())
+  {
+    std::vector<HttpResponse*> streams(std::max<size_t>(16, 2 * _streams.size()), 0);
+    std::swap(streams, _streams);
+
+    for (size_t i = 0; i < streams.size(); i++)
+    {
+      if (streams[i]) addStream(streams[i]);
+    }
+  }
+
+  size_t mask = _streams.size() - 1;
+  size_t i = (response->_streamId >> 1) & mask;
+
+  while (_streams[i])
+  {
+    i = (i + 1) & mask;
+  }
+
+  _streams[i] = response;
+}
+
+
+//-----------------------------------------------------------------------------
+// Take the stream out of the table. The ones after it in its run of slots
+// move back, so that no lookup stops short at the gap.
+void Http2Connection::removeStream(int streamId)
+{
+  if (_streams.empty()) return;
+
+  size_t mask = _streams.size() - 1;
+  size_t i = (streamId >> 1) & mask;
+
+  while (_streams[i] && _streams[i]->_streamId != streamId)
+  {
+    i = (i + 1) & mask;
+  }
+
+  if (!_streams[i]) return;
+
+  _streams[i] = 0;
+
+  for (size_t j = (i + 1) & mask; _streams[j]; j = (j + 1) & mask)
+  {
+    size_t home = (_streams[j]->_streamId >> 1) & mask;
+
+    // Moves back unless its home lies cyclically in (i, j]
+    if ((i < j) ? (home <= i || home > j) : (home <= i && home > j))
+    {
+      _streams[i] = _streams[j];
+      _streams[j] = 0;
+      i = j;
+    }
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// The response is complete, let go of its stream.
+void Http2Connection::closeStream(HttpResponse *response)
+{
+  // Still sending the body: the server doesn't need the rest.
+  if (response->_streamRemaining != 0)
+  {
+    resetStream(response->_streamId, Cancel);
+  }
+
+  if (response->_streamId > _lastStreamId)
+  {
+    _unprocessed--;
+  }
+
+  removeStream(response->_streamId);
+
+  response->_streamId = 0;
+  _openStreams--;
+
+  _request.removeResponse(response);
+}
+
+
+//-----------------------------------------------------------------------------
+// The server broke the protocol. Say so with a GOAWAY, if it can still be
+// sent, and give up on the connection. Return false.
+bool Http2Connection::error(ErrorCode code, const char *what)
+{
+  unsigned char payload[8];
+  write32(payload, 0); // No server streams processed
+  write32(payload + 4, code);
+
+  frame(GoAway, 0, 0, payload, sizeof(payload));
+
+  _request.write((const unsigned char*)_output.data(), _output.size(), 0, 0);
+  _output.clear();
+
+  return _request.fail(HttpError::Protocol, "HTTP/2 protocol error: %s", what);
+}
@@ -0,0 +1,179 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// HTTP/2 (RFC 9113) on the connection of an HttpRequest, see
+// HttpRequest::setHttp2().
+//
+// Each request is a stream of its own, so many of them run at once on one
+// connection and a slow response holds up none of the others. Requests are
+// built as usual (initRequest(), addHeader()) and turned into HPACK coded
+// HEADERS here; responses are handed to the same HttpResponse objects and
+// callbacks as with HTTP/1.1, completing in whatever order they finish.
+//
+// Flow control: request bodies go out only as far as the server's windows
+// allow, waiting for its WINDOW_UPDATE otherwise. The windows offered to
+// the server are large (StreamWindow, ConnectionWindow) and topped up once
+// half of them has been used.
+//
+// Basic Usage:
+//
+//   HttpRequest request("localhost", 8080);
+//   request.setHttp2(true); // h2c, or h2 with setTls()
+//   request.initCallbacks(foo, bar, baz, 0);
+//
+//   for (int i = 0; i < 100; i++)
+//     request.sendRequest("GET", "/");
+//
+//   request.waitForResponses(5000);
+//
+
+#ifndef HTTP2_CONNECTION_H
+#define HTTP2_CONNECTION_H
+
+#include "Hpack.h"
+#include "HttpHeaders.h"
+
+#include <string>
+#include <vector>
+
+class HttpRequest;
+class HttpResponse;
+class RingBuffer;
+
+
+class Http2Connection
+{
+public:
+
+  // Receive window offered for each stream and for the connection.
+  static const int StreamWindow = 1 << 20;
+  static const int ConnectionWindow = 1 << 24;
+
+  // Streams opened at once if the server sets no limit. Until its SETTINGS
+  // arrive only one is, so as not to go over a lower one.
+  static const int DefaultMaxStreams = 100;
+
+
+  explicit Http2Connection(HttpRequest &request);
+
+  // Streams waiting for their response.
+  int openStreams() const { return _openStreams; }
+
+  // Streams the server allows at once (SETTINGS_MAX_CONCURRENT_STREAMS).
+  int maxStreams() const { return _maxStreams; }
+
+  // Did the server announce it is shutting down (GOAWAY)? The streams
+  // already started still complete, except those the server says it didn't
+  // process. They fail with HttpError::Closed once the others are done.
+  bool goingAway() const { return _goingAway; }
+
+
+private:
+
+  friend class HttpRequest;
+
+  enum FrameType
+  {
+    Data         = 0x0,
+    Headers      = 0x1,
+    Priority     = 0x2,
+    RstStream    = 0x3,
+    Settings     = 0x4,
+    PushPromise  = 0x5,
+    Ping         = 0x6,
+    GoAway       = 0x7,
+    WindowUpdate = 0x8,
+    Continuation = 0x9
+  };
+
+  enum Flags
+  {
+    EndStream    = 0x01,
+    Ack          = 0x01,
+    EndHeaders   = 0x04,
+    Padded       = 0x08,
+    PriorityFlag = 0x20
+  };
+
+  enum ErrorCode
+  {
+    NoError          = 0x0,
+    ProtocolError    = 0x1,
+    FlowControlError = 0x3,
+    FrameSizeError   = 0x6,
+    Cancel           = 0x8,
+    CompressionError = 0x9
+  };
+
+  static const int FrameHeaderSize = 9;
+  static const int DefaultWindow = 65535;
+  static const int DefaultFrameSize = 16384;
+  static const int MaxWindow = 0x7fffffff;
+  static const int MaxStreamId = 0x7fffffff;
+
+  HttpRequest &_request;
+
+  HpackEncoder _encoder;
+  HpackDecoder _decoder;
+
+  std::string _output; // Frames waiting to be written
+  std::string _block;  // Header block being sent
+
+  int _nextStreamId;
+  int _openStreams;
+
+  // Open streams by ID: open addressing, linear probing. IDs are odd and
+  // handed out in order, so (ID >> 1) spreads them over the slots. Kept at
+  // most half full.
+  std::vector<HttpResponse*> _streams;
+  int _maxStreams;
+  int _maxFrameSize;  // Largest frame the server accepts
+  int _initialWindow; // Server's window for new streams
+  int _sendWindow;    // Connection window for request bodies
+  int _recvUnacked;   // Received on the connection, not yet given back
+
+  bool _settingsReceived;
+  bool _goingAway;
+  int _lastStreamId; // Last stream the server processes, see GOAWAY
+  int _unprocessed;  // Open streams after it, failed when the rest are done
+
+  // HEADERS continued in CONTINUATION frames
+  std::string _headerBlock;
+  int _headerStream;     // Stream of the block being received, 0 if none
+  bool _headerEndStream;
+
+  HttpHeaders _trailers; // Trailers and headers of closed streams
+
+  // Used by HttpRequest
+  bool canStartStream() const;
+  int startStream(HttpResponse *response, const std::string &head);
+  int sendData(int streamId, const unsigned char *data, int size, bool last);
+  void resetStream(int streamId, ErrorCode error);
+  bool process(RingBuffer &buffer);
+  bool flush();
+
+  void frame(FrameType type, int flags, int streamId, const void *payload, int length);
+  void frameHeader(FrameType type, int flags, int streamId, int length);
+  void windowUpdate(int streamId, int increment);
+
+  bool processFrame(int type, int flags, int streamId, const unsigned char *payload, int length);
+  bool processData(int flags, int streamId, const unsigned char *payload, int length);
+  bool processHeaders(int flags, int streamId, const unsigned char *payload, int length);
+  bool processSettings(int flags, const unsigned char *payload, int length);
+  bool processGoAway(const unsigned char *payload, int length);
+  bool processWindowUpdate(int streamId, const unsigned char *payload, int length);
+  bool headerBlockDone(int streamId, bool endStream);
+
+  HttpResponse* find(int streamId) const;
+  void addStream(HttpResponse *response);
+  void removeStream(int streamId);
+  void closeStream(HttpResponse *response);
+
+  bool error(ErrorCode code, const char *what);
+
+  Http2Connection(const Http2Connection&);
+  Http2Connection& operator=(const Http2Connection&);
+};
+
+#endif
@@ -0,0 +1,1254 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Process-wide cache of GET responses.
+
+#include "HttpCache.h"
+
+#include "HttpException.h"
+#include "HttpResponse.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+// Cache-Control directives used
+struct CacheControl
+{
+  bool noStore;
+  bool noCache;
+  long long maxAge; // -1 if not given
+
+  CacheControl() : noStore(false), noCache(false), maxAge(-1) {}
+};
+
+
+//-----------------------------------------------------------------------------
+static void parseCacheControl(const char *value, CacheControl &control)
+{
+  const char *c = value;
+
+  while (c && *c)
+  {
+    while (*c == ' ' || *c == '\t' || *c == ',') { c++; }
+
+    const char *directive = c;
+
+    while (*c && *c != ',') { c++; }
+
+    int length = c - directive;
+
+    if (length >= 8 && 0 == strncasecmp(directive, "no-store", 8))
+    {
+      control.noStore = true;
+    }
+    else if (length >= 8 && 0 == strncasecmp(directive, "no-cache", 8))
+    {
+      control.noCache = true;
+    }
+    else if (length > 8 && 0 == strncasecmp(directive, "max-age=", 8))
+    {
+      control.maxAge = atoll(directive + 8);
+    }
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// HTTP-date (RFC 9110, 5.6.7) as seconds since the epoch, -1 if invalid.
+static time_t parseDate(const char *value)
+{
+  if (!value) return -1;
+
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+
+  if (!strptime(value, "%a, %d %b %Y %H:%M:%S", &tm))
+  {
+    return -1;
+  }
+
+  return timegm(&tm);
+}
+
+
+//-----------------------------------------------------------------------------
+// Header of a 304 response, or else that of the stored response.
+static const char* header(const HttpHeaders &headers, const HttpHeaders *stored, HeaderId id)
+{
+  const char *value = headers.get(id);
+
+  if (!value && stored)
+  {
+    value = stored->get(id);
+  }
+
+  return value;
+}
+
+
+//-----------------------------------------------------------------------------
+// Set the validators and freshness of entry from the headers of a response
+// received just now. For a 304, stored has the headers of the response it
+// stands for, which it may leave out.
+static void freshness(const HttpHeaders &headers, const HttpHeaders *stored, CachedResponse &entry)
+{
+  time_t now = time(0);
+
+  const char *lastModified = header(headers, stored, HeaderLastModified);
+
+  // Validators are those of the stored response, requests may be using them.
+  if (!stored)
+  {
+    const char *etag = headers.get(HeaderETag);
+
+    entry.etag.assign(etag ? etag : "");
+    entry.lastModified.assign(lastModified ? lastModified : "");
+  }
+
+  // Age when received: by its own account or from its Date (RFC 9111, 4.2.3)
+  time_t date = parseDate(headers.get(HeaderDate));
+  const char *age = headers.get(HeaderAge);
+
+  if (date < 0 || date > now)
+  {
+    date = now;
+  }
+
+  entry.responseTime = now;
+  entry.initialAge = std::max(age ? atoll(age) : 0LL, (long long)(now - date));
+
+  CacheControl control;
+  parseCacheControl(header(headers, stored, HeaderCacheControl), control);
+
+  entry.noCache = control.noCache;
+
+  if (control.maxAge >= 0)
+  {
+    entry.lifetime = control.maxAge;
+    return;
+  }
+
+  const char *expires = header(headers, stored, HeaderExpires);
+
+  if (expires)
+  {
+    // An invalid date means already expired.
+    time_t time = parseDate(expires);
+
+    entry.lifetime = (time >= 0) ? time - date : 0;
+    return;
+  }
+
+  // Heuristic: a tenth of the time since it last changed
+  time_t modified = parseDate(lastModified);
+
+  entry.lifetime = (modified >= 0 && modified < date) ? (date - modified) / 10 : 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// Headers to replay with a stored body of size bytes. It is whole and, if
+// decoded, decompressed: how it came over the wire no longer applies.
+static void storedHeaders(const HttpHeaders &headers, bool decoded, long long size, HttpHeaders &stored)
+{
+  stored.clear();
+
+  for (int i = 0; i < headers.count(); i++)
+  {
+    HeaderId id = headers.id(i);
+
+    if (id == HeaderTransferEncoding || id == HeaderContentLength ||
+        (decoded && id == HeaderContentEncoding))
+    {
+      continue;
+    }
+
+    stored.add(headers.name(i), strlen(headers.name(i)), headers.value(i), strlen(headers.value(i)));
+  }
+
+  char length[24];
+  int lengthSize = snprintf(length, sizeof(length), "%lld", size);
+
+  stored.add("Content-Length", 14, length, lengthSize);
+}
+
+
+// File layout, see open(). Numbers are in host byte order.
+
+static const unsigned int RecordMagic = 0x31435248; // "HRC1"
+static const unsigned int IndexMagic = 0x31495248;  // "HRI1"
+
+// Record in a segment, followed by the key, the head and the body, padded
+// to a multiple of 8 bytes. The head is the reason phrase, then each
+// header name and value, all NUL-terminated.
+struct RecordHeader
+{
+  unsigned int magic;
+  unsigned int checksum; // Of key, head and body
+  int status;
+  unsigned int keySize;
+  unsigned int headSize;
+  unsigned int reserved;
+  long long bodySize;
+};
+
+struct IndexHeader
+{
+  unsigned int magic;
+  int generation; // Of the segment
+};
+
+// Where a record is and how fresh; the last one for an offset counts.
+struct IndexRecord
+{
+  long long offset;
+  long long responseTime;
+  long long initialAge;
+  long long lifetime;
+  int flags;
+  int reserved;
+};
+
+enum { IndexRemoved = 1, IndexNoCache = 2 };
+
+
+// A segment file and its mapping, shared by the responses stored in it.
+struct CacheSegment
+{
+  int fd;
+  unsigned char *map;
+  long long capacity; // Size of the mapping
+  long long end;      // Of the file, where records are appended
+  int refs;           // Responses in it, and the cache while appending
+  std::string path;
+};
+
+
+//-----------------------------------------------------------------------------
+// FNV-1a, continuing from hash for data in pieces
+static unsigned int checksum(const void *data, long long size, unsigned int hash = 2166136261u)
+{
+  const unsigned char *c = (const unsigned char*)data;
+
+  for (long long i = 0; i < size; i++)
+  {
+    hash = (hash ^ c[i]) * 16777619u;
+  }
+
+  return hash;
+}
+
+
+//-----------------------------------------------------------------------------
+static long long recordSize(long long unpadded)
+{
+  return (unpadded + 7) & ~7LL;
+}
+
+
+//-----------------------------------------------------------------------------
+// Open and map a segment file, 0 on failure.
+static CacheSegment* mapSegment(const std::string &path, long long capacity, bool truncate)
+{
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+
+  if (fd < 0)
+  {
+    return 0;
+  }
+
+  struct stat info;
+
+  if (fstat(fd, &info) != 0)
+  {
+    ::close(fd);
+    return 0;
+  }
+
+  // Mapped beyond the end of the file, which grows into it.
+  long long page = sysconf(_SC_PAGESIZE);
+
+  capacity = std::max(capacity, (long long)info.st_size);
+  capacity = std::max(page, (capacity + page - 1) / page * page);
+
+  void *map = mmap(0, capacity, PROT_READ, MAP_SHARED, fd, 0);
+
+  if (map == MAP_FAILED)
+  {
+    ::close(fd);
+    return 0;
+  }
+
+  CacheSegment *segment = new CacheSegment();
+  segment->fd = fd;
+  segment->map = (unsigned char*)map;
+  segment->capacity = capacity;
+  segment->end = info.st_size;
+  segment->refs = 1;
+  segment->path = path;
+
+  return segment;
+}
+
+
+//-----------------------------------------------------------------------------
+static void releaseSegment(CacheSegment *segment)
+{
+  if (--segment->refs == 0)
+  {
+    munmap(segment->map, segment->capacity);
+    ::close(segment->fd);
+    delete segment;
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// Write all of data at offset. Files only come up short when the disk is full.
+static bool writeAll(int fd, struct iovec *iov, int count, long long offset)
+{
+  while (count > 0)
+  {
+    ssize_t written = pwritev(fd, iov, count, offset);
+
+    if (written <= 0)
+    {
+      if (written < 0 && errno == EINTR) continue;
+      return false;
+    }
+
+    offset += written;
+
+    while (count > 0 && (size_t)written >= iov->iov_len)
+    {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+
+    if (count > 0)
+    {
+      iov->iov_base = (char*)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Read a record of a segment back into entry. False if it doesn't fit in
+// the file or its sizes make no sense.
+static bool readRecord(const CacheSegment &segment, long long offset, CachedResponse &entry)
+{
+  if (offset < 0 || (offset & 7) || offset + (long long)sizeof(RecordHeader) > segment.end)
+  {
+    return false;
+  }
+
+  const RecordHeader *record = (const RecordHeader*)(segment.map + offset);
+
+  long long size = sizeof(RecordHeader) + (long long)record->keySize + record->headSize + record->bodySize;
+
+  if (record->magic != RecordMagic || record->bodySize < 0 || record->headSize == 0 ||
+      offset + size > segment.end)
+  {
+    return false;
+  }
+
+  const char *key = (const char*)(record + 1);
+  const char *head = key + record->keySize;
+  const char *end = head + record->headSize;
+
+  if (end[-1] != '\0')
+  {
+    return false;
+  }
+
+  entry.key.assign(key, record->keySize);
+  entry.status = record->status;
+
+  // Reason, then name/value pairs
+  const char *c = head;
+
+  entry.reason.assign(c);
+  c += entry.reason.size() + 1;
+
+  entry.headers.clear();
+
+  while (c < end)
+  {
+    const char *name = c;
+    int nameLength = strlen(name);
+
+    c += nameLength + 1;
+
+    if (c >= end)
+    {
+      return false;
+    }
+
+    int valueLength = strlen(c);
+
+    entry.headers.add(name, nameLength, c, valueLength);
+    c += valueLength + 1;
+  }
+
+  const char *etag = entry.headers.get(HeaderETag);
+  const char *lastModified = entry.headers.get(HeaderLastModified);
+
+  entry.etag.assign(etag ? etag : "");
+  entry.lastModified.assign(lastModified ? lastModified : "");
+
+  entry.data = (const unsigned char*)end;
+  entry.size = record->bodySize;
+  entry.offset = offset;
+  entry.checksum = record->checksum;
+  entry.bytes = recordSize(size);
+
+  return true;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+CachedResponse::CachedResponse() :
+  status(0),
+  data(0),
+  size(0),
+  responseTime(0),
+  initialAge(0),
+  lifetime(0),
+  noCache(false),
+  bytes(0),
+  refs(1),
+  stored(false),
+  segment(0),
+  offset(0),
+  checksum(0),
+  verified(true)
+{
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+HttpCache& HttpCache::instance()
+{
+  static HttpCache cache;
+  return cache;
+}
+
+
+//-----------------------------------------------------------------------------
+HttpCache::HttpCache() :
+  _maxBytes(DefaultMaxBytes),
+  _size(0),
+  _segment(0),
+  _generation(0),
+  _index(-1),
+  _indexRecords(0)
+{
+  pthread_mutex_init(&_mutex, 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// The files are left for the next run.
+HttpCache::~HttpCache()
+{
+  close();
+
+  pthread_mutex_destroy(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpCache::setMaxBytes(long long bytes)
+{
+  pthread_mutex_lock(&_mutex);
+
+  __atomic_store_n(&_maxBytes, bytes, __ATOMIC_RELAXED);
+  evict(bytes);
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+long long HttpCache::size()
+{
+  pthread_mutex_lock(&_mutex);
+  long long size = _size;
+  pthread_mutex_unlock(&_mutex);
+
+  return size;
+}
+
+
+//-----------------------------------------------------------------------------
+int HttpCache::count()
+{
+  pthread_mutex_lock(&_mutex);
+  int count = _entries.size();
+  pthread_mutex_unlock(&_mutex);
+
+  return count;
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpCache::clear()
+{
+  pthread_mutex_lock(&_mutex);
+
+  evict(0);
+
+  // Start an empty segment, giving back the space.
+  if (_segment)
+  {
+    compact(0);
+  }
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpCache::open(HttpError &error, const char *directory)
+{
+  pthread_mutex_lock(&_mutex);
+
+  while (!_lru.empty())
+  {
+    drop(_lru.back());
+  }
+
+  closeFiles();
+
+  _directory = directory;
+
+  bool opened = (mkdir(directory, 0755) == 0 || errno == EEXIST) ?
+                load(error) :
+                error.set(HttpError::System, "HttpCache: mkdir(%s): %s", directory, strerror(errno));
+
+  if (!opened)
+  {
+    while (!_lru.empty())
+    {
+      drop(_lru.back());
+    }
+
+    closeFiles();
+  }
+
+  pthread_mutex_unlock(&_mutex);
+
+  return opened;
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpCache::close()
+{
+  pthread_mutex_lock(&_mutex);
+
+  while (!_lru.empty())
+  {
+    drop(_lru.back());
+  }
+
+  closeFiles();
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+CachedResponse* HttpCache::lookup(const std::string &key, bool &fresh)
+{
+  pthread_mutex_lock(&_mutex);
+
+  std::map<std::string, CachedResponse*>::iterator itr = _entries.find(key);
+  CachedResponse *entry = 0;
+  bool verified = true;
+
+  if (itr != _entries.end())
+  {
+    entry = itr->second;
+    entry->refs++;
+
+    // Most recently used
+    _lru.splice(_lru.begin(), _lru, entry->position);
+
+    time_t now = time(0);
+    long long age = entry->initialAge + (now - entry->responseTime);
+
+    // A clock behind the time it was stored (no RTC, before NTP) can't
+    // tell its age.
+    fresh = (!entry->noCache && now >= entry->responseTime && age < entry->lifetime);
+    verified = entry->verified;
+  }
+
+  pthread_mutex_unlock(&_mutex);
+
+  if (!verified && !verify(entry))
+  {
+    return 0;
+  }
+
+  return entry;
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpCache::release(CachedResponse *entry)
+{
+  pthread_mutex_lock(&_mutex);
+
+  unref(entry);
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+// Check the checksum of a record read from disk, the first time it is
+// used. A bad one is dropped, along with the reference from lookup().
+bool HttpCache::verify(CachedResponse *entry)
+{
+  const unsigned char *start = entry->segment->map + entry->offset + sizeof(RecordHeader);
+  bool valid = (checksum(start, entry->data + entry->size - start) == entry->checksum);
+
+  pthread_mutex_lock(&_mutex);
+
+  if (valid)
+  {
+    entry->verified = true;
+  }
+  else
+  {
+    if (entry->stored)
+    {
+      remove(entry);
+    }
+
+    unref(entry);
+  }
+
+  pthread_mutex_unlock(&_mutex);
+
+  return valid;
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpCache::storable(const HttpResponse &response)
+{
+  // Cacheable by default (RFC 9110, 15.1)
+  switch (response.getStatus())
+  {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+      break;
+
+    default:
+      return false;
+  }
+
+  // As a private cache, private doesn't stop it.
+  CacheControl control;
+  parseCacheControl(response.getHeader(HeaderCacheControl), control);
+
+  if (control.noStore)
+  {
+    return false;
+  }
+
+  // Responses that depend on request headers other than Accept-Encoding,
+  // which is part of the key, can't be told apart.
+  const char *vary = response.getHeader(HeaderVary);
+
+  if (vary && 0 != strcasecmp(vary, "accept-encoding"))
+  {
+    return false;
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpCache::store(const std::string &key, const HttpResponse &response, bool decoded, std::string &body)
+{
+  CachedResponse *entry = new CachedResponse();
+
+  freshness(response.getHeaders(), 0, *entry);
+
+  // Neither fresh nor able to be revalidated: no use keeping it.
+  if (entry->lifetime <= 0 && entry->etag.empty() && entry->lastModified.empty())
+  {
+    delete entry;
+    return;
+  }
+
+  entry->key = key;
+  entry->status = response.getStatus();
+  entry->reason = response.getReason();
+  storedHeaders(response.getHeaders(), decoded, body.size(), entry->headers);
+
+  pthread_mutex_lock(&_mutex);
+
+  std::map<std::string, CachedResponse*>::iterator itr = _entries.find(key);
+
+  if (itr != _entries.end())
+  {
+    remove(itr->second);
+  }
+
+  if (_segment)
+  {
+    if (!append(entry, body))
+    {
+      pthread_mutex_unlock(&_mutex);
+
+      delete entry;
+      return;
+    }
+  }
+  else
+  {
+    entry->body.swap(body);
+    entry->data = (const unsigned char*)entry->body.data();
+    entry->size = entry->body.size();
+
+    entry->bytes = sizeof(CachedResponse) + key.size() + entry->reason.size() + entry->size +
+                   entry->etag.size() + entry->lastModified.size();
+
+    for (int i = 0; i < entry->headers.count(); i++)
+    {
+      entry->bytes += strlen(entry->headers.name(i)) + strlen(entry->headers.value(i)) + 2;
+    }
+  }
+
+  entry->stored = true;
+
+  _entries[key] = entry;
+  _lru.push_front(entry);
+  entry->position = _lru.begin();
+  _size += entry->bytes;
+
+  evict(_maxBytes);
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpCache::freshen(CachedResponse *entry, const HttpResponse &notModified)
+{
+  pthread_mutex_lock(&_mutex);
+
+  freshness(notModified.getHeaders(), &entry->headers, *entry);
+
+  if (entry->stored && entry->segment)
+  {
+    writeIndex(entry);
+  }
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+// Take entry out of the cache, and out of the index. Call with the mutex
+// locked.
+void HttpCache::remove(CachedResponse *entry)
+{
+  if (entry->segment && _segment)
+  {
+    writeIndex(entry, true);
+  }
+
+  drop(entry);
+}
+
+
+//-----------------------------------------------------------------------------
+// Take entry out of memory only. Call with the mutex locked.
+void HttpCache::drop(CachedResponse *entry)
+{
+  _entries.erase(entry->key);
+  _lru.erase(entry->position);
+  _size -= entry->bytes;
+
+  entry->stored = false;
+
+  unref(entry);
+}
+
+
+//-----------------------------------------------------------------------------
+// Still in use by a request: the last release() deletes it. Call with the
+// mutex locked.
+void HttpCache::unref(CachedResponse *entry)
+{
+  if (--entry->refs > 0)
+  {
+    return;
+  }
+
+  if (entry->segment)
+  {
+    releaseSegment(entry->segment);
+  }
+
+  delete entry;
+}
+
+
+//-----------------------------------------------------------------------------
+// Drop the least recently used entries until the cache fits in maxBytes.
+// Call with the mutex locked.
+void HttpCache::evict(long long maxBytes)
+{
+  while (_size > maxBytes && !_lru.empty())
+  {
+    remove(_lru.back());
+  }
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Load the responses stored by an earlier run: those of the index found in
+// its segment. The index is then rewritten with only them.
+bool HttpCache::load(HttpError &error)
+{
+  std::string indexPath = path("index");
+
+  _index = ::open(indexPath.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+
+  if (_index < 0)
+  {
+    return error.set(HttpError::System, "HttpCache: open(%s): %s", indexPath.c_str(), strerror(errno));
+  }
+
+  std::string index;
+  char buffer[16384];
+  ssize_t bytesRead;
+
+  while ((bytesRead = pread(_index, buffer, sizeof(buffer), index.size())) > 0)
+  {
+    index.append(buffer, bytesRead);
+  }
+
+  // A missing or damaged index starts the cache over.
+  const IndexHeader *header = (const IndexHeader*)index.data();
+  bool valid = (index.size() >= sizeof(IndexHeader) && header->magic == IndexMagic);
+
+  _generation = valid ? header->generation : 0;
+  _segment = mapSegment(path("segment", _generation), SegmentShare * maxBytes(), !valid);
+
+  if (!_segment)
+  {
+    return error.set(HttpError::System, "HttpCache: %s: %s", path("segment", _generation).c_str(), strerror(errno));
+  }
+
+  // The last record for an offset counts. A record cut short is ignored.
+  std::map<long long, IndexRecord> records;
+  size_t count = valid ? (index.size() - sizeof(IndexHeader)) / sizeof(IndexRecord) : 0;
+
+  for (size_t i = 0; i < count; i++)
+  {
+    IndexRecord record;
+    memcpy(&record, index.data() + sizeof(IndexHeader) + i * sizeof(IndexRecord), sizeof(record));
+
+    if (record.flags & IndexRemoved)
+    {
+      records.erase(record.offset);
+    }
+    else
+    {
+      records[record.offset] = record;
+    }
+  }
+
+  // Appended in the order stored, which stands in for the order used.
+  for (std::map<long long, IndexRecord>::iterator itr = records.begin(); itr != records.end(); ++itr)
+  {
+    CachedResponse *entry = new CachedResponse();
+
+    if (!readRecord(*_segment, itr->first, *entry))
+    {
+      delete entry;
+      continue;
+    }
+
+    entry->responseTime = itr->second.responseTime;
+    entry->initialAge = itr->second.initialAge;
+    entry->lifetime = itr->second.lifetime;
+    entry->noCache = (itr->second.flags & IndexNoCache) != 0;
+
+    entry->segment = _segment;
+    entry->verified = false;
+    entry->stored = true;
+    _segment->refs++;
+
+    std::map<std::string, CachedResponse*>::iterator found = _entries.find(entry->key);
+
+    if (found != _entries.end())
+    {
+      drop(found->second);
+    }
+
+    _entries[entry->key] = entry;
+    _lru.push_front(entry);
+    entry->position = _lru.begin();
+    _size += entry->bytes;
+  }
+
+  evict(_maxBytes);
+  rewriteIndex();
+
+  // Segments left behind by a copy cut short
+  DIR *dir = opendir(_directory.c_str());
+  struct dirent *file;
+
+  while (dir && (file = readdir(dir)))
+  {
+    if (0 == strncmp(file->d_name, "segment.", 8) && path(file->d_name) != _segment->path)
+    {
+      unlink(path(file->d_name).c_str());
+    }
+  }
+
+  if (dir)
+  {
+    closedir(dir);
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Write the record of entry at the end of the segment, copying the live
+// ones to a new segment if it is full. False if it can't be written.
+bool HttpCache::append(CachedResponse *entry, const std::string &body)
+{
+  std::string head(entry->reason.c_str(), entry->reason.size() + 1);
+
+  for (int i = 0; i < entry->headers.count(); i++)
+  {
+    head.append(entry->headers.name(i), strlen(entry->headers.name(i)) + 1);
+    head.append(entry->headers.value(i), strlen(entry->headers.value(i)) + 1);
+  }
+
+  RecordHeader record;
+  memset(&record, 0, sizeof(record));
+
+  record.magic = RecordMagic;
+  record.status = entry->status;
+  record.keySize = entry->key.size();
+  record.headSize = head.size();
+  record.bodySize = body.size();
+
+  long long unpadded = sizeof(record) + entry->key.size() + head.size() + body.size();
+  long long size = recordSize(unpadded);
+
+  // Room within the budget, then in the segment
+  evict(_maxBytes - size);
+
+  if (_segment->end + size > _segment->capacity)
+  {
+    compact(size);
+
+    if (_segment->end + size > _segment->capacity)
+    {
+      return false;
+    }
+  }
+
+  unsigned int hash = checksum(entry->key.data(), entry->key.size());
+  hash = checksum(head.data(), head.size(), hash);
+  hash = checksum(body.data(), body.size(), hash);
+
+  record.checksum = hash;
+
+  static const char padding[8] = { 0 };
+
+  struct iovec iov[5];
+  iov[0].iov_base = &record;
+  iov[0].iov_len = sizeof(record);
+  iov[1].iov_base = (void*)entry->key.data();
+  iov[1].iov_len = entry->key.size();
+  iov[2].iov_base = (void*)head.data();
+  iov[2].iov_len = head.size();
+  iov[3].iov_base = (void*)body.data();
+  iov[3].iov_len = body.size();
+  iov[4].iov_base = (void*)padding;
+  iov[4].iov_len = size - unpadded;
+
+  long long offset = _segment->end;
+
+  if (!writeAll(_segment->fd, iov, 5, offset))
+  {
+    // Leave no partial record behind
+    if (ftruncate(_segment->fd, offset) != 0) {}
+    return false;
+  }
+
+  _segment->end += size;
+  _segment->refs++;
+
+  entry->segment = _segment;
+  entry->offset = offset;
+  entry->data = _segment->map + offset + sizeof(record) + entry->key.size() + head.size();
+  entry->size = body.size();
+  entry->checksum = hash;
+  entry->bytes = size;
+
+  writeIndex(entry);
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Append the freshness of entry, or that it was removed, to the index.
+void HttpCache::writeIndex(const CachedResponse *entry, bool removed)
+{
+  IndexRecord record;
+  memset(&record, 0, sizeof(record));
+
+  record.offset = entry->offset;
+  record.responseTime = entry->responseTime;
+  record.initialAge = entry->initialAge;
+  record.lifetime = entry->lifetime;
+  record.flags = (removed ? IndexRemoved : 0) | (entry->noCache ? IndexNoCache : 0);
+
+  if (::write(_index, &record, sizeof(record)) != sizeof(record))
+  {
+    return;
+  }
+
+  // Mostly outdated records: start it over.
+  if (++_indexRecords > 2 * (int)_entries.size() + 256)
+  {
+    rewriteIndex();
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// Replace the index with one of the live responses. Written aside and
+// renamed, so that a crash leaves either the old or the new one.
+void HttpCache::rewriteIndex()
+{
+  std::string indexPath = path("index");
+  std::string newPath = path("index.new");
+
+  int fd = ::open(newPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+  if (fd < 0)
+  {
+    return;
+  }
+
+  std::string index;
+
+  IndexHeader header;
+  header.magic = IndexMagic;
+  header.generation = _generation;
+
+  index.append((const char*)&header, sizeof(header));
+
+  for (LruList::reverse_iterator itr = _lru.rbegin(); itr != _lru.rend(); ++itr)
+  {
+    IndexRecord record;
+    memset(&record, 0, sizeof(record));
+
+    record.offset = (*itr)->offset;
+    record.responseTime = (*itr)->responseTime;
+    record.initialAge = (*itr)->initialAge;
+    record.lifetime = (*itr)->lifetime;
+    record.flags = (*itr)->noCache ? IndexNoCache : 0;
+
+    index.append((const char*)&record, sizeof(record));
+  }
+
+  struct iovec iov;
+  iov.iov_base = (void*)index.data();
+  iov.iov_len = index.size();
+
+  if (!writeAll(fd, &iov, 1, 0) || fdatasync(fd) != 0 || rename(newPath.c_str(), indexPath.c_str()) != 0)
+  {
+    ::close(fd);
+    unlink(newPath.c_str());
+    return;
+  }
+
+  if (_index >= 0)
+  {
+    ::close(_index);
+  }
+
+  _index = fd;
+  _indexRecords = _lru.size();
+}
+
+
+//-----------------------------------------------------------------------------
+// Copy the live records to a new segment with room for needed bytes more.
+// Responses in use keep the old one mapped until they are released.
+void HttpCache::compact(long long needed)
+{
+  CacheSegment *segment = mapSegment(path("segment", _generation + 1),
+                                     std::max(SegmentShare * _maxBytes, _size + needed), true);
+
+  if (!segment)
+  {
+    return;
+  }
+
+  CacheSegment *old = _segment;
+
+  for (LruList::iterator itr = _lru.begin(); itr != _lru.end(); ++itr)
+  {
+    CachedResponse *entry = *itr;
+
+    struct iovec iov;
+    iov.iov_base = old->map + entry->offset;
+    iov.iov_len = entry->bytes;
+
+    if (!writeAll(segment->fd, &iov, 1, segment->end))
+    {
+      releaseSegment(segment);
+      unlink(path("segment", _generation + 1).c_str());
+      return;
+    }
+
+    segment->end += entry->bytes;
+  }
+
+  // The data has to be there before an index points to it.
+  if (fdatasync(segment->fd) != 0) {}
+
+  _segment = segment;
+  _generation++;
+
+  // Stand-ins for the entries, pointing into the new segment
+  long long offset = 0;
+
+  for (LruList::iterator itr = _lru.begin(); itr != _lru.end(); ++itr)
+  {
+    CachedResponse *entry = *itr;
+    CachedResponse *copy = new CachedResponse();
+
+    copy->key = entry->key;
+    copy->status = entry->status;
+    copy->reason = entry->reason;
+    copy->headers.assign(entry->headers);
+    copy->data = segment->map + offset + (entry->data - (old->map + entry->offset));
+    copy->size = entry->size;
+    copy->etag = entry->etag;
+    copy->lastModified = entry->lastModified;
+    copy->responseTime = entry->responseTime;
+    copy->initialAge = entry->initialAge;
+    copy->lifetime = entry->lifetime;
+    copy->noCache = entry->noCache;
+    copy->bytes = entry->bytes;
+    copy->stored = true;
+    copy->position = itr;
+    copy->segment = segment;
+    copy->offset = offset;
+    copy->checksum = entry->checksum;
+    copy->verified = entry->verified;
+
+    segment->refs++;
+    offset += entry->bytes;
+
+    *itr = copy;
+    _entries[copy->key] = copy;
+
+    entry->stored = false;
+    unref(entry);
+  }
+
+  rewriteIndex();
+
+  unlink(old->path.c_str());
+  releaseSegment(old);
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpCache::closeFiles()
+{
+  if (_segment)
+  {
+    releaseSegment(_segment);
+    _segment = 0;
+  }
+
+  if (_index >= 0)
+  {
+    ::close(_index);
+    _index = -1;
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// File in the directory, numbered if generation isn't -1.
+std::string HttpCache::path(const char *name, int generation) const
+{
+  std::string path(_directory);
+  path += '/';
+  path += name;
+
+  if (generation >= 0)
+  {
+    char number[16];
+    snprintf(number, sizeof(number), ".%d", generation);
+    path += number;
+  }
+
+  return path;
+}
+
+
+
+
+#ifndef HTTP_NO_EXCEPTIONS
+
+//-----------------------------------------------------------------------------
+void HttpCache::open(const char *directory)
+{
+  HttpError error;
+
+  if (!open(error, directory))
+  {
+    throw HttpException(error);
+  }
+}
+
+#endif
@@ -0,0 +1,214 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Process-wide cache of GET responses, see HttpRequest::setCaching().
+//
+// A response is kept if its status allows it and Cache-Control doesn't
+// forbid it (no-store), within a budget of bytes; the least recently used
+// are dropped to make room. How long it stays fresh comes from
+// Cache-Control max-age, Expires or, failing those, a tenth of its age
+// since Last-Modified (RFC 9111, 4.2).
+//
+// A fresh response is replayed through the callbacks without touching the
+// network. A stale one is revalidated: the request goes out with
+// If-None-Match (ETag) and If-Modified-Since (Last-Modified), and a 304 Not
+// Modified answer replays the stored status, headers and body as if they
+// had been sent again.
+//
+// It is a private cache (RFC 9111, 3.5), the client's own: responses marked
+// Cache-Control private are stored too, and s-maxage is ignored. Don't
+// turn on caching for requests made on behalf of different users. A stale
+// response is never served, whatever the outcome of its revalidation, so
+// must-revalidate and proxy-revalidate hold without being looked at.
+//
+// Responses are kept in memory unless open() gives the cache a directory,
+// where they survive a restart:
+//   segment.<n> : Append-only records of key, status, headers and body.
+//                 It is mapped into memory and bodies are passed to the
+//                 ReceiveData callback straight from the mapping. When it
+//                 fills up the live records are copied to segment.<n+1>.
+//   index       : Fixed size records locating the live responses in the
+//                 segment, with their freshness. Appended to as responses
+//                 are stored, revalidated and dropped, and rewritten when
+//                 the cache is opened or the segment copied.
+// Only keys, headers and the index are held in memory. A record whose
+// checksum doesn't match (the segment was cut short by a power failure) is
+// dropped the first time it is looked up.
+//
+// Basic Usage:
+//
+//   HttpCache::instance().setMaxBytes(4 << 20); // Optional
+//   HttpCache::instance().open("/var/cache/app"); // Optional
+//
+//   HttpRequest request("www.hyperceptive.org", 80);
+//   request.setCaching(true);
+//   request.sendRequest("GET", "/status.json"); // Fresh: completes here
+//
+
+#ifndef HTTP_CACHE_H
+#define HTTP_CACHE_H
+
+#include "HttpException.h"
+#include "HttpHeaders.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+#include <pthread.h>
+#include <time.h>
+
+class HttpResponse;
+struct CacheSegment;
+
+
+// A stored response. Status, headers and body don't change once stored;
+// the freshness is updated by revalidation.
+struct CachedResponse
+{
+  std::string key;
+  int status;
+  std::string reason;
+  HttpHeaders headers;
+
+  // Body, in memory or in the mapping of a segment
+  const unsigned char *data;
+  long long size;
+  std::string body;
+
+  // Validators, "" if none
+  std::string etag;
+  std::string lastModified;
+
+  // Freshness, in seconds
+  time_t responseTime;  // When it was received or last revalidated
+  long long initialAge; // Age when received
+  long long lifetime;   // Fresh until its age reaches this
+  bool noCache;         // Revalidate before every use
+
+  long long bytes; // Counted against the budget
+  int refs;        // Users, the cache included while stored
+  bool stored;     // Still in the cache
+
+  std::list<CachedResponse*>::iterator position; // In the LRU list
+
+  // Record in a segment, see HttpCache::open()
+  CacheSegment *segment; // 0 if kept in memory
+  long long offset;
+  unsigned int checksum;
+  bool verified;         // Checksum checked since it was read from disk
+
+  CachedResponse();
+};
+
+
+class HttpCache
+{
+  friend class HttpRequest;
+  friend class HttpResponse;
+
+public:
+
+  static const long long DefaultMaxBytes = 8 << 20;
+
+  // The segment is mapped this many times the budget, so that records can
+  // be appended for a while before the live ones are copied to a new one.
+  static const int SegmentShare = 2;
+
+  // A response larger than this share of the budget isn't kept.
+  static const int MaxEntryShare = 8;
+
+
+  static HttpCache& instance();
+
+  // Budget for stored responses. Lowering it drops the least recently
+  // used ones right away.
+  void setMaxBytes(long long bytes);
+  long long maxBytes() const { return __atomic_load_n(&_maxBytes, __ATOMIC_RELAXED); }
+
+  // Largest body kept.
+  long long maxEntrySize() const { return maxBytes() / MaxEntryShare; }
+
+  long long size();
+  int count();
+
+  // Drop all stored responses, from the directory too if open.
+  void clear();
+
+  // Keep responses in files in directory (created if need be), loading
+  // those stored by an earlier run. Responses held in memory are dropped.
+  // Return false, with error set, if the files can't be used.
+  bool open(HttpError &error, const char *directory);
+
+#ifndef HTTP_NO_EXCEPTIONS
+  // The same, throwing HttpException.
+  void open(const char *directory);
+#endif
+
+  // Back to keeping responses in memory. The files stay as they are.
+  void close();
+
+  bool isOpen() const { return _segment != 0; }
+
+
+private:
+
+  typedef std::list<CachedResponse*> LruList;
+
+  std::map<std::string, CachedResponse*> _entries;
+  LruList _lru; // Most recently used first
+
+  long long _maxBytes;
+  long long _size;
+
+  // Files, see open()
+  std::string _directory;
+  CacheSegment *_segment; // Being appended to
+  int _generation;        // Number of the segment
+  int _index;             // Index file
+  int _indexRecords;      // Written since it was last rewritten
+
+  pthread_mutex_t _mutex;
+
+  HttpCache();
+  ~HttpCache();
+
+  // Used by HttpRequest and HttpResponse
+
+  // Stored response for key, or 0. It stays valid until release().
+  CachedResponse* lookup(const std::string &key, bool &fresh);
+  void release(CachedResponse *entry);
+
+  // Can response be stored, going by its status and headers?
+  static bool storable(const HttpResponse &response);
+
+  // Store a complete response. Its body is taken from body, decompressed if
+  // decoded.
+  void store(const std::string &key, const HttpResponse &response, bool decoded, std::string &body);
+
+  // A 304 Not Modified revalidated entry.
+  void freshen(CachedResponse *entry, const HttpResponse &notModified);
+
+  bool verify(CachedResponse *entry);
+
+  void remove(CachedResponse *entry);
+  void drop(CachedResponse *entry);
+  void unref(CachedResponse *entry);
+  void evict(long long maxBytes);
+
+  // Files, call with the mutex locked
+  bool load(HttpError &error);
+  bool append(CachedResponse *entry, const std::string &body);
+  void writeIndex(const CachedResponse *entry, bool removed = false);
+  void rewriteIndex();
+  void compact(long long needed);
+  void newSegment(long long needed);
+  void closeFiles();
+  std::string path(const char *name, int generation = -1) const;
+
+  HttpCache(const HttpCache&);
+  HttpCache& operator=(const HttpCache&);
+};
+
+#endif
@@ -0,0 +1,490 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Make HTTP requests from any thread, run by a set of EventLoop threads.
+
+#include "HttpClient.h"
+
+#include "HttpException.h"
+#include "MpscQueue.h"
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+
+//-----------------------------------------------------------------------------
+// A submitted request, copied so the caller's buffers can go away.
+struct HttpClient::Job
+{
+  Job *next; // MpscQueue link
+
+  std::string host;
+  int port;
+  std::string method;
+  std::string url;
+  std::vector<std::string> headers; // Name, value, name, value, ...
+  std::string body;
+  bool hasBody;
+
+  Callbacks callbacks;
+};
+
+
+//-----------------------------------------------------------------------------
+// A connection owned by a Worker, running one Job at a time.
+class HttpClient::Connection : public HttpRequest
+{
+public:
+
+  Connection(Worker &worker, const std::string &host, int port) :
+    HttpRequest(host.c_str(), port),
+    worker(worker),
+    job(0),
+    closing(false)
+  {
+    // Connections stay with their thread, not in the shared pool.
+    setConnectionPooling(false);
+  }
+
+  Worker &worker;
+  Job *job;     // Job in progress, 0 when idle
+  bool closing; // The last response closes the connection
+};
+
+
+//-----------------------------------------------------------------------------
+// One event loop thread and the connections it owns.
+class HttpClient::Worker
+{
+public:
+
+  explicit Worker(int core);
+
+  // Wait for the submitted jobs, then stop the thread.
+  ~Worker();
+
+  // Start the thread. Return false, with error set, if it can't be.
+  bool startThread(HttpError &error);
+
+  // Any thread
+  void submit(Job *job);
+
+
+private:
+
+  EventLoop _loop;
+  MpscQueue<Job> _queue;
+
+  pthread_t _thread;
+  int _core;      // Pinned to this core, -1 if not pinned
+  bool _running;  // The thread was started
+  bool _stopping; // Set by the destructor
+
+  int _active; // Jobs started and not finished
+
+  typedef std::vector<Connection*> ConnectionList;
+
+  std::map<std::string, ConnectionList> _idle; // By host:port
+  ConnectionList _retired; // Deleted once run() returns
+
+  static void* threadMain(void *worker);
+
+  void run();
+  void start(Job *job);
+  void finish(Connection &connection);
+
+  // Callbacks passed on to the job
+  static void headersReady(const HttpResponse *response, void *connection);
+  static void receiveData(const HttpResponse *response, void *connection,
+                          const unsigned char *data, int sizeOfData);
+  static void responseComplete(const HttpResponse *response, void *connection);
+  static void requestError(HttpRequest *request, const HttpException &e, void *worker);
+
+  static std::string key(const std::string &host, int port);
+
+  Worker(const Worker&);
+  Worker& operator=(const Worker&);
+};
+
+
+
+
+//-----------------------------------------------------------------------------
+HttpClient::HttpClient(int threads, bool pinThreads) :
+  _next(0)
+{
+  int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (cores < 1)
+  {
+    cores = 1;
+  }
+
+  if (threads <= 0)
+  {
+    threads = cores;
+  }
+
+  HttpError error;
+
+  for (int i = 0; i < threads; i++)
+  {
+    Worker *worker = new Worker(pinThreads ? i % cores : -1);
+
+    if (!worker->startThread(error))
+    {
+      delete worker;
+      break;
+    }
+
+    _workers.push_back(worker);
+  }
+
+#ifndef HTTP_NO_EXCEPTIONS
+  if (error.failed())
+  {
+    for (size_t i = 0; i < _workers.size(); i++)
+    {
+      delete _workers[i];
+    }
+
+    throw HttpException(error);
+  }
+#endif
+}
+
+
+//-----------------------------------------------------------------------------
+HttpClient::~HttpClient()
+{
+  for (size_t i = 0; i < _workers.size(); i++)
+  {
+    delete _workers[i];
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpClient::submit(const char *host,
+                        int port,
+                        const char *method,
+                        const char *url,
+                        const char *headers[],
+                        const unsigned char *body,
+                        int sizeOfBody,
+                        const Callbacks &callbacks)
+{
+  Job *job = new Job;
+
+  job->next = 0;
+  job->host = host;
+  job->port = port;
+  job->method = method;
+  job->url = url;
+
+  for (int i = 0; headers && headers[i] && headers[i + 1]; i += 2)
+  {
+    job->headers.push_back(headers[i]);
+    job->headers.push_back(headers[i + 1]);
+  }
+
+  job->hasBody = (body != 0);
+
+  if (body)
+  {
+    job->body.assign((const char*)body, sizeOfBody);
+  }
+
+  job->callbacks = callbacks;
+
+  assert(!_workers.empty());
+
+  unsigned next = __atomic_fetch_add(&_next, 1, __ATOMIC_RELAXED);
+
+  _workers[next % _workers.size()]->submit(job);
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+HttpClient::Worker::Worker(int core) :
+  _core(core),
+  _running(false),
+  _stopping(false),
+  _active(0)
+{
+  _loop.initErrorHandler(requestError, this);
+}
+
+
+//-----------------------------------------------------------------------------
+HttpClient::Worker::~Worker()
+{
+  if (_running)
+  {
+    __atomic_store_n(&_stopping, true, __ATOMIC_RELEASE);
+    _loop.wake();
+
+    pthread_join(_thread, 0);
+  }
+
+  std::map<std::string, ConnectionList>::iterator itr;
+
+  for (itr = _idle.begin(); itr != _idle.end(); itr++)
+  {
+    for (size_t i = 0; i < itr->second.size(); i++)
+    {
+      delete itr->second[i];
+    }
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpClient::Worker::startThread(HttpError &error)
+{
+  // A loop that couldn't be set up fails at once.
+  if (_loop.run(error, 0) < 0)
+  {
+    return false;
+  }
+
+  int status = pthread_create(&_thread, 0, threadMain, this);
+
+  if (status != 0)
+  {
+    return error.set(HttpError::System, "pthread_create(): %s", strerror(status));
+  }
+
+  _running = true;
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpClient::Worker::submit(Job *job)
+{
+  // Only the first job needs to wake the thread, it takes them all.
+  if (_queue.push(job))
+  {
+    _loop.wake();
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void* HttpClient::Worker::threadMain(void *worker)
+{
+  ((Worker*)worker)->run();
+  return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpClient::Worker::run()
+{
+  if (_core >= 0)
+  {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(_core, &cpus);
+
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  while (true)
+  {
+    for (Job *job = _queue.popAll(); job; )
+    {
+      Job *next = job->next;
+      start(job);
+      job = next;
+    }
+
+    for (size_t i = 0; i < _retired.size(); i++)
+    {
+      delete _retired[i];
+    }
+
+    _retired.clear();
+
+    if (__atomic_load_n(&_stopping, __ATOMIC_ACQUIRE) && _active == 0 && _queue.empty())
+    {
+      break;
+    }
+
+    // Failed requests go to requestError(), not here.
+    HttpError error;
+    _loop.run(error);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpClient::Worker::start(Job *job)
+{
+  ConnectionList &idle = _idle[key(job->host, job->port)];
+
+  Connection *connection;
+  bool reused = !idle.empty();
+
+  if (reused)
+  {
+    connection = idle.back();
+    idle.pop_back();
+
+    if (connection->closing)
+    {
+      connection->cleanUp();
+      connection->closing = false;
+      reused = false;
+    }
+  }
+  else
+  {
+    HttpError error; // Not connected yet, nothing to fail
+
+    connection = new Connection(*this, job->host, job->port);
+    _loop.add(error, *connection);
+  }
+
+  connection->job = job;
+  connection->initCallbacks(headersReady, receiveData, responseComplete, connection);
+
+  _active++;
+
+  std::vector<const char*> headers;
+
+  for (size_t i = 0; i < job->headers.size(); i++)
+  {
+    headers.push_back(job->headers[i].c_str());
+  }
+
+  headers.push_back(0);
+
+  HttpError error;
+
+  while (!connection->sendRequest(error, job->method.c_str(), job->url.c_str(), &headers[0],
+                                  job->hasBody ? (const unsigned char*)job->body.data() : 0,
+                                  (int)job->body.size()))
+  {
+    connection->cleanUp();
+
+    // The server may have closed an idle connection, try a new one.
+    if (!reused)
+    {
+      requestError(connection, HttpException(error), this);
+      return;
+    }
+
+    reused = false;
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// The job is done: the connection waits for the next one.
+void HttpClient::Worker::finish(Connection &connection)
+{
+  ConnectionList &idle = _idle[key(connection.job->host, connection.job->port)];
+
+  delete connection.job;
+  connection.job = 0;
+
+  _active--;
+
+  if ((int)idle.size() < MaxIdlePerHost)
+  {
+    idle.push_back(&connection);
+  }
+  else
+  {
+    // Still in use by the caller of this callback
+    _retired.push_back(&connection);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpClient::Worker::headersReady(const HttpResponse *response, void *connection)
+{
+  Callbacks &callbacks = ((Connection*)connection)->job->callbacks;
+
+  if (callbacks.headersReady)
+  {
+    (callbacks.headersReady)(response, callbacks.additionalParams);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpClient::Worker::receiveData(const HttpResponse *response, void *connection,
+                                     const unsigned char *data, int sizeOfData)
+{
+  Callbacks &callbacks = ((Connection*)connection)->job->callbacks;
+
+  if (callbacks.receiveData)
+  {
+    (callbacks.receiveData)(response, callbacks.additionalParams, data, sizeOfData);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpClient::Worker::responseComplete(const HttpResponse *response, void *connection)
+{
+  Connection &c = *(Connection*)connection;
+  Callbacks &callbacks = c.job->callbacks;
+
+  if (callbacks.responseComplete)
+  {
+    (callbacks.responseComplete)(response, callbacks.additionalParams);
+  }
+
+  c.closing = response->autoClose();
+  c.worker.finish(c);
+}
+
+
+//-----------------------------------------------------------------------------
+// The request has been cleaned up, see EventLoop::initErrorHandler().
+void HttpClient::Worker::requestError(HttpRequest *request, const HttpException &e, void *worker)
+{
+  Connection &c = *static_cast<Connection*>(request);
+
+  // Nothing in flight, the connection just went away.
+  if (!c.job)
+  {
+    return;
+  }
+
+  Callbacks &callbacks = c.job->callbacks;
+
+  if (callbacks.requestError)
+  {
+    (callbacks.requestError)(request, e, callbacks.additionalParams);
+  }
+
+  c.closing = false;
+  ((Worker*)worker)->finish(c);
+}
+
+
+//-----------------------------------------------------------------------------
+std::string HttpClient::Worker::key(const std::string &host, int port)
+{
+  char portStr[16];
+  snprintf(portStr, sizeof(portStr), ":%d", port);
+
+  return host + portStr;
+}
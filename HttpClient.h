@@ -0,0 +1,90 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Make HTTP requests from any thread, run by a set of EventLoop threads.
+//
+// Each thread runs its own EventLoop and owns its own connections, so the
+// threads share nothing while requests are in flight. submit() hands a
+// request to one of them through a lock-free queue; the callbacks are then
+// called on that thread, never on the one that submitted it.
+//
+// Basic Usage:
+//
+//   HttpClient client;  // One thread per core
+//
+//   HttpClient::Callbacks callbacks = { foo, bar, baz, qux, 0 };
+//
+//   // From any thread
+//   client.submit("www.hyperceptive.org", 80, "GET", "/", 0, 0, 0, callbacks);
+//
+// The destructor waits for submitted requests to complete.
+//
+
+#ifndef HTTP_CLIENT_H
+#define HTTP_CLIENT_H
+
+#include "EventLoop.h"
+#include "HttpRequest.h"
+
+#include <vector>
+
+
+class HttpClient
+{
+public:
+
+  // Idle keep-alive connections a thread keeps per host:port.
+  static const int MaxIdlePerHost = 32;
+
+  // How a submitted request reports back, see HttpRequest::initCallbacks()
+  // and EventLoop::initErrorHandler(). All are called on the thread that
+  // runs the request; requestError instead of responseComplete if it fails.
+  struct Callbacks
+  {
+    HeadersReady     headersReady;
+    ReceiveData      receiveData;
+    ResponseComplete responseComplete;
+    RequestError     requestError;
+    void            *additionalParams;
+  };
+
+
+  // Start the event loop threads, 0 for one per core. With pinThreads
+  // thread i only runs on core i (modulo the number of cores). Throws
+  // HttpException if one can't be started; without exceptions those that
+  // started are used, see threads().
+  explicit HttpClient(int threads = 0, bool pinThreads = false);
+
+  ~HttpClient();
+
+  // Make an HTTP request, see HttpRequest::sendRequest(). May be called from
+  // any thread; everything is copied before it returns.
+  void submit(const char *host,
+              int port,
+              const char *method,
+              const char *url,
+              const char *headers[],
+              const unsigned char *body,
+              int sizeOfBody,
+              const Callbacks &callbacks);
+
+  // Threads running, 0 if none could be started (don't submit()).
+  int threads() const { return (int)_workers.size(); }
+
+
+private:
+
+  struct Job;
+  class Connection;
+  class Worker;
+
+  std::vector<Worker*> _workers;
+
+  unsigned _next; // Round-robin over the workers
+
+  HttpClient(const HttpClient&);
+  HttpClient& operator=(const HttpClient&);
+};
+
+#endif
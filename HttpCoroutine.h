@@ -0,0 +1,675 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// C++20 coroutine interface: co_await a response instead of using callbacks.
+//
+// An AsyncRequest is an HttpRequest run by an AsyncLoop. Awaiting get() or
+// fetch() suspends the task until the response headers arrive, then the
+// body is read piece by piece with read(). Tasks are resumed by the loop
+// after it has processed the socket events, never from inside the parser,
+// so a task is free to start another request or destroy the AsyncRequest.
+//
+// Coroutine frames come from FrameAllocator, which recycles them: once a
+// thread has run a task of the same size, starting another allocates
+// nothing. Only available when compiling with -std=c++20 (or later).
+//
+// Basic Usage:
+//
+//   HttpTask fetchPage(AsyncLoop &loop)
+//   {
+//     AsyncRequest request(loop, "www.hyperceptive.org", 80);
+//
+//     AsyncResponse &response = co_await request.get("/");
+//
+//     printf("%d %s\n", response.getStatus(), response.getHeader("content-type"));
+//
+//     for (StringRef data = co_await response.read(); !data.empty();
+//          data = co_await response.read())
+//     {
+//       fwrite(data.data, 1, data.size, stdout);
+//     }
+//   }
+//
+//   AsyncLoop loop;
+//   HttpTask task = fetchPage(loop);
+//
+//   loop.runUntilComplete();
+//   task.result();  // Rethrow an HttpException the task ended with
+//
+
+#ifndef HTTP_COROUTINE_H
+#define HTTP_COROUTINE_H
+
+#if defined(__cpp_impl_coroutine)
+
+#include "EventLoop.h"
+#include "HttpException.h"
+#include "HttpHeaders.h"
+#include "HttpRequest.h"
+#include "LineScanner.h"
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <string>
+#include <vector>
+
+// Task results carry errors as exceptions.
+#ifdef HTTP_NO_EXCEPTIONS
+#error "HttpCoroutine.h needs exceptions"
+#endif
+
+class AsyncLoop;
+class AsyncRequest;
+
+
+//-----------------------------------------------------------------------------
+// Recycling allocator for coroutine frames.
+//
+// Freed frames are kept on per-thread lists by size class and handed out
+// again. A frame freed on another thread joins that thread's lists.
+class FrameAllocator
+{
+public:
+
+  static const std::size_t Granularity = 64;
+  static const std::size_t SizeClasses = 64;  // Frames up to 4 KB are recycled
+  static const int MaxFreePerClass = 256;
+
+  static void* allocate(std::size_t size)
+  {
+    std::size_t sizeClass = (size - 1) / Granularity;
+
+    if (sizeClass >= SizeClasses)
+    {
+      return ::operator new(size);
+    }
+
+    FreeList &list = lists().classes[sizeClass];
+
+    if (list.head)
+    {
+      FreeFrame *frame = list.head;
+      list.head = frame->next;
+      list.count--;
+      return frame;
+    }
+
+    return ::operator new((sizeClass + 1) * Granularity);
+  }
+
+  static void deallocate(void *frame, std::size_t size)
+  {
+    std::size_t sizeClass = (size - 1) / Granularity;
+
+    if (sizeClass >= SizeClasses)
+    {
+      ::operator delete(frame);
+      return;
+    }
+
+    FreeList &list = lists().classes[sizeClass];
+
+    if (list.count >= MaxFreePerClass)
+    {
+      ::operator delete(frame);
+      return;
+    }
+
+    FreeFrame *free = (FreeFrame*)frame;
+    free->next = list.head;
+    list.head = free;
+    list.count++;
+  }
+
+
+private:
+
+  struct FreeFrame
+  {
+    FreeFrame *next;
+  };
+
+  struct FreeList
+  {
+    FreeFrame *head;
+    int count;
+  };
+
+  struct ThreadLists
+  {
+    FreeList classes[SizeClasses];
+
+    ThreadLists()
+    {
+      for (std::size_t i = 0; i < SizeClasses; i++)
+      {
+        classes[i].head = 0;
+        classes[i].count = 0;
+      }
+    }
+
+    ~ThreadLists()
+    {
+      for (std::size_t i = 0; i < SizeClasses; i++)
+      {
+        while (classes[i].head)
+        {
+          FreeFrame *frame = classes[i].head;
+          classes[i].head = frame->next;
+          ::operator delete(frame);
+        }
+      }
+    }
+  };
+
+  static ThreadLists& lists()
+  {
+    static thread_local ThreadLists threadLists;
+    return threadLists;
+  }
+};
+
+
+//-----------------------------------------------------------------------------
+// Return type of a coroutine using this interface.
+//
+// The task starts running right away and runs until its first co_await.
+// Another task can co_await it to wait for it to finish. Destroying the
+// HttpTask object doesn't stop the task; it finishes on its own, and an
+// exception it ends with is then lost.
+class HttpTask
+{
+public:
+
+  struct promise_type;
+  typedef std::coroutine_handle<promise_type> Handle;
+
+  struct FinalAwaiter
+  {
+    bool await_ready() noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(Handle handle) noexcept
+    {
+      promise_type &promise = handle.promise();
+      promise.done = true;
+
+      if (promise.continuation)
+      {
+        return promise.continuation;
+      }
+
+      if (promise.detached)
+      {
+        handle.destroy();
+      }
+
+      return std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+  struct promise_type
+  {
+    std::coroutine_handle<> continuation; // Task waiting for this one
+    std::exception_ptr exception;
+    bool done;
+    bool detached; // The HttpTask object is gone
+
+    promise_type() : done(false), detached(false) {}
+
+    HttpTask get_return_object() { return HttpTask(Handle::from_promise(*this)); }
+
+    std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+    FinalAwaiter final_suspend() noexcept { return FinalAwaiter(); }
+
+    void return_void() {}
+    void unhandled_exception() { exception = std::current_exception(); }
+
+    static void* operator new(std::size_t size) { return FrameAllocator::allocate(size); }
+    static void operator delete(void *frame, std::size_t size) { FrameAllocator::deallocate(frame, size); }
+  };
+
+
+  HttpTask(HttpTask &&other) : _handle(other._handle) { other._handle = Handle(); }
+
+  ~HttpTask()
+  {
+    if (!_handle)
+    {
+      return;
+    }
+
+    if (_handle.promise().done)
+    {
+      _handle.destroy();
+    }
+    else
+    {
+      _handle.promise().detached = true;
+    }
+  }
+
+  bool done() const { return !_handle || _handle.promise().done; }
+
+  // Rethrow the exception the task ended with, if any.
+  void result() const
+  {
+    if (_handle && _handle.promise().exception)
+    {
+      std::rethrow_exception(_handle.promise().exception);
+    }
+  }
+
+  // co_await a task
+  bool await_ready() const { return done(); }
+  void await_suspend(std::coroutine_handle<> awaiting) { _handle.promise().continuation = awaiting; }
+  void await_resume() const { result(); }
+
+
+private:
+
+  Handle _handle;
+
+  explicit HttpTask(Handle handle) : _handle(handle) {}
+
+  HttpTask(const HttpTask&);
+  HttpTask& operator=(const HttpTask&);
+};
+
+
+//-----------------------------------------------------------------------------
+// Awaited by AsyncResponse::read(): the next piece of the body.
+class BodyAwaiter
+{
+public:
+
+  explicit BodyAwaiter(AsyncRequest &request) : _request(request) {}
+
+  bool await_ready() const;
+  void await_suspend(std::coroutine_handle<> awaiting);
+  StringRef await_resume();
+
+private:
+
+  AsyncRequest &_request;
+};
+
+
+//-----------------------------------------------------------------------------
+// The response of an AsyncRequest, valid until its next request.
+// Status and headers are copied, so they outlive the HttpResponse.
+class AsyncResponse
+{
+  friend class AsyncRequest;
+  friend class BodyAwaiter;
+  friend class ResponseAwaiter;
+
+public:
+
+  int getStatus() const { return _status; }
+  const char* getReason() const { return _reason.c_str(); }
+
+  // Get value of a header name/value pair. Return 0 if name doesn't exist.
+  const char* getHeader(const char *name) const { return _headers.get(name); }
+  const char* getHeader(HeaderId id) const { return _headers.get(id); }
+
+  const HttpHeaders& getHeaders() const { return _headers; }
+
+  // co_await the next piece of the body. Empty at the end of the body.
+  // The data stays valid until the next read().
+  BodyAwaiter read() { return BodyAwaiter(_request); }
+
+  // Has all of the body been read?
+  bool completed() const { return _complete && _pending.empty(); }
+
+
+private:
+
+  AsyncRequest &_request;
+
+  int _status;
+  std::string _reason;
+  HttpHeaders _headers;
+
+  // Body data received but not read yet, and data returned by read().
+  // Swapped, so both keep their memory from earlier responses.
+  std::string _pending;
+  std::string _delivered;
+
+  bool _headersReady;
+  bool _complete;
+
+  explicit AsyncResponse(AsyncRequest &request) :
+    _request(request),
+    _status(0),
+    _headersReady(false),
+    _complete(false)
+  {
+  }
+
+  void reset()
+  {
+    _status = 0;
+    _reason.clear();
+    _headers.clear();
+    _pending.clear();
+    _delivered.clear();
+    _headersReady = false;
+    _complete = false;
+  }
+
+  StringRef take()
+  {
+    _delivered.swap(_pending);
+    _pending.clear();
+
+    return StringRef(_delivered.data(), (int)_delivered.size());
+  }
+
+  AsyncResponse(const AsyncResponse&);
+  AsyncResponse& operator=(const AsyncResponse&);
+};
+
+
+//-----------------------------------------------------------------------------
+// Awaited by AsyncRequest::get() and fetch(): the response headers.
+class ResponseAwaiter
+{
+public:
+
+  explicit ResponseAwaiter(AsyncRequest &request) : _request(request) {}
+
+  bool await_ready() const;
+  void await_suspend(std::coroutine_handle<> awaiting);
+  AsyncResponse& await_resume();
+
+private:
+
+  AsyncRequest &_request;
+};
+
+
+//-----------------------------------------------------------------------------
+// EventLoop that resumes the tasks waiting on its AsyncRequests.
+class AsyncLoop : private EventLoop
+{
+  friend class AsyncRequest;
+
+public:
+
+  AsyncLoop()
+  {
+    initErrorHandler(requestError, this);
+  }
+
+  // Process socket events, see EventLoop::run(), then resume the tasks
+  // they completed.
+  int run(int timeoutMs = -1)
+  {
+    int n = EventLoop::run(timeoutMs);
+    resumeReady();
+    return n;
+  }
+
+  // Call run() until no request has a response pending.
+  void runUntilComplete()
+  {
+    while (responsesPending())
+    {
+      run();
+    }
+  }
+
+  using EventLoop::responsesPending;
+  using EventLoop::wake;
+
+
+private:
+
+  std::vector<AsyncRequest*> _ready; // Requests with a task to resume
+
+  static void requestError(HttpRequest *request, const HttpException &e, void *loop);
+
+  void resumeReady();
+  void forget(AsyncRequest &request);
+
+  AsyncLoop(const AsyncLoop&);
+  AsyncLoop& operator=(const AsyncLoop&);
+};
+
+
+//-----------------------------------------------------------------------------
+// An HTTP connection used from coroutines. One request at a time.
+class AsyncRequest : private HttpRequest
+{
+  friend class AsyncLoop;
+  friend class BodyAwaiter;
+  friend class ResponseAwaiter;
+
+public:
+
+  AsyncRequest(AsyncLoop &loop, const char *host, int port) :
+    HttpRequest(host, port),
+    _loop(loop),
+    _response(*this),
+    _queued(false)
+  {
+    initCallbacks(headersReady, receiveData, responseComplete, this);
+    loop.add(*this);
+  }
+
+  ~AsyncRequest()
+  {
+    _loop.forget(*this);
+  }
+
+  // co_await the response to a GET request.
+  ResponseAwaiter get(const char *url, const char *headers[] = 0)
+  {
+    return fetch("GET", url, headers);
+  }
+
+  // co_await the response to a request, see HttpRequest::sendRequest().
+  // The request is sent before this returns. Throws if the previous
+  // response hasn't completed.
+  ResponseAwaiter fetch(const char *method,
+                        const char *url,
+                        const char *headers[] = 0,
+                        const unsigned char *body = 0,
+                        int sizeOfBody = 0)
+  {
+    if (responsesPending())
+    {
+      throw HttpException("AsyncRequest: previous response still in progress");
+    }
+
+    _response.reset();
+    _error = std::exception_ptr();
+
+    try
+    {
+      sendRequest(method, url, headers, body, sizeOfBody);
+    }
+    catch (HttpException&)
+    {
+      cleanUp();
+      _error = std::current_exception();
+    }
+
+    return ResponseAwaiter(*this);
+  }
+
+  using HttpRequest::setResponseTimeout;
+  using HttpRequest::setConnectTimeout;
+  using HttpRequest::setDecompression;
+  using HttpRequest::setConnectionPooling;
+  using HttpRequest::setMaxRecvSize;
+
+
+private:
+
+  AsyncLoop &_loop;
+  AsyncResponse _response;
+
+  std::coroutine_handle<> _waiting; // Task suspended on this request
+  std::exception_ptr _error;
+  bool _queued;                     // In the loop's ready list
+
+  // The task can continue once run() is done with the socket events.
+  void wake()
+  {
+    if (_waiting && !_queued)
+    {
+      _queued = true;
+      _loop._ready.push_back(this);
+    }
+  }
+
+  void resume()
+  {
+    _queued = false;
+
+    std::coroutine_handle<> waiting = _waiting;
+    _waiting = std::coroutine_handle<>();
+
+    if (waiting)
+    {
+      waiting.resume();
+    }
+  }
+
+  void rethrowError()
+  {
+    if (_error)
+    {
+      std::rethrow_exception(_error);
+    }
+  }
+
+  static void headersReady(const HttpResponse *response, void *request)
+  {
+    AsyncRequest &r = *(AsyncRequest*)request;
+
+    r._response._status = response->getStatus();
+    r._response._reason = response->getReason();
+    r._response._headers.assign(response->getHeaders());
+    r._response._headersReady = true;
+    r.wake();
+  }
+
+  static void receiveData(const HttpResponse *, void *request,
+                          const unsigned char *data, int sizeOfData)
+  {
+    AsyncRequest &r = *(AsyncRequest*)request;
+
+    r._response._pending.append((const char*)data, sizeOfData);
+    r.wake();
+  }
+
+  static void responseComplete(const HttpResponse *, void *request)
+  {
+    AsyncRequest &r = *(AsyncRequest*)request;
+
+    r._response._complete = true;
+    r.wake();
+  }
+
+  AsyncRequest(const AsyncRequest&);
+  AsyncRequest& operator=(const AsyncRequest&);
+};
+
+
+
+
+//-----------------------------------------------------------------------------
+inline bool ResponseAwaiter::await_ready() const
+{
+  return (_request._error || _request._response._headersReady);
+}
+
+
+//-----------------------------------------------------------------------------
+inline void ResponseAwaiter::await_suspend(std::coroutine_handle<> awaiting)
+{
+  _request._waiting = awaiting;
+}
+
+
+//-----------------------------------------------------------------------------
+inline AsyncResponse& ResponseAwaiter::await_resume()
+{
+  _request.rethrowError();
+  return _request._response;
+}
+
+
+//-----------------------------------------------------------------------------
+inline bool BodyAwaiter::await_ready() const
+{
+  const AsyncResponse &response = _request._response;
+
+  return (_request._error || !response._pending.empty() || response._complete);
+}
+
+
+//-----------------------------------------------------------------------------
+inline void BodyAwaiter::await_suspend(std::coroutine_handle<> awaiting)
+{
+  _request._waiting = awaiting;
+}
+
+
+//-----------------------------------------------------------------------------
+inline StringRef BodyAwaiter::await_resume()
+{
+  _request.rethrowError();
+  return _request._response.take();
+}
+
+
+//-----------------------------------------------------------------------------
+// The request has been cleaned up, see EventLoop::initErrorHandler().
+inline void AsyncLoop::requestError(HttpRequest *request, const HttpException &e, void *)
+{
+  AsyncRequest &r = *static_cast<AsyncRequest*>(request);
+
+  r._error = std::make_exception_ptr(e);
+  r.wake();
+}
+
+
+//-----------------------------------------------------------------------------
+inline void AsyncLoop::resumeReady()
+{
+  // Resumed tasks may destroy requests further down the list, see forget().
+  for (std::size_t i = 0; i < _ready.size(); i++)
+  {
+    if (_ready[i])
+    {
+      _ready[i]->resume();
+    }
+  }
+
+  _ready.clear();
+}
+
+
+//-----------------------------------------------------------------------------
+inline void AsyncLoop::forget(AsyncRequest &request)
+{
+  for (std::size_t i = 0; i < _ready.size(); i++)
+  {
+    if (_ready[i] == &request)
+    {
+      _ready[i] = 0;
+    }
+  }
+}
+
+#endif // __cpp_impl_coroutine
+
+#endif
@@ -7,17 +7,55 @@
 #include <cstdarg>
 #include <cstdio>
 
-HttpException::HttpException(const char* e, ...)
+//-----------------------------------------------------------------------------
+HttpError::HttpError(Code code, const char *format, ...)
 {
   va_list ap;
-  va_start(ap, e);
-  
-  int n = vsnprintf(_message, MaxLength, e, ap);
-  
+  va_start(ap, format);
+
+  vset(code, format, ap);
+
   va_end(ap);
-  
-  if(n == MaxLength)
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpError::set(Code code, const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+
+  vset(code, format, ap);
+
+  va_end(ap);
+
+  return false;
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpError::vset(Code code, const char *format, va_list args)
+{
+  _code = code;
+
+  int n = vsnprintf(_message, MaxLength, format, args);
+
+  if(n >= MaxLength)
   {
     _message[MaxLength - 1] = '\0';
   }
+
+  return false;
+}
+
+
+//-----------------------------------------------------------------------------
+HttpException::HttpException(const char* e, ...)
+{
+  va_list ap;
+  va_start(ap, e);
+
+  vset(Other, e, ap);
+
+  va_end(ap);
 }
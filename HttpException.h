@@ -1,23 +1,83 @@
 // Copyright (c) 2013 Matt Hill
 // Use of this source code is governed by The MIT License
-// that can be found in the LICENSE file. 
+// that can be found in the LICENSE file.
+//
+// Errors of the library.
+//
+// Calls that can fail come in two forms: one takes an HttpError to fill in
+// and returns false, the other throws it as an HttpException. Where
+// failures are routine (resets, refused connections) the first costs no
+// unwinding.
+//
+// Basic Usage:
+//
+//   HttpError error;
+//
+//   if (!request.sendRequest(error, "GET", "/"))
+//   {
+//     printf("%d: %s\n", error.code(), error.message());
+//   }
+//
+// Built without exceptions (-fno-exceptions, "make NO_EXCEPTIONS=1")
+// HTTP_NO_EXCEPTIONS is defined and only the first form is there.
 
 #ifndef HTTP_EXCEPTION_H
 #define HTTP_EXCEPTION_H
 
-class HttpException
+#include <cstdarg>
+
+#if !defined(HTTP_NO_EXCEPTIONS) && !defined(__cpp_exceptions) && !defined(__EXCEPTIONS)
+#define HTTP_NO_EXCEPTIONS
+#endif
+
+class HttpError
 {
 public:
   static const int MaxLength = 256;
 
-  HttpException(const char* e, ...);
-  
+  enum Code
+  {
+    None,     // No error
+    Usage,    // Call out of order, or an invalid argument
+    Resolve,  // Host name not found
+    Connect,  // No address could be reached
+    Timeout,  // Connect or response deadline passed
+    Closed,   // Connection closed or reset with responses pending
+    System,   // Some other system call failed
+    Tls,      // TLS handshake or record
+    Protocol, // The server broke HTTP, HTTP/2 or the Content-Encoding
+    Aborted,  // Given up by a callback, see HttpRequest::failResponse()
+    Other     // None of the above, e.g. HttpException(format, ...)
+  };
+
+  HttpError() : _code(None) { _message[0] = '\0'; }
+
+  HttpError(Code code, const char *format, ...);
+
+  Code code() const { return _code; }
   const char* message() const { return _message; }
 
-protected:  
+  bool failed() const { return _code != None; }
+
+  // Record an error, message formatted like printf(). Return false, for
+  // "return error.set(...)".
+  bool set(Code code, const char *format, ...);
+  bool vset(Code code, const char *format, va_list args);
+
+  void clear() { _code = None; _message[0] = '\0'; }
+
+protected:
+  Code _code;
   char _message[MaxLength];
 };
 
-#endif 
 
+class HttpException : public HttpError
+{
+public:
+  HttpException(const char* e, ...);
+
+  explicit HttpException(const HttpError &error) : HttpError(error) {}
+};
 
+#endif
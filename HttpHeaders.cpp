@@ -0,0 +1,369 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Header name/value pairs of an HTTP Response.
+
+#include "HttpHeaders.h"
+
+#include <climits>
+#include <cstring>
+#include <strings.h>
+
+
+// Standard names, in HeaderId order
+static constexpr const char *Names[] =
+{
+  "accept", "accept-charset", "accept-encoding", "accept-language",
+  "accept-ranges", "access-control-allow-credentials",
+  "access-control-allow-headers", "access-control-allow-methods",
+  "access-control-allow-origin", "access-control-expose-headers",
+  "access-control-max-age", "access-control-request-headers",
+  "access-control-request-method", "age", "allow", "alt-svc",
+  "authentication-info", "authorization", "cache-control", "connection",
+  "content-disposition", "content-encoding", "content-language",
+  "content-length", "content-location", "content-range",
+  "content-security-policy", "content-type", "cookie", "date", "etag",
+  "expect", "expires", "forwarded", "from", "host", "if-match",
+  "if-modified-since", "if-none-match", "if-range", "if-unmodified-since",
+  "keep-alive", "last-modified", "link", "location", "max-forwards",
+  "origin", "pragma", "proxy-authenticate", "proxy-authentication-info",
+  "proxy-authorization", "proxy-connection", "range", "referer", "refresh",
+  "retry-after", "server", "set-cookie", "strict-transport-security", "te",
+  "trailer", "transfer-encoding", "upgrade", "user-agent", "vary", "via",
+  "www-authenticate", "x-content-type-options", "x-forwarded-for",
+  "x-frame-options", "x-request-id"
+};
+
+static_assert(sizeof(Names) / sizeof(Names[0]) == HeaderCount, "A name for each HeaderId");
+
+
+// Perfect hash: a seed is searched for at compile time with which every
+// standard name lands in a slot of its own. Hashing folds case with | 0x20,
+// right for the letters, digits and '-' of the standard names; any other
+// name is told apart by comparing it with the name found.
+static const int HashSlots = 512;
+static const unsigned char NoName = 0xFF;
+
+static constexpr int hashSlot(const char *name, int nameLength, unsigned seed)
+{
+  unsigned hash = seed ^ nameLength;
+
+  for (int i = 0; i < nameLength; i++)
+  {
+    hash = (hash ^ (unsigned char)(name[i] | 0x20)) * 16777619u;
+  }
+
+  return (hash ^ (hash >> 15)) & (HashSlots - 1);
+}
+
+static constexpr int nameLength(const char *name)
+{
+  int length = 0;
+
+  while (name[length]) { length++; }
+
+  return length;
+}
+
+static constexpr unsigned findSeed()
+{
+  for (unsigned seed = 1; seed < 100000; seed++)
+  {
+    bool used[HashSlots] = {};
+    bool collision = false;
+
+    for (int id = 0; id < HeaderCount && !collision; id++)
+    {
+      int slot = hashSlot(Names[id], nameLength(Names[id]), seed);
+
+      collision = used[slot];
+      used[slot] = true;
+    }
+
+    if (!collision)
+    {
+      return seed;
+    }
+  }
+
+  return 0;
+}
+
+static constexpr unsigned Seed = findSeed();
+
+static_assert(Seed != 0, "No perfect hash seed for the standard names");
+
+struct NameTable
+{
+  unsigned char ids[HashSlots]; // HeaderId in each slot, or NoName
+  int lengths[HeaderCount];
+};
+
+static constexpr NameTable makeNameTable()
+{
+  NameTable table = {};
+
+  for (int slot = 0; slot < HashSlots; slot++)
+  {
+    table.ids[slot] = NoName;
+  }
+
+  for (int id = 0; id < HeaderCount; id++)
+  {
+    table.lengths[id] = nameLength(Names[id]);
+    table.ids[hashSlot(Names[id], table.lengths[id], Seed)] = id;
+  }
+
+  return table;
+}
+
+static constexpr NameTable Table = makeNameTable();
+
+
+
+
+//-----------------------------------------------------------------------------
+HttpHeaders::HttpHeaders() :
+  _buffer(_inlineBuffer),
+  _size(0),
+  _capacity(InlineBytes),
+  _entries(_inlineEntries),
+  _count(0),
+  _entryCapacity(InlineEntries)
+{
+  memset(_index, 0, sizeof(_index));
+}
+
+
+//-----------------------------------------------------------------------------
+HttpHeaders::~HttpHeaders()
+{
+  if (_buffer != _inlineBuffer)
+  {
+    delete[] _buffer;
+  }
+
+  if (_entries != _inlineEntries)
+  {
+    delete[] _entries;
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpHeaders::clear()
+{
+  _size = 0;
+  _count = 0;
+
+  memset(_index, 0, sizeof(_index));
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpHeaders::assign(const HttpHeaders &other)
+{
+  if (&other == this)
+  {
+    return;
+  }
+
+  clear();
+  reserve(other._size);
+
+  memcpy(_buffer, other._buffer, other._size);
+  _size = other._size;
+
+  if (other._count > _entryCapacity)
+  {
+    if (_entries != _inlineEntries)
+    {
+      delete[] _entries;
+    }
+
+    _entries = new Entry[other._entryCapacity];
+    _entryCapacity = other._entryCapacity;
+  }
+
+  memcpy(_entries, other._entries, other._count * sizeof(Entry));
+  _count = other._count;
+
+  memcpy(_index, other._index, sizeof(_index));
+}
+
+
+//-----------------------------------------------------------------------------
+HeaderId HttpHeaders::add(const char *name, int nameLength, const char *value, int valueLength)
+{
+  if (_count == _entryCapacity)
+  {
+    Entry *entries = new Entry[_entryCapacity * 2];
+    memcpy(entries, _entries, _count * sizeof(Entry));
+
+    if (_entries != _inlineEntries)
+    {
+      delete[] _entries;
+    }
+
+    _entries = entries;
+    _entryCapacity *= 2;
+  }
+
+  Entry &entry = _entries[_count++];
+
+  entry.nameLength = nameLength;
+  entry.name = append(name, nameLength);
+  entry.value = append(value, valueLength);
+  entry.id = find(name, nameLength);
+
+  // Last one wins
+  if (entry.id != HeaderOther)
+  {
+    _index[entry.id] = _count;
+  }
+
+  return entry.id;
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpHeaders::appendToLast(const char *data, int length)
+{
+  if (_count == 0)
+  {
+    return;
+  }
+
+  // The last value is at the end of the buffer: replace its NUL.
+  reserve(length + 1);
+
+  _buffer[_size - 1] = ' ';
+  memcpy(_buffer + _size, data, length);
+  _size += length;
+  _buffer[_size++] = '\0';
+}
+
+
+//-----------------------------------------------------------------------------
+const char* HttpHeaders::get(const char *name) const
+{
+  return get(name, strlen(name));
+}
+
+
+//-----------------------------------------------------------------------------
+const char* HttpHeaders::get(const char *name, int nameLength) const
+{
+  HeaderId id = find(name, nameLength);
+
+  if (id != HeaderOther)
+  {
+    return get(id);
+  }
+
+  // Last one wins
+  for (int i = _count - 1; i >= 0; i--)
+  {
+    const Entry &entry = _entries[i];
+
+    if (entry.id == HeaderOther && entry.nameLength == nameLength &&
+        0 == strncasecmp(_buffer + entry.name, name, nameLength))
+    {
+      return _buffer + entry.value;
+    }
+  }
+
+  return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+HeaderId HttpHeaders::find(const char *name, int nameLength)
+{
+  int id = Table.ids[hashSlot(name, nameLength, Seed)];
+
+  if (id != NoName && Table.lengths[id] == nameLength &&
+      0 == strncasecmp(Names[id], name, nameLength))
+  {
+    return (HeaderId)id;
+  }
+
+  return HeaderOther;
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpHeaders::parseLength(const char *value, int valueLength, long long &length)
+{
+  const char *c = value;
+  const char *end = value + valueLength;
+  length = 0;
+
+  while (c < end && (*c == ' ' || *c == '\t')) { c++; }
+
+  if (c == end || *c < '0' || *c > '9')
+  {
+    return false;
+  }
+
+  for (; c < end && *c >= '0' && *c <= '9'; c++)
+  {
+    if (length > (LLONG_MAX - (*c - '0')) / 10)
+    {
+      return false;
+    }
+
+    length = length * 10 + (*c - '0');
+  }
+
+  while (c < end && (*c == ' ' || *c == '\t')) { c++; }
+
+  return (c == end);
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Copy data and a NUL to the end of the buffer. Return its offset.
+int HttpHeaders::append(const char *data, int length)
+{
+  reserve(length + 1);
+
+  int offset = _size;
+
+  memcpy(_buffer + _size, data, length);
+  _size += length;
+  _buffer[_size++] = '\0';
+
+  return offset;
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpHeaders::reserve(int bytes)
+{
+  if (_size + bytes <= _capacity)
+  {
+    return;
+  }
+
+  int capacity = _capacity * 2;
+
+  while (capacity < _size + bytes)
+  {
+    capacity *= 2;
+  }
+
+  char *buffer = new char[capacity];
+  memcpy(buffer, _buffer, _size);
+
+  if (_buffer != _inlineBuffer)
+  {
+    delete[] _buffer;
+  }
+
+  _buffer = buffer;
+  _capacity = capacity;
+}
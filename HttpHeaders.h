@@ -0,0 +1,182 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Header name/value pairs of an HTTP Response.
+//
+// Names and values are packed, NUL-terminated, into one buffer with an
+// index of offsets next to it. Both start out inside the object, so the
+// headers of a typical response need no heap allocation at all. Lookups
+// compare names case-insensitively in place and never allocate.
+//
+// Well-known names are recognized as they are added, with a perfect hash
+// built at compile time, and indexed by HeaderId so that get(HeaderId)
+// takes no string compares at all.
+
+#ifndef HTTP_HEADERS_H
+#define HTTP_HEADERS_H
+
+
+// Standard header names (RFC 9110 and common extensions). Same order as
+// the names in HttpHeaders.cpp.
+enum HeaderId
+{
+  HeaderAccept,
+  HeaderAcceptCharset,
+  HeaderAcceptEncoding,
+  HeaderAcceptLanguage,
+  HeaderAcceptRanges,
+  HeaderAccessControlAllowCredentials,
+  HeaderAccessControlAllowHeaders,
+  HeaderAccessControlAllowMethods,
+  HeaderAccessControlAllowOrigin,
+  HeaderAccessControlExposeHeaders,
+  HeaderAccessControlMaxAge,
+  HeaderAccessControlRequestHeaders,
+  HeaderAccessControlRequestMethod,
+  HeaderAge,
+  HeaderAllow,
+  HeaderAltSvc,
+  HeaderAuthenticationInfo,
+  HeaderAuthorization,
+  HeaderCacheControl,
+  HeaderConnection,
+  HeaderContentDisposition,
+  HeaderContentEncoding,
+  HeaderContentLanguage,
+  HeaderContentLength,
+  HeaderContentLocation,
+  HeaderContentRange,
+  HeaderContentSecurityPolicy,
+  HeaderContentType,
+  HeaderCookie,
+  HeaderDate,
+  HeaderETag,
+  HeaderExpect,
+  HeaderExpires,
+  HeaderForwarded,
+  HeaderFrom,
+  HeaderHost,
+  HeaderIfMatch,
+  HeaderIfModifiedSince,
+  HeaderIfNoneMatch,
+  HeaderIfRange,
+  HeaderIfUnmodifiedSince,
+  HeaderKeepAlive,
+  HeaderLastModified,
+  HeaderLink,
+  HeaderLocation,
+  HeaderMaxForwards,
+  HeaderOrigin,
+  HeaderPragma,
+  HeaderProxyAuthenticate,
+  HeaderProxyAuthenticationInfo,
+  HeaderProxyAuthorization,
+  HeaderProxyConnection,
+  HeaderRange,
+  HeaderReferer,
+  HeaderRefresh,
+  HeaderRetryAfter,
+  HeaderServer,
+  HeaderSetCookie,
+  HeaderStrictTransportSecurity,
+  HeaderTE,
+  HeaderTrailer,
+  HeaderTransferEncoding,
+  HeaderUpgrade,
+  HeaderUserAgent,
+  HeaderVary,
+  HeaderVia,
+  HeaderWWWAuthenticate,
+  HeaderXContentTypeOptions,
+  HeaderXForwardedFor,
+  HeaderXFrameOptions,
+  HeaderXRequestId,
+
+  HeaderCount,              // Number of standard names
+  HeaderOther = HeaderCount // Any other name
+};
+
+
+class HttpHeaders
+{
+public:
+
+  static const int InlineBytes = 1024;
+  static const int InlineEntries = 24;
+
+
+  HttpHeaders();
+
+  ~HttpHeaders();
+
+  // Remove all headers. Memory is kept for reuse.
+  void clear();
+
+  // Replace the headers with a copy of other's. Memory is kept for reuse.
+  void assign(const HttpHeaders &other);
+
+  // Add a header. Name and value are copied. Returns the HeaderId of the
+  // name.
+  HeaderId add(const char *name, int nameLength, const char *value, int valueLength);
+
+  // Append a continuation line to the value of the last header added.
+  void appendToLast(const char *data, int length);
+
+  // Value of a header, or 0 if it doesn't exist. If a name is repeated
+  // the last value wins.
+  const char* get(const char *name) const;
+  const char* get(const char *name, int nameLength) const;
+
+  // The same for a standard name, without looking through the headers.
+  const char* get(HeaderId id) const
+  {
+    int index = (id < HeaderCount) ? _index[id] - 1 : -1;
+    return (index >= 0) ? _buffer + _entries[index].value : 0;
+  }
+
+  // Iterate over the headers in the order received.
+  int count() const { return _count; }
+  const char* name(int index) const { return _buffer + _entries[index].name; }
+  const char* value(int index) const { return _buffer + _entries[index].value; }
+  HeaderId id(int index) const { return _entries[index].id; }
+
+  // HeaderId of a name (any case), HeaderOther if it isn't a standard one.
+  static HeaderId find(const char *name, int nameLength);
+
+  // Content-Length value: decimal digits only, 64 bits, optional spaces and
+  // tabs around. Return false if invalid.
+  static bool parseLength(const char *value, int valueLength, long long &length);
+
+
+private:
+
+  struct Entry
+  {
+    int name;        // Offset of the name in _buffer
+    int nameLength;
+    int value;       // Offset of the value in _buffer
+    HeaderId id;
+  };
+
+  char *_buffer;  // _inlineBuffer or heap
+  int _size;
+  int _capacity;
+
+  Entry *_entries; // _inlineEntries or heap
+  int _count;
+  int _entryCapacity;
+
+  int _index[HeaderCount]; // Last entry with each standard name, plus 1, or 0
+
+  char _inlineBuffer[InlineBytes];
+  Entry _inlineEntries[InlineEntries];
+
+  int append(const char *data, int length);
+  void reserve(int bytes);
+
+  HttpHeaders(const HttpHeaders&);
+  HttpHeaders& operator=(const HttpHeaders&);
+};
+
+#endif
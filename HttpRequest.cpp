@@ -4,7 +4,15 @@
 
 #include "HttpRequest.h"
 
+#include "ConnectionPool.h"
+#include "Connector.h"
+#include "EventLoop.h"
+#include "Http2Connection.h"
+#include "HttpCache.h"
 #include "HttpException.h"
+#include "HttpStats.h"
+#include "Resolver.h"
+#include "TlsConnection.h"
 
 #include <algorithm>
 #include <cstdio>
@@ -12,353 +20,2261 @@
 #include <cstdarg>
 #include <vector>
 
-#include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
-#include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+// ALPN offer of setHttp2() with TLS
+static const char *Http2Protocols[] = { "h2", "http/1.1", 0 };
+
+
+//-----------------------------------------------------------------------------
+// Is name in an array of name/value pairs terminated by NULL (0)?
+bool findHeader(const char *headers[], const char *name)
+{
+  if (!headers) return false;
+
+  const char **itr = headers;
+
+  while (*itr)
+  {
+    const char *headerName = *itr++;
+    (void) *itr++;  //skip value
+
+    if (0 == strcasecmp(headerName, name))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+//-----------------------------------------------------------------------------
+// Is there a header called name in a request head being built?
+static bool hasHeader(const std::string &head, const char *name)
+{
+  size_t length = strlen(name);
+  size_t line = head.find('\n');
+
+  while (line != std::string::npos)
+  {
+    line++;
+
+    if (0 == strncasecmp(head.c_str() + line, name, length) && head[line + length] == ':')
+    {
+      return true;
+    }
+
+    line = head.find('\n', line);
+  }
+
+  return false;
+}
+
+
+//-----------------------------------------------------------------------------
+HttpRequest::HttpRequest(const char *host, int port) :
+  _headersReady(0),
+  _receiveData(0),
+  _responseComplete(0),
+  _responseFailed(0),
+  _additionalParams(0),
+  _state(Idle),
+  _host(host),
+  _port(port),
+  _socket(-1),
+  _connectTimeout(-1),
+  _pipelineDepth(0),
+  _readSize(InitialRecvSize),
+  _maxReadSize(DefaultMaxRecvSize),
+  _pooling(true),
+  _reusable(false),
+  _decompress(false),
+  _caching(false),
+  _bodyFile(-1),
+  _bodySplice(false),
+  _nonBlocking(-1),
+  _tls(false),
+  _tlsConnection(0),
+  _http2(false),
+  _http2Connection(0),
+  _sendingStream(0),
+  _stats(HttpStats::instance().host(host, port)),
+  _connectedBefore(false),
+  _resolved(0),
+  _connected(0),
+  _secured(0),
+  _loop(0),
+  _responseTimeout(0),
+  _timers(0),
+  _timedOut(false),
+  _waitDeadline(-1)
+{
+  _splicePipe[0] = _splicePipe[1] = -1;
+}
+
+
+//-----------------------------------------------------------------------------
+HttpRequest::~HttpRequest()
+{
+  if (_loop)
+  {
+    _loop->remove(*this);
+  }
+
+  cleanUp();
+
+  while (!_freeResponses.empty())
+  {
+    delete _freeResponses.pop_front();
+  }
+
+  if (_splicePipe[0] >= 0)
+  {
+    ::close(_splicePipe[0]);
+    ::close(_splicePipe[1]);
+  }
+
+  delete _timers;
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpRequest::setBodyFile(int fd)
+{
+  _bodyFile = fd;
+
+  int flags = (fd >= 0) ? fcntl(fd, F_GETFL) : -1;
+  _bodySplice = (flags >= 0 && !(flags & O_APPEND));
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpRequest::initCallbacks(HeadersReady headersReady,
+                                ReceiveData receiveData,
+                                ResponseComplete responseComplete,
+                                void *additionalParams,
+                                ResponseFailed responseFailed)
+{
+  _headersReady = headersReady;
+  _receiveData = receiveData;
+  _responseComplete = responseComplete;
+  _additionalParams = additionalParams;
+  _responseFailed = responseFailed;
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::sendRequest(HttpError &error,
+                              const char *method,
+                              const char *url,
+                              const char *headers[],
+                              const unsigned char *body,
+                              int sizeOfBody)
+{
+  return makeRequest(method, url, headers, body, sizeOfBody) || report(error);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::sendFileRequest(HttpError &error,
+                                  const char *method,
+                                  const char *url,
+                                  const char *headers[],
+                                  int fd,
+                                  off_t offset,
+                                  off_t length)
+{
+  return makeFileRequest(method, url, headers, fd, offset, length) || report(error);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::sendChunkedRequest(HttpError &error,
+                                     const char *method,
+                                     const char *url,
+                                     const char *headers[],
+                                     ProduceBody produceBody,
+                                     void *additionalParams)
+{
+  return makeChunkedRequest(method, url, headers, produceBody, additionalParams) || report(error);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::processRequest(HttpError &error, int timeoutMs)
+{
+  return process(timeoutMs) || report(error);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::waitForResponses(HttpError &error, int timeoutMs)
+{
+  long long deadline = TimerWheel::now() + timeoutMs;
+
+  error.clear();
+
+  while (!_pendingResponses.empty())
+  {
+    int wait = -1;
+
+    if (timeoutMs >= 0)
+    {
+      long long remaining = deadline - TimerWheel::now();
+
+      if (remaining <= 0) break;
+
+      wait = (int)remaining;
+    }
+
+    if (!process(wait))
+    {
+      return report(error);
+    }
+  }
+
+  return _pendingResponses.empty();
+}
+
+
+//-----------------------------------------------------------------------------
+// The response takes no more data; the call that was passing it data sees
+// it failed and reports the error.
+void HttpRequest::failResponse(const HttpResponse *response, const char *format, ...)
+{
+  if (response->completed() || response->failed())
+  {
+    return;
+  }
+
+  const_cast<HttpResponse*>(response)->_state = HttpResponse::Failed;
+
+  va_list ap;
+  va_start(ap, format);
+
+  _error.vset(HttpError::Aborted, format, ap);
+
+  va_end(ap);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::initSocket(HttpError &error)
+{
+  return openSocket() || report(error);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::initRequest(HttpError &error, const char *method, const char *url)
+{
+  return startRequest(method, url) || report(error);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::addHeader(HttpError &error, const char *name, const char *value)
+{
+  return appendHeader(name, value) || report(error);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::addHeader(HttpError &error, const char *name, int numericValue)
+{
+  char data[32];
+  snprintf(data, sizeof(data), "%d", numericValue);
+  return addHeader(error, name, data);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::addHeader(HttpError &error, const char *name, long long numericValue)
+{
+  char data[32];
+  snprintf(data, sizeof(data), "%lld", numericValue);
+  return addHeader(error, name, data);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::sendHeaders(HttpError &error)
+{
+  return sendHead(0, 0) || report(error);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::sendHeaders(HttpError &error, const unsigned char *body, int sizeOfBody)
+{
+  return sendHead(body, sizeOfBody) || report(error);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::send(HttpError &error, const unsigned char *data, int sizeOfData)
+{
+  return sendBody(data, sizeOfData) || report(error);
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Record why the call under way failed. Return false.
+bool HttpRequest::fail(HttpError::Code code, const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+
+  _error.vset(code, format, ap);
+
+  va_end(ap);
+
+  return false;
+}
+
+
+//-----------------------------------------------------------------------------
+// fail() with the errno of a system call. A closed connection is Closed.
+bool HttpRequest::socketError(const char *context)
+{
+  int error = errno;
+  HttpError::Code code = (error == EPIPE || error == ECONNRESET) ? HttpError::Closed : HttpError::System;
+
+  return fail(code, "%s: %s", context, strerror(error));
+}
+
+
+//-----------------------------------------------------------------------------
+// A public call failed: pass on what fail() recorded. Only here, with none
+// of the connection's code on the stack, is a failed connection dropped.
+// Usage errors leave it as it is. Return false.
+bool HttpRequest::report(HttpError &error)
+{
+  if (_error.code() != HttpError::Usage)
+  {
+    abandon();
+  }
+
+  error = _error;
+
+  return false;
+}
+
+
+//-----------------------------------------------------------------------------
+// Drop the connection after an error. The ResponseFailed callback hears of
+// each response lost with it; requests it makes go on a new connection.
+void HttpRequest::abandon()
+{
+  HttpError error = _error;
+  int lost = _pendingResponses.size();
+
+  closeSocket();
+
+  while (lost-- > 0 && !_pendingResponses.empty())
+  {
+    HttpResponse *response = _pendingResponses.front();
+
+    if (_responseFailed && !response->completed())
+    {
+      (_responseFailed)(response, _additionalParams, error);
+    }
+
+    popResponse();
+  }
+
+  _error = error;
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::makeRequest(const char *method,
+                              const char *url,
+                              const char *headers[],
+                              const unsigned char *body,
+                              int sizeOfBody)
+{
+  if (!startRequest(method, url))
+  {
+    return false;
+  }
+
+  if (body && !findHeader(headers, "content-length"))
+  {
+    char length[32];
+    snprintf(length, sizeof(length), "%d", sizeOfBody);
+    appendHeader("Content-Length", length);
+  }
+
+  // Head and body go out together
+  return addHeaders(headers) && sendHead(body, sizeOfBody);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::makeFileRequest(const char *method,
+                                  const char *url,
+                                  const char *headers[],
+                                  int fd,
+                                  off_t offset,
+                                  off_t length)
+{
+  struct stat st;
+
+  if (fstat(fd, &st) < 0)
+  {
+    return fail(HttpError::Usage, "fstat(): %s", strerror(errno));
+  }
+
+  if (length < 0)
+  {
+    if (!S_ISREG(st.st_mode))
+    {
+      return fail(HttpError::Usage, "sendFileRequest(): length required unless fd is a file");
+    }
+
+    length = st.st_size - offset;
+  }
+
+  if (!waitPipelineDrained() || !startRequest(method, url))
+  {
+    return false;
+  }
+
+  if (!findHeader(headers, "content-length"))
+  {
+    char value[32];
+    snprintf(value, sizeof(value), "%lld", (long long)length);
+    appendHeader("Content-Length", value);
+  }
+
+  if (!addHeaders(headers))
+  {
+    return false;
+  }
+
+  assert(_state == InProgress);
+
+  _state = Idle;
+  _requestHead += "\r\n";
+
+  if (!startStreaming(_pendingResponses.back()))
+  {
+    return false;
+  }
+
+  if (_http2Connection)
+  {
+    _sendingStream = _http2Connection->startStream(_pendingResponses.back(), _requestHead);
+
+    if (!_sendingStream)
+    {
+      return false;
+    }
+  }
+  // MSG_MORE: let the head share a segment with the start of the body.
+  else if (!send((const unsigned char*)_requestHead.data(), _requestHead.size(), 0, 0, MSG_MORE))
+  {
+    return false;
+  }
+
+  return sendFile(fd, offset, length);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::makeChunkedRequest(const char *method,
+                                     const char *url,
+                                     const char *headers[],
+                                     ProduceBody produceBody,
+                                     void *additionalParams)
+{
+  if (!waitPipelineDrained() || !startRequest(method, url))
+  {
+    return false;
+  }
+
+  if (!findHeader(headers, "transfer-encoding"))
+  {
+    appendHeader("Transfer-Encoding", "chunked");
+  }
+
+  if (!addHeaders(headers))
+  {
+    return false;
+  }
+
+  assert(_state == InProgress);
+
+  _state = Idle;
+  _requestHead += "\r\n";
+
+  if (!startStreaming(_pendingResponses.back()))
+  {
+    return false;
+  }
+
+  if (_http2Connection)
+  {
+    _sendingStream = _http2Connection->startStream(_pendingResponses.back(), _requestHead);
+
+    if (!_sendingStream)
+    {
+      return false;
+    }
+  }
+  else if (!send((const unsigned char*)_requestHead.data(), _requestHead.size(), 0, 0, MSG_MORE))
+  {
+    return false;
+  }
+
+  // Room for the chunk length line in front of the data and CRLF after it.
+  const int prefix = 10;
+  std::vector<unsigned char> buffer(prefix + MaxChunkSize + 2);
+
+  unsigned char *data = &buffer[prefix];
+
+  while (true)
+  {
+    int size = (produceBody)(additionalParams, data, MaxChunkSize);
+
+    if (size < 0 || size > MaxChunkSize)
+    {
+      return fail(HttpError::Aborted, "sendChunkedRequest(): body aborted");
+    }
+
+    // HTTP/2 frames the data itself, no chunks needed.
+    if (_http2Connection)
+    {
+      if (!sendHttp2(data, size, size == 0))
+      {
+        return false;
+      }
+
+      if (size == 0) break;
+
+      continue;
+    }
+
+    // Last chunk
+    if (size == 0)
+    {
+      return sendBody((const unsigned char*)"0\r\n\r\n", 5);
+    }
+
+    char length[prefix + 1];
+    int lengthSize = snprintf(length, sizeof(length), "%x\r\n", size);
+
+    unsigned char *chunk = data - lengthSize;
+    memcpy(chunk, length, lengthSize);
+
+    data[size] = '\r';
+    data[size + 1] = '\n';
+
+    if (!sendBody(chunk, lengthSize + size + 2))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::process(int timeoutMs)
+{
+  if (_pendingResponses.empty()) return true;
+
+  // Sends made while processing (queued pipelined requests, HTTP/2 frames)
+  // keep to the same timeout, see waitWritable().
+  long long waitDeadline = _waitDeadline;
+  _waitDeadline = (timeoutMs >= 0) ? TimerWheel::now() + timeoutMs : -1;
+
+  int readable = waitReadable(timeoutMs);
+
+  bool processed = (readable == 0 || (readable > 0 && processEvents())) && checkTimeouts();
+
+  _waitDeadline = waitDeadline;
+
+  return processed;
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpRequest::cleanUp()
+{
+  closeSocket();
+
+  // Clear out any pending responses
+  while (!_pendingResponses.empty())
+  {
+    popResponse();
+  }
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::openSocket()
+{
+  if (_pooling && !_http2)
+  {
+    _socket = ConnectionPool::instance().acquire(_host, _port, _tls ? &_tlsConnection : 0);
+
+    if (_socket >= 0)
+    {
+      _stats->addReused();
+      _connectedBefore = true;
+      _resolved = 0;
+      _connected = 0;
+      _secured = 0;
+
+      return !_loop || _loop->watch(*this, _error);
+    }
+  }
+
+  SocketAddressList addresses;
+
+  if (!Resolver::instance().resolve(_host, addresses))
+  {
+    return fail(HttpError::Resolve, "Invalid IP Address or Hostname.");
+  }
+
+  _resolved = HttpStats::now();
+
+  _socket = Connector::connect(addresses, _port, _connectTimeout, _error);
+
+  if (_socket < 0)
+  {
+    return false;
+  }
+
+  _connected = HttpStats::now();
+  _secured = 0;
+
+  if (_tls)
+  {
+    _tlsConnection = new TlsConnection(_socket, _host, _port, _http2 ? Http2Protocols : 0);
+
+    if (!_tlsConnection->handshake(_connectTimeout, _error))
+    {
+      delete _tlsConnection;
+      _tlsConnection = 0;
+
+      ::close(_socket);
+      _socket = -1;
+      return false;
+    }
+
+    _secured = HttpStats::now();
+  }
+
+  // With TLS the server has the last word (ALPN).
+  if (_http2 && (!_tlsConnection || 0 == strcmp(_tlsConnection->alpn(), "h2")))
+  {
+    _http2Connection = new Http2Connection(*this);
+  }
+
+  _stats->addConnect();
+
+  if (_connectedBefore)
+  {
+    _stats->addReconnect();
+  }
+
+  _connectedBefore = true;
+
+  return !_loop || _loop->watch(*this, _error);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::startRequest(const char *method, const char *url)
+{
+  if (_state != Idle)
+  {
+    return fail(HttpError::Usage, "Request already started.");
+  }
+
+  _state = InProgress;
+  _reusable = false;
+
+  // Request line. The buffer keeps its memory from earlier requests.
+  _requestHead.clear();
+  _requestHead += method;
+  _requestHead += ' ';
+  _requestHead += url;
+  _requestHead += " HTTP/1.1\r\n";
+
+  appendHeader("Host", _host.c_str()); // For HTTP/1.1
+  appendHeader("Accept-Encoding", _decompress ? "gzip, deflate" : "identity");
+
+  HttpResponse *response = acquireResponse(method);
+  response->_timing.start = HttpStats::now();
+  response->_bodyFile = _bodyFile;
+  response->_bodySplice = _bodySplice;
+  _pendingResponses.push_back(response);
+
+  if (_responseTimeout > 0)
+  {
+    timers().schedule(*response, _responseTimeout);
+  }
+
+  if (_loop && _pendingResponses.size() == 1)
+  {
+    _loop->pendingChanged(true);
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::appendHeader(const char *name, const char *value)
+{
+  if (_state != InProgress)
+  {
+    return fail(HttpError::Usage, "addHeader() failed");
+  }
+
+  _requestHead += name;
+  _requestHead += ": ";
+  _requestHead += value;
+  _requestHead += "\r\n";
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::sendHead(const unsigned char *body, int sizeOfBody)
+{
+  assert(_state == InProgress);
+
+  // Answered from the HttpCache, nothing to send. Unless a callback failed
+  // the response, see useCache().
+  if (_caching && !body && useCache(_pendingResponses.back()))
+  {
+    return _pendingResponses.empty() || !_pendingResponses.back()->failed();
+  }
+
+  _state = Idle;
+  _requestHead += "\r\n";
+
+  if (pipelining())
+  {
+    // Keep the request until its response starts, it may need a replay.
+    HttpResponse *response = _pendingResponses.back();
+
+    response->_requestData.assign(_requestHead);
+
+    if (body)
+    {
+      response->_requestData.append((const char*)body, sizeOfBody);
+    }
+
+    return sendPending();
+  }
+
+  if (!startSending(_pendingResponses.back()))
+  {
+    return false;
+  }
+
+  if (_http2Connection)
+  {
+    _sendingStream = _http2Connection->startStream(_pendingResponses.back(), _requestHead);
+    return _sendingStream && sendHttp2(body, body ? sizeOfBody : 0);
+  }
+
+  return send((const unsigned char*)_requestHead.data(), _requestHead.size(), body, sizeOfBody);
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::sendBody(const unsigned char *data, int sizeOfData)
+{
+  if (_http2Connection)
+  {
+    return sendHttp2(data, sizeOfData);
+  }
+
+  if (pipelining() && !_pendingResponses.empty())
+  {
+    HttpResponse *response = _pendingResponses.back();
+
+    response->_requestData.append((const char*)data, sizeOfData);
+
+    // Still queued: goes out with the rest of the request.
+    if (!response->_sent) return true;
+  }
+
+  return send(data, sizeOfData, 0, 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// write(), the server closing the connection being an error too.
+bool HttpRequest::send(const unsigned char *data, int sizeOfData,
+                       const unsigned char *moreData, int sizeOfMoreData,
+                       int flags)
+{
+  int written = write(data, sizeOfData, moreData, sizeOfMoreData, flags);
+
+  if (written == 0)
+  {
+    return socketError("send()");
+  }
+
+  return (written > 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Send two buffers with as few sendmsg() calls as possible, so a small
+// request leaves in a single TCP segment.
+// Return 1 when sent, 0 (with errno set) if the server closed the
+// connection, -1 if it failed.
+int HttpRequest::write(const unsigned char *data, int sizeOfData,
+                       const unsigned char *moreData, int sizeOfMoreData,
+                       int flags)
+{
+  if (_socket < 0 && !openSocket())
+  {
+    return -1;
+  }
+
+  if (_tlsConnection)
+  {
+    return writeTls(data, sizeOfData, moreData, sizeOfMoreData);
+  }
+
+  struct iovec iov[2];
+  iov[0].iov_base = (void*)data;
+  iov[0].iov_len = (data ? sizeOfData : 0);
+  iov[1].iov_base = (void*)moreData;
+  iov[1].iov_len = (moreData ? sizeOfMoreData : 0);
+
+  struct iovec *next = iov;
+  int count = 2;
+
+  while (count > 0)
+  {
+    // Skip empty (or fully sent) buffers
+    if (next->iov_len == 0)
+    {
+      next++;
+      count--;
+      continue;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = next;
+    msg.msg_iovlen = count;
+
+    ssize_t bytesSent = sendmsg(_socket, &msg, MSG_NOSIGNAL | flags);
+
+    if (bytesSent < 0)
+    {
+      // Non-blocking socket (see EventLoop): wait until it drains.
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        if (!waitWritable()) return -1;
+        continue;
+      }
+
+      if (errno == EINTR) continue;
+
+      if (errno == EPIPE || errno == ECONNRESET) return 0;
+
+      socketError("send()");
+      return -1;
+    }
+
+    _stats->addBytesOut(bytesSent);
+
+    // Advance past what was sent
+    while (count > 0 && bytesSent >= (ssize_t)next->iov_len)
+    {
+      bytesSent -= next->iov_len;
+      next++;
+      count--;
+    }
+
+    if (count > 0)
+    {
+      next->iov_base = (char*)next->iov_base + bytesSent;
+      next->iov_len -= bytesSent;
+    }
+  }
+
+  return 1;
+}
+
+
+//-----------------------------------------------------------------------------
+// write() for a TLS connection.
+int HttpRequest::writeTls(const unsigned char *data, int sizeOfData,
+                          const unsigned char *moreData, int sizeOfMoreData)
+{
+  if (!data) sizeOfData = 0;
+  if (!moreData) sizeOfMoreData = 0;
+
+  // Each write is a TLS record of its own; a small request goes out in one.
+  if (sizeOfData > 0 && sizeOfMoreData > 0 && sizeOfData + sizeOfMoreData <= MaxChunkSize)
+  {
+    _tlsBuffer.assign((const char*)data, sizeOfData);
+    _tlsBuffer.append((const char*)moreData, sizeOfMoreData);
+
+    data = (const unsigned char*)_tlsBuffer.data();
+    sizeOfData = _tlsBuffer.size();
+    sizeOfMoreData = 0;
+  }
+
+  int written = 1;
+
+  if (sizeOfData > 0)
+  {
+    written = _tlsConnection->write(data, sizeOfData, _error);
+  }
+
+  if (written > 0 && sizeOfMoreData > 0)
+  {
+    written = _tlsConnection->write(moreData, sizeOfMoreData, _error);
+  }
+
+  if (written > 0)
+  {
+    _stats->addBytesOut(sizeOfData + sizeOfMoreData);
+  }
+
+  return written;
+}
+
+
+//-----------------------------------------------------------------------------
+// Read everything currently available on the socket.
+// Called by EventLoop when the socket becomes readable.
+// peerClosed: the EventLoop saw the other end close. Its edge-triggered
+// events won't report the end of the data again, so read until it.
+// Return false if the connection failed.
+bool HttpRequest::processEvents(bool peerClosed)
+{
+  int more = 1;
+
+  while (_socket >= 0 && (more = receive(peerClosed)) > 0)
+  {
+  }
+
+  return (more >= 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Read once from the socket into the receive buffer and pass the data to
+// the pending responses. Return 1 to read again, 0 when there is nothing
+// more to read for now, -1 if the connection failed.
+int HttpRequest::receive(bool peerClosed)
+{
+  _recvBuffer.reserve(_recvBuffer.size() + _readSize);
+
+  unsigned char *space;
+  int requested = _recvBuffer.writable(space);
+
+  if (requested > _readSize)
+  {
+    requested = _readSize;
+  }
+
+  int bytesReceived;
+
+  // The rest of a Body for the body file bypasses the buffer.
+  HttpResponse *splicing = 0;
+
+  if (_recvBuffer.empty() && !_tlsConnection && !_http2Connection &&
+      !_pendingResponses.empty() && _pendingResponses.front()->spliceable())
+  {
+    splicing = _pendingResponses.front();
+    bytesReceived = spliceBody(splicing);
+  }
+  else if (_tlsConnection)
+  {
+    bytesReceived = _tlsConnection->read(space, requested, _error);
+  }
+  else
+  {
+    bytesReceived = recv(_socket, (char*)space, requested, MSG_DONTWAIT);
+  }
+
+  if (bytesReceived < 0)
+  {
+    if (errno == EINTR) return 1;
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+
+    // Already recorded, by TLS or spliceBody()
+    if (errno == EPROTO) return -1;
+
+    if (errno != ECONNRESET || !pipelining())
+    {
+      socketError(splicing ? "splice()" : "recv()");
+      return -1;
+    }
+
+    bytesReceived = 0; // Reset: replay like a close
+  }
+
+  // No more data in the socket
+  if (bytesReceived == 0)
+  {
+    _reusable = false;
+
+    // HTTP/2: streams not answered are lost. A request not yet sent goes
+    // out on a new connection.
+    if (_http2Connection)
+    {
+      int unanswered = _http2Connection->openStreams();
+
+      if (unanswered > 0)
+      {
+        fail(HttpError::Closed, "Connection closed with %d streams unanswered: %s:%d",
+             unanswered, _host.c_str(), _port);
+        return -1;
+      }
+
+      closeSocket();
+      return 0;
+    }
+
+    if (pipelining())
+    {
+      return replay() ? 0 : -1;
+    }
+
+    if (!_pendingResponses.empty())
+    {
+      // Unless the close ends the response, it stays for report().
+      if (!_pendingResponses.front()->connectionClosed())
+      {
+        return -1;
+      }
+
+      popResponse();
+    }
+
+    cleanUp();
+    return 0;
+  }
+
+  if (splicing)
+  {
+    _stats->addBytesIn(bytesReceived);
+
+    splicing->spliced(bytesReceived);
+
+    if (splicing->completed())
+    {
+      popResponse();
+    }
+
+    return processBuffer() ? 1 : -1;
+  }
+
+  _recvBuffer.commit(bytesReceived);
+  _stats->addBytesIn(bytesReceived);
+
+  // Adapt the read size: grow while reads fill it, shrink when they
+  // come back mostly empty. Measured against what was asked for, which
+  // is less than _readSize where the buffer wraps around.
+  if (bytesReceived == requested && requested == _readSize && _readSize < _maxReadSize)
+  {
+    _readSize = std::min(_readSize * 2, _maxReadSize);
+  }
+  else if (bytesReceived < requested / 8 && _readSize > InitialRecvSize)
+  {
+    _readSize /= 2;
+  }
+
+  if (!processBuffer())
+  {
+    return -1;
+  }
+
+  // A short read emptied the socket, no need to ask again, unless the
+  // end of the data is still to be seen. TLS reads stop at the end of a
+  // record, so they only tell by coming back empty.
+  return (bytesReceived == requested || peerClosed || _tlsConnection) ? 1 : 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// Move Body data of response from the socket to its body file through a
+// pipe, up to the end of the Body. Returns like recv(), with errno EPROTO
+// if it failed and recorded why.
+int HttpRequest::spliceBody(HttpResponse *response)
+{
+  if (_splicePipe[0] < 0)
+  {
+    if (pipe2(_splicePipe, O_CLOEXEC) < 0)
+    {
+      socketError("pipe2()");
+      errno = EPROTO;
+      return -1;
+    }
+
+    // Room for a whole read, if allowed
+    fcntl(_splicePipe[1], F_SETPIPE_SZ, _maxReadSize);
+  }
+
+  // splice() only returns at once from a non-blocking socket.
+  if (_nonBlocking != _socket)
+  {
+    int flags = fcntl(_socket, F_GETFL);
+
+    if (flags < 0 || fcntl(_socket, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+      socketError("fcntl()");
+      errno = EPROTO;
+      return -1;
+    }
+
+    _nonBlocking = _socket;
+  }
+
+  long long size = _maxReadSize;
+
+  if (response->_contentLength != -1)
+  {
+    size = std::min(size, response->_contentLength - response->_bytesRead);
+  }
+
+  ssize_t received = splice(_socket, 0, _splicePipe[1], 0, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+  if (received <= 0)
+  {
+    return received;
+  }
+
+  for (ssize_t left = received; left > 0; )
+  {
+    ssize_t written = splice(_splicePipe[0], 0, response->_bodyFile, 0, left, SPLICE_F_MOVE);
+
+    if (written < 0 && errno == EINTR)
+      continue;
+
+    if (written <= 0)
+    {
+      int error = errno;
+
+      // What is left in the pipe belongs to no one.
+      ::close(_splicePipe[0]);
+      ::close(_splicePipe[1]);
+      _splicePipe[0] = _splicePipe[1] = -1;
+
+      fail(HttpError::System, "splice() of body: %s", strerror(error));
+      errno = EPROTO;
+      return -1;
+    }
+
+    left -= written;
+  }
+
+  return received;
+}
+
+
+//-----------------------------------------------------------------------------
+// Pass the data in the receive buffer to the pending responses. Return
+// false if one of them failed.
+bool HttpRequest::processBuffer()
+{
+  // HTTP/2 frames, for any of the streams
+  if (_http2Connection)
+  {
+    return _http2Connection->process(_recvBuffer);
+  }
+
+  while (!_recvBuffer.empty() && !_pendingResponses.empty())
+  {
+    HttpResponse *response = _pendingResponses.front();
+
+    const unsigned char *data;
+    int available = _recvBuffer.readable(data);
+
+    int bytesHandled = response->processResponse(data, available);
+
+    _recvBuffer.consume(bytesHandled);
+
+    if (response->failed())
+    {
+      return false;
+    }
+
+    // Too late to replay, don't hold on to the request.
+    if (!response->_requestData.empty())
+    {
+      response->dropRequestData();
+    }
+
+    if (response->completed())
+    {
+      popResponse();
+      continue;
+    }
+
+    if (bytesHandled < available)
+    {
+      // An incomplete line stays in the buffer. If it wraps around the
+      // end of the buffer, make it contiguous and look again.
+      if (_recvBuffer.size() > available - bytesHandled)
+      {
+        _recvBuffer.linearize();
+        continue;
+      }
+
+      break;
+    }
+  }
+
+  // Nothing is waiting for this data
+  if (_pendingResponses.empty())
+  {
+    _recvBuffer.clear();
+  }
+
+  return !pipelining() || sendPending();
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpRequest::popResponse()
+{
+  HttpResponse *response = _pendingResponses.front();
+
+  _reusable = response->completed() && !response->autoClose();
+
+  removeResponse(response);
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpRequest::removeResponse(HttpResponse *response)
+{
+  _pendingResponses.remove(response);
+
+  if (!response->completed())
+  {
+    _stats->addError();
+  }
+
+  releaseResponse(response);
+
+  if (_loop && _pendingResponses.empty())
+  {
+    _loop->pendingChanged(false);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// Reuse a completed response if there is one: its strings, headers and
+// buffers keep their memory, so a request in the steady state allocates
+// nothing.
+HttpResponse* HttpRequest::acquireResponse(const char *method)
+{
+  if (_freeResponses.empty())
+  {
+    return new HttpResponse(method, *this);
+  }
+
+  HttpResponse *response = _freeResponses.pop_front();
+  response->reset(method);
+
+  return response;
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpRequest::releaseResponse(HttpResponse *response)
+{
+  // Its deadline must not fire while it waits for reuse.
+  response->cancel();
+
+  if (response->_cacheEntry)
+  {
+    HttpCache::instance().release(response->_cacheEntry);
+    response->_cacheEntry = 0;
+  }
+
+  if (_freeResponses.size() >= MaxFreeResponses)
+  {
+    delete response;
+    return;
+  }
+
+  _freeResponses.push_back(response);
+}
+
+
+//-----------------------------------------------------------------------------
+// Look for the GET request being built in the HttpCache. Return true if a
+// fresh response was replayed to response, which is then done with, unless
+// a callback failed it. A stale one is revalidated: the request gets its
+// validators as conditions.
+bool HttpRequest::useCache(HttpResponse *response)
+{
+  if (response->_method != "GET"                       ||
+      hasHeader(_requestHead, "if-none-match")         ||
+      hasHeader(_requestHead, "if-modified-since")     ||
+      hasHeader(_requestHead, "range")                 ||
+      hasHeader(_requestHead, "cache-control")         ||
+      hasHeader(_requestHead, "pragma"))
+  {
+    return false;
+  }
+
+  // Absolute URL, and whether the Body is stored decompressed
+  size_t urlStart = _requestHead.find(' ') + 1;
+  size_t urlEnd = _requestHead.find(' ', urlStart);
+
+  std::string &key = response->_cacheKey;
+  char port[16];
+  snprintf(port, sizeof(port), ":%d", _port);
+
+  key.assign(_tls ? "https://" : "http://");
+  key += _host;
+  key += port;
+  key.append(_requestHead, urlStart, urlEnd - urlStart);
+
+  if (_decompress)
+  {
+    key += " decompressed";
+  }
+
+  response->_caching = true;
+
+  bool fresh = false;
+  CachedResponse *entry = HttpCache::instance().lookup(key, fresh);
+
+  if (!entry)
+  {
+    return false;
+  }
+
+  if (fresh)
+  {
+    _state = Idle;
+
+    response->replay(*entry);
+    HttpCache::instance().release(entry);
+
+    _stats->addCacheHit();
+
+    if (!response->failed())
+    {
+      removeResponse(response);
+    }
+
+    return true;
+  }
+
+  if (entry->etag.empty() && entry->lastModified.empty())
+  {
+    HttpCache::instance().release(entry);
+    return false;
+  }
+
+  response->_cacheEntry = entry;
+
+  if (!entry->etag.empty())
+  {
+    appendHeader("If-None-Match", entry->etag.c_str());
+  }
+
+  if (!entry->lastModified.empty())
+  {
+    appendHeader("If-Modified-Since", entry->lastModified.c_str());
+  }
+
+  return false;
+}
+
+
+//-----------------------------------------------------------------------------
+// Called by HttpResponse::complete() to record its latencies.
+void HttpRequest::responseCompleted(const HttpResponse &response)
+{
+  _stats->addRequest();
+
+  const HttpResponse::Timing &timing = response._timing;
+
+  // Nothing was sent when answered from the HttpCache.
+  if (timing.start == 0 || timing.sent == 0)
+  {
+    return;
+  }
+
+  _stats->total().record((timing.complete - timing.start) / 1000);
+
+  if (timing.received)
+  {
+    _stats->firstByte().record((timing.received - timing.start) / 1000);
+  }
+
+  // Until the connection could be used
+  long long connected = timing.secured ? timing.secured : timing.connected;
+
+  if (connected)
+  {
+    _stats->connect().record((connected - timing.start) / 1000);
+  }
+}
 
 
 //-----------------------------------------------------------------------------
-// Convert IP or Hostname into a usable IP structure (in_addr).
-struct in_addr* addressToIP(const char *address)
+// The request of response is about to be written. Connect if need be and
+// note the time, and that of the connection if it is new.
+bool HttpRequest::startSending(HttpResponse *response)
 {
-  // Case for IP address like: www.xxx.yyy.zzz 
-  static struct in_addr addr;
+  if (_http2Connection && !waitForStream())
+  {
+    return false;
+  }
+
+  if (_socket < 0 && !openSocket())
+  {
+    return false;
+  }
+
+  HttpResponse::Timing &timing = response->_timing;
+
+  // A replayed request keeps the times of its first attempt.
+  if (timing.sent == 0)
+  {
+    timing.sent = HttpStats::now();
+    timing.resolved = _resolved;
+    timing.connected = _connected;
+    timing.secured = _secured;
+  }
+
+  _resolved = 0;
+  _connected = 0;
+  _secured = 0;
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Sleep until the socket is writable. A response deadline, or the end of
+// the processRequest() wait, passing first fails with HttpError::Timeout:
+// the request is partly sent and can't be finished later.
+bool HttpRequest::waitWritable()
+{
+  return waitReady(_socket, POLLOUT);
+}
+
+
+//-----------------------------------------------------------------------------
+// waitWritable() for any fd and events, e.g. the input of sendFileRequest().
+// POLLERR and POLLHUP count as ready: the next call on fd reports them.
+bool HttpRequest::waitReady(int fd, short events)
+{
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = events;
+
+  while (true)
+  {
+    TimerWheel *wheel = _loop ? &_loop->_timers : _timers;
+
+    int timeoutMs = wheel ? wheel->nextTimeout() : -1;
+
+    if (_waitDeadline >= 0)
+    {
+      long long remaining = std::max(_waitDeadline - TimerWheel::now(), 0LL);
+
+      if (timeoutMs < 0 || remaining < timeoutMs)
+      {
+        timeoutMs = (int)remaining;
+      }
+    }
+
+    pfd.revents = 0;
+
+    int r = poll(&pfd, 1, timeoutMs);
+
+    if (r > 0)
+    {
+      if (pfd.revents & POLLNVAL)
+      {
+        return fail(HttpError::Usage, "poll(): fd %d is not open", fd);
+      }
+
+      return true;
+    }
+
+    if (r < 0 && errno != EINTR)
+    {
+      return socketError("poll()");
+    }
+
+    if (wheel)
+    {
+      wheel->advance();
+    }
+
+    if (_timedOut)
+    {
+      // Failed here, not by the EventLoop as well.
+      _timedOut = false;
+
+      if (_loop)
+      {
+        std::vector<HttpRequest*> &timedOut = _loop->_timedOut;
+        timedOut.erase(std::remove(timedOut.begin(), timedOut.end(), this), timedOut.end());
+      }
+
+      return fail(HttpError::Timeout, "Response timed out while sending: %s:%d", _host.c_str(), _port);
+    }
+
+    if (_waitDeadline >= 0 && TimerWheel::now() >= _waitDeadline)
+    {
+      return fail(HttpError::Timeout, "Timed out sending: %s:%d", _host.c_str(), _port);
+    }
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// Wait until the HTTP/2 connection can take another stream. One that can't
+// take any more (GOAWAY, stream IDs used up) is closed once its streams are
+// done, for a new one.
+bool HttpRequest::waitForStream()
+{
+  while (_http2Connection && !_http2Connection->canStartStream())
+  {
+    if (_http2Connection->openStreams() == 0)
+    {
+      closeSocket();
+      break;
+    }
+
+    if (!process(-1))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Send body data of the request being sent on its HTTP/2 stream, waiting
+// for the server to open the flow control windows as need be. last ends a
+// body of unknown length.
+bool HttpRequest::sendHttp2(const unsigned char *data, int sizeOfData, bool last)
+{
+  while (true)
+  {
+    int sent = _http2Connection->sendData(_sendingStream, data, sizeOfData, last);
+
+    if (sent < 0) return false;
+
+    data += sent;
+    sizeOfData -= sent;
+
+    if (sizeOfData == 0) return true;
+
+    if (!process(-1))
+    {
+      return false;
+    }
+
+    if (!_http2Connection)
+    {
+      return fail(HttpError::Closed, "Connection closed while sending: %s:%d", _host.c_str(), _port);
+    }
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+TimerWheel& HttpRequest::timers()
+{
+  if (_loop)
+  {
+    return _loop->_timers;
+  }
+
+  if (!_timers)
+  {
+    _timers = new TimerWheel();
+  }
+
+  return *_timers;
+}
+
+
+//-----------------------------------------------------------------------------
+// Called by HttpResponse::expired(). The connection is torn down afterwards
+// by checkTimeouts() or the EventLoop, outside of the TimerWheel.
+void HttpRequest::responseTimedOut()
+{
+  if (_timedOut) return;
+
+  _timedOut = true;
+  _stats->addTimeout();
+
+  if (_loop)
+  {
+    _loop->_timedOut.push_back(this);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+bool HttpRequest::checkTimeouts()
+{
+  if (_loop || !_timers) return true;
+
+  _timers->advance();
+
+  if (_timedOut)
+  {
+    _timedOut = false;
+    return fail(HttpError::Timeout, "Response timed out: %s:%d", _host.c_str(), _port);
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Sleep until the socket is readable, timeoutMs passed (-1 is forever)
+// or the next response deadline is reached. Return 1 if readable, -1 if
+// poll() failed.
+int HttpRequest::waitReadable(int timeoutMs)
+{
+  if (_timers && !_loop)
+  {
+    int next = _timers->nextTimeout();
+
+    if (next >= 0 && (timeoutMs < 0 || next < timeoutMs))
+    {
+      timeoutMs = next;
+    }
+  }
+
+  struct pollfd pfd;
+  pfd.fd = _socket;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  int r = poll(&pfd, 1, timeoutMs);
 
-  if (inet_aton(address, &addr) != 0)
+  if (r < 0)
   {
-    return &addr;
+    if (errno == EINTR) return 0;
+
+    socketError("poll()");
+    return -1;
   }
 
-  // Case for hostname
-  struct hostent *host;
+  return (r > 0) ? 1 : 0;
+}
 
-  host = gethostbyname(address);
 
-  if (host)
+//-----------------------------------------------------------------------------
+void HttpRequest::closeSocket()
+{
+  if (_socket >= 0)
   {
-    return (struct in_addr*)*host->h_addr_list;
+    if (_loop)
+    {
+      _loop->unwatch(*this);
+    }
+
+    // Keep-alive connection with nothing in flight, let someone else use it.
+    if (_pooling && _reusable && _pendingResponses.empty() && _state == Idle && !_http2Connection)
+    {
+      ConnectionPool::instance().release(_host, _port, _socket, _tlsConnection);
+    }
+    else
+    {
+      delete _tlsConnection;
+      ::close(_socket);
+    }
   }
 
-  return 0;
+  delete _http2Connection;
+
+  _socket = -1;
+  _nonBlocking = -1;
+  _tlsConnection = 0;
+  _http2Connection = 0;
+  _reusable = false;
+
+  _recvBuffer.clear();
+  _readSize = InitialRecvSize;
 }
 
 
 //-----------------------------------------------------------------------------
-void socketError(const char *context)
+// Send queued requests, in order, as far as the pipelining rules allow.
+bool HttpRequest::sendPending()
 {
-  const char *msg = strerror(errno);
-  throw HttpException("%s: %s", context, msg);
+  int inFlight = 0;
+  bool idempotent = true; // Everything in flight is idempotent
+
+  HttpResponse *response;
+
+  for (response = _pendingResponses.front(); response; response = ResponseQueue::next(response))
+  {
+    if (response->_sent)
+    {
+      // Once its response has started a request won't be replayed, so it
+      // no longer holds back the ones after it.
+      inFlight++;
+      idempotent = idempotent && (response->idempotent() || response->_started);
+      continue;
+    }
+
+    // Keep the order: stop at the first request that has to wait.
+    if (inFlight >= _pipelineDepth)
+    {
+      break;
+    }
+
+    if (inFlight > 0 && !(idempotent && response->idempotent()))
+    {
+      break;
+    }
+
+    // Still being built by initRequest()/addHeader()
+    if (response == _pendingResponses.back() && _state == InProgress)
+    {
+      break;
+    }
+
+    response->_sent = true;
+
+    if (!startSending(response))
+    {
+      return false;
+    }
+
+    const std::string &data = response->_requestData;
+    int written = write((const unsigned char*)data.data(), data.size(), 0, 0);
+
+    if (written < 0)
+    {
+      return false;
+    }
+
+    if (written == 0)
+    {
+      // Stale connection; replay() reconnects and starts over.
+      return replay();
+    }
+
+    inFlight++;
+    idempotent = idempotent && response->idempotent();
+  }
+
+  return true;
 }
 
 
 //-----------------------------------------------------------------------------
-bool moreData(int socket)
+// The connection dropped while pipelining. Finish the response in progress
+// if the close completes it, then send the unanswered requests again on a
+// new connection.
+bool HttpRequest::replay()
 {
-  fd_set fds;
-  FD_ZERO(&fds);
-  FD_SET(socket, &fds);
-
-  struct timeval tv;
-  tv.tv_sec = 0;
-  tv.tv_usec = 0;
+  if (!_pendingResponses.empty() && _pendingResponses.front()->_started)
+  {
+    HttpResponse *response = _pendingResponses.front();
 
-  int r = select(socket + 1, &fds, NULL, NULL, &tv);
+    // Fails unless the response was close-delimited
+    if (!response->connectionClosed())
+    {
+      return false;
+    }
 
-  if (r < 0)
-  {
-    socketError("select()");
+    popResponse();
   }
 
-  if (FD_ISSET(socket, &fds))
+  _reusable = false;
+  closeSocket();
+
+  if (_pendingResponses.empty())
   {
     return true;
   }
-  else
-  {
-    return false;
-  }
-}
 
+  HttpResponse *response;
 
+  for (response = _pendingResponses.front(); response; response = ResponseQueue::next(response))
+  {
+    if (!response->_sent)
+    {
+      continue;
+    }
 
+    // The server may have acted on these, or keeps dropping them.
+    if (!response->idempotent() || response->_replays >= MaxReplays)
+    {
+      return fail(HttpError::Closed, "Connection closed with %d requests unanswered: %s:%d",
+                  _pendingResponses.size(), _host.c_str(), _port);
+    }
 
+    response->_sent = false;
+    response->_replays++;
+  }
 
-//-----------------------------------------------------------------------------
-HttpRequest::HttpRequest(const char *host, int port) :
-  _headersReady(0),
-  _receiveData(0),
-  _responseComplete(0),
-  _additionalParams(0),
-  _state(Idle),
-  _host(host),
-  _port(port),
-  _socket(-1)
-{
+  return sendPending();
 }
 
 
 //-----------------------------------------------------------------------------
-HttpRequest::~HttpRequest()
+// Add an array of name/value pairs terminated by NULL (0).
+bool HttpRequest::addHeaders(const char *headers[])
 {
-  cleanUp();
-}
+  if (!headers) return true;
 
+  const char **itr = headers;
 
-//-----------------------------------------------------------------------------
-void HttpRequest::initCallbacks(HeadersReady headersReady,
-                                ReceiveData receiveData,
-                                ResponseComplete responseComplete,
-                                void *additionalParams)
-{
-  _headersReady = headersReady;
-  _receiveData = receiveData;
-  _responseComplete = responseComplete;
-  _additionalParams = additionalParams;
+  while (*itr)
+  {
+    const char *name = *itr++;
+    const char *value = *itr++;
+
+    if (!appendHeader(name, value))
+    {
+      return false;
+    }
+  }
+
+  return true;
 }
 
 
 //-----------------------------------------------------------------------------
-void HttpRequest::sendRequest(const char *method,
-                              const char *url,
-                              const char *headers[],
-                              const unsigned char *body,
-                              int sizeOfBody)
+// Copy length bytes from fd to the socket inside the kernel.
+bool HttpRequest::sendFile(int fd, off_t offset, off_t length)
 {
-  bool hasContentLength = false;
+  struct stat st;
+  fstat(fd, &st);
 
-  // Check headers for content-length
-  if (headers)
+  // Pipes splice straight to the socket, anything else that isn't a
+  // file needs a pipe in between.
+  int pipeFds[2] = { -1, -1 };
+  bool regular = S_ISREG(st.st_mode);
+
+  if (_tlsConnection || _http2Connection)
   {
-    const char **itr = headers;
+    return sendFileCopy(fd, offset, length, regular);
+  }
 
-    while (*itr)
+  if (!regular && !S_ISFIFO(st.st_mode))
+  {
+    if (pipe2(pipeFds, O_CLOEXEC) < 0)
     {
-      const char *name = *itr++;
-      (void) *itr++;  //skip value
-
-      if (0 == strcasecmp(name, "content-length"))
-      {
-        hasContentLength = true;
-      }
+      return socketError("pipe2()");
     }
   }
 
-  initRequest(method, url);
+  int buffered = 0; // Bytes waiting in pipeFds
 
-  if (body && !hasContentLength)
+  while (length > 0 || buffered > 0)
   {
-    addHeader("Content-Length", sizeOfBody);
-  }
+    ssize_t n;
+    const char *context;
 
-  if (headers)
-  {
-    const char **itr = headers;
+    if (regular)
+    {
+      context = "sendfile()";
+      n = sendfile(_socket, fd, &offset, std::min(length, (off_t)0x40000000));
+    }
+    else if (pipeFds[0] < 0)
+    {
+      context = "splice()";
+      n = splice(fd, 0, _socket, 0, std::min(length, (off_t)0x40000000), SPLICE_F_MOVE | SPLICE_F_MORE);
+    }
+    else if (buffered == 0)
+    {
+      // Fill the intermediate pipe
+      n = splice(fd, 0, pipeFds[1], 0, std::min(length, (off_t)65536), SPLICE_F_MOVE);
+
+      if (n > 0)
+      {
+        buffered = n;
+        length -= n;
+        continue;
+      }
 
-    while (*itr)
+      context = "splice()";
+    }
+    else
+    {
+      context = "splice()";
+      n = splice(pipeFds[0], 0, _socket, 0, buffered, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+      if (n > 0)
+      {
+        _stats->addBytesOut(n);
+        buffered -= n;
+        continue;
+      }
+    }
+
+    if (n < 0)
     {
-      const char *name = *itr++;
-      const char *value = *itr++;
+      if (errno == EINTR) continue;
+
+      bool waited;
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        waited = socketError(context);
+      }
+      else if (regular || buffered > 0)
+      {
+        waited = waitWritable();
+      }
+      // Non-blocking input: filling the intermediate pipe waits for it, a
+      // direct splice for whichever side isn't ready.
+      else if (pipeFds[0] >= 0 || !inputReady(fd))
+      {
+        waited = waitReady(fd, POLLIN);
+      }
+      else
+      {
+        waited = waitWritable();
+      }
+
+      if (waited) continue;
+
+      if (pipeFds[0] >= 0)
+      {
+        ::close(pipeFds[0]);
+        ::close(pipeFds[1]);
+      }
+
+      return false;
+    }
 
-      addHeader(name, value);
+    if (n == 0)
+    {
+      break; // End of input
     }
+
+    _stats->addBytesOut(n);
+    length -= n;
   }
 
-  sendHeaders();
+  if (pipeFds[0] >= 0)
+  {
+    ::close(pipeFds[0]);
+    ::close(pipeFds[1]);
+  }
 
-  if (body)
+  if (length > 0)
   {
-    send(body, sizeOfBody);
+    // The server expects more than we have, the connection can't be used.
+    return fail(HttpError::System, "sendFileRequest(): body ended %lld bytes short", (long long)length);
   }
+
+  return true;
 }
 
 
 //-----------------------------------------------------------------------------
-void HttpRequest::processRequest()
+// Can fd be read without blocking (or does reading it fail right away)?
+bool HttpRequest::inputReady(int fd)
 {
-  if (_pendingResponses.empty()) return;
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
 
-  if (!moreData(_socket)) return;
+  return poll(&pfd, 1, 0) > 0;
+}
 
-  unsigned char data[MaxSocketRecvSize];
-  
-  int bytesReceived = recv(_socket, (char*)data, sizeof(data), 0);
 
-  if (bytesReceived < 0)
-  {
-    socketError("recv()");
-  }
+//-----------------------------------------------------------------------------
+// The kernel can't encrypt or frame, so with TLS or HTTP/2 the body passes
+// through user space.
+bool HttpRequest::sendFileCopy(int fd, off_t offset, off_t length, bool regular)
+{
+  unsigned char buffer[MaxChunkSize];
 
-  // No more data in the socket
-  if (bytesReceived == 0)
-  {
-    HttpResponse *response = _pendingResponses.front();
-    response->connectionClosed();
-    delete response;
-    _pendingResponses.pop_front();
-    cleanUp();
-  }
-  // Process Response(s)
-  else
+  while (length > 0)
   {
-    int totalBytesProcessed = 0;
+    int size = (int)std::min(length, (off_t)sizeof(buffer));
 
-    while (totalBytesProcessed < bytesReceived && !_pendingResponses.empty())
-    {
-      HttpResponse *response = _pendingResponses.front();
+    ssize_t n = regular ? pread(fd, buffer, size, offset) : read(fd, buffer, size);
 
-      int bytesHandled = response->processResponse(&data[totalBytesProcessed], bytesReceived - totalBytesProcessed);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
 
-      if (response->completed())
+      // Non-blocking pipe or socket
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
       {
-        delete response;
-        _pendingResponses.pop_front();
+        if (!waitReady(fd, POLLIN)) return false;
+        continue;
       }
 
-      totalBytesProcessed += bytesHandled;
+      return socketError("read()");
+    }
+
+    if (n == 0)
+    {
+      break; // End of input
+    }
+
+    bool sent = _http2Connection ? sendHttp2(buffer, n) : send(buffer, n, 0, 0);
+
+    if (!sent)
+    {
+      return false;
     }
+
+    offset += n;
+    length -= n;
   }
+
+  if (length > 0)
+  {
+    return fail(HttpError::System, "sendFileRequest(): body ended %lld bytes short", (long long)length);
+  }
+
+  return true;
 }
 
 
 //-----------------------------------------------------------------------------
-void HttpRequest::cleanUp()
+// startSending() for a request that sends its own body. It is on the wire
+// from here on, but can't be replayed: sendPending() must leave it alone
+// and replay() fails it.
+bool HttpRequest::startStreaming(HttpResponse *response)
 {
-  if (_socket >= 0)
-  {
-    ::close(_socket);
-  }
+  response->_sent = true;
+  response->_streamed = true;
 
-  _socket = -1;
+  return startSending(response);
+}
 
-  // Clear out any pending responses
-  while (!_pendingResponses.empty())
+
+//-----------------------------------------------------------------------------
+// Streamed bodies can't be kept for a replay, so they don't join a pipeline.
+bool HttpRequest::waitPipelineDrained()
+{
+  while (pipelining() && !_pendingResponses.empty())
   {
-    delete _pendingResponses.front();
-    _pendingResponses.pop_front();
+    if (!process(-1))
+    {
+      return false;
+    }
   }
+
+  return true;
 }
 
 
 
 
+#ifndef HTTP_NO_EXCEPTIONS
+
 //-----------------------------------------------------------------------------
-void HttpRequest::initSocket()
+void HttpRequest::sendRequest(const char *method,
+                              const char *url,
+                              const char *headers[],
+                              const unsigned char *body,
+                              int sizeOfBody)
 {
-  in_addr *ip = addressToIP(_host.c_str());
+  HttpError error;
 
-  if (!ip)
+  if (!sendRequest(error, method, url, headers, body, sizeOfBody))
   {
-    throw HttpException("Invalid IP Address or Hostname.");
+    throw HttpException(error);
   }
+}
 
-  sockaddr_in address;
-  memset((char*)&address, 0, sizeof(address));
-  address.sin_family = AF_INET;
-  address.sin_port = htons(_port);
-  address.sin_addr.s_addr = ip->s_addr;
 
-  _socket = socket(AF_INET, SOCK_STREAM, 0);
+//-----------------------------------------------------------------------------
+void HttpRequest::sendFileRequest(const char *method,
+                                  const char *url,
+                                  const char *headers[],
+                                  int fd,
+                                  off_t offset,
+                                  off_t length)
+{
+  HttpError error;
 
-  if (_socket < 0)
+  if (!sendFileRequest(error, method, url, headers, fd, offset, length))
   {
-    socketError("socket()");
+    throw HttpException(error);
   }
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpRequest::sendChunkedRequest(const char *method,
+                                     const char *url,
+                                     const char *headers[],
+                                     ProduceBody produceBody,
+                                     void *additionalParams)
+{
+  HttpError error;
 
-  if (::connect(_socket, (sockaddr const*)&address, sizeof(address)) < 0)
+  if (!sendChunkedRequest(error, method, url, headers, produceBody, additionalParams))
   {
-    socketError("connect()");
+    throw HttpException(error);
   }
 }
 
 
 //-----------------------------------------------------------------------------
-void HttpRequest::initRequest(const char *method, const char *url)
+void HttpRequest::processRequest(int timeoutMs)
 {
-  if (_state != Idle)
+  HttpError error;
+
+  if (!processRequest(error, timeoutMs))
   {
-    throw HttpException("Request already started.");
+    throw HttpException(error);
   }
+}
 
-  _state = InProgress;
 
-  char request[MaxRequestSize];
-  sprintf(request, "%s %s HTTP/1.1", method, url);
+//-----------------------------------------------------------------------------
+bool HttpRequest::waitForResponses(int timeoutMs)
+{
+  HttpError error;
 
-  _currRequest.push_back(request);
+  bool done = waitForResponses(error, timeoutMs);
 
-  addHeader("Host", _host.c_str()); // For HTTP/1.1
-  addHeader("Accept-Encoding", "identity");
+  if (error.failed())
+  {
+    throw HttpException(error);
+  }
 
-  HttpResponse *response = new HttpResponse(method, *this);
-  _pendingResponses.push_back(response);
+  return done;
 }
 
 
 //-----------------------------------------------------------------------------
-void HttpRequest::addHeader(const char *name, const char *value)
+void HttpRequest::initSocket()
 {
-  if (_state != InProgress)
+  HttpError error;
+
+  if (!initSocket(error))
   {
-    throw HttpException("addHeader() failed");
+    throw HttpException(error);
   }
-
-  _currRequest.push_back(std::string(name) + ": " + std::string(value));
 }
 
 
 //-----------------------------------------------------------------------------
-void HttpRequest::addHeader(const char *name, int numericValue)
+void HttpRequest::initRequest(const char *method, const char *url)
 {
-  char data[32];
-  sprintf(data, "%d", numericValue);
-  addHeader(name, data);
+  HttpError error;
+
+  if (!initRequest(error, method, url))
+  {
+    throw HttpException(error);
+  }
 }
 
 
 //-----------------------------------------------------------------------------
-void HttpRequest::sendHeaders()
+void HttpRequest::addHeader(const char *name, const char *value)
 {
-  assert(_state == InProgress);
+  HttpError error;
 
-  _state = Idle;
-  _currRequest.push_back("");
+  if (!addHeader(error, name, value))
+  {
+    throw HttpException(error);
+  }
+}
 
-  std::string msg;
-  std::vector<std::string>::const_iterator itr;
 
-  for(itr = _currRequest.begin(); itr != _currRequest.end(); itr++)
+//-----------------------------------------------------------------------------
+void HttpRequest::addHeader(const char *name, int numericValue)
+{
+  HttpError error;
+
+  if (!addHeader(error, name, numericValue))
   {
-    msg += (*itr) + "\r\n";
+    throw HttpException(error);
   }
+}
+
 
-  _currRequest.clear();
+//-----------------------------------------------------------------------------
+void HttpRequest::addHeader(const char *name, long long numericValue)
+{
+  HttpError error;
 
-  send((const unsigned char*)msg.c_str(), msg.size());
+  if (!addHeader(error, name, numericValue))
+  {
+    throw HttpException(error);
+  }
 }
 
 
 //-----------------------------------------------------------------------------
-void HttpRequest::send(const unsigned char *data, int sizeOfData)
+void HttpRequest::sendHeaders()
 {
-  if (_socket < 0)
+  HttpError error;
+
+  if (!sendHeaders(error))
   {
-    initSocket();
+    throw HttpException(error);
   }
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpRequest::sendHeaders(const unsigned char *body, int sizeOfBody)
+{
+  HttpError error;
 
-  while (sizeOfData > 0)
+  if (!sendHeaders(error, body, sizeOfBody))
   {
-    int bytesSent = ::send(_socket, data, sizeOfData, 0);
+    throw HttpException(error);
+  }
+}
 
-    if (bytesSent < 0)
-    {
-      socketError("send()");
-    }
 
-    sizeOfData -= bytesSent;
-    data += bytesSent;
+//-----------------------------------------------------------------------------
+void HttpRequest::send(const unsigned char *data, int sizeOfData)
+{
+  HttpError error;
+
+  if (!send(error, data, sizeOfData))
+  {
+    throw HttpException(error);
   }
 }
 
+#endif
@@ -12,36 +12,87 @@
 //   request.initCallbacks(foo, bar, baz, 0);
 //   request.sendRequest("GET", "/", 0, 0, 0);
 //
-//   while(request.responsesPending())
+//   request.waitForResponses(5000);
+//
+// To drive many requests at once, register them with an EventLoop
+// instead of calling processRequest() on each one.
+//
+// Each call that can fail also comes in a form that reports an HttpError
+// rather than throwing (the only form when built with HTTP_NO_EXCEPTIONS,
+// see HttpException.h):
+//
+//   HttpError error;
+//
+//   if (!request.sendRequest(error, "GET", "/") ||
+//       !request.waitForResponses(error, 5000))
 //   {
-//     request.processRequest();
+//     ...error.code(), error.message()...
 //   }
 //
+// Usage errors (a call out of order, an invalid argument) leave the
+// connection as it is. Any other error ends it: it is cleaned up, and the
+// ResponseFailed callback is told of each response that was pending.
+//
 
 #ifndef HTTP_REQUEST_H
 #define HTTP_REQUEST_H
 
+#include "HttpException.h"
 #include "HttpResponse.h"
+#include "RingBuffer.h"
+#include "TimerWheel.h"
 
-#include <deque>
+#include <algorithm>
 #include <string>
-#include <vector>
+
+#include <sys/types.h>
 
 
 // Prototype for callbacks used to process an HTTP Response.
+// ReceiveData gets the Body a piece at a time; a piece is at most one
+// read (see setMaxRecvSize()), the Body as a whole may be any length (see
+// HttpResponse::getBodyBytes()).
 typedef void (*HeadersReady)(const HttpResponse *response, void *additionalParams);
 typedef void (*ReceiveData)(const HttpResponse *response, void *additionalParams, const unsigned char *data, int sizeOfData);
 typedef void (*ResponseComplete)(const HttpResponse *response, void *additionalParams);
 
+// Prototype for callback told that a response won't complete: the
+// connection failed or timed out first. error says why.
+typedef void (*ResponseFailed)(const HttpResponse *response, void *additionalParams, const HttpError &error);
+
+// Prototype for callback that produces a request body piece by piece.
+// Fill buffer with up to sizeOfBuffer bytes and return how many were
+// written. Return 0 at the end of the body, or -1 to abort the request.
+typedef int (*ProduceBody)(void *additionalParams, unsigned char *buffer, int sizeOfBuffer);
+
+
+class EventLoop;
+class HostStats;
+class Http2Connection;
+class TlsConnection;
+
 
 class HttpRequest
 {
   friend class HttpResponse;
+  friend class EventLoop;
+  friend class Http2Connection;
 
 public:
 
-  static const int MaxRequestSize = 512;
-  static const int MaxSocketRecvSize = 2048;
+  // Bytes asked for by the first recv() on a connection. Reads that fill
+  // up double the size, up to the limit set by setMaxRecvSize().
+  static const int InitialRecvSize = 2048;
+  static const int DefaultMaxRecvSize = 262144;
+
+  // Times a pipelined request is sent again after losing its connection.
+  static const int MaxReplays = 2;
+
+  // Largest chunk asked of a ProduceBody callback.
+  static const int MaxChunkSize = 16384;
+
+  // Completed HttpResponse objects kept for reuse by later requests.
+  static const int MaxFreeResponses = 16;
 
 
   HttpRequest(const char *host, int port);
@@ -54,10 +105,13 @@ public:
   //   receiveData      : Called repeatedly to handle Body data.
   //   responseComplete : Called when response is complete.
   //   additionalParams : Passed back to all callbacks.
+  //   responseFailed   : Called instead of responseComplete if the
+  //                      connection fails first (optional).
   void initCallbacks(HeadersReady headersReady,
                      ReceiveData receiveData,
                      ResponseComplete responseComplete,
-                     void *additionalParams);
+                     void *additionalParams,
+                     ResponseFailed responseFailed = 0);
 
   // Make an HTTP request to the host and port specified in the Constructor.
   //   method     : GET, POST, HEAD, etc.
@@ -65,15 +119,62 @@ public:
   //   headers    : Array of name/value pairs terminated by NULL (0)
   //   body       : Body of request
   //   sizeOfBody : Size of the body
-  void sendRequest(const char *method,
+  // Return false, with error set, if it failed.
+  bool sendRequest(HttpError &error,
+                   const char *method,
                    const char *url,
                    const char *headers[] = 0,
                    const unsigned char *body = 0,
                    int sizeOfBody = 0);
 
+  // Make an HTTP request with a body read from a file descriptor. The data
+  // goes from the file to the socket inside the kernel (sendfile() for
+  // files, splice() for pipes and sockets), never through user space.
+  //   fd     : File, pipe or socket to read the body from
+  //   offset : Where the body starts in a file (ignored for pipes)
+  //   length : Size of the body; -1 sends the rest of a file
+  bool sendFileRequest(HttpError &error,
+                       const char *method,
+                       const char *url,
+                       const char *headers[],
+                       int fd,
+                       off_t offset,
+                       off_t length);
+
+  // Make an HTTP request with a body of unknown length, sent with
+  // "Transfer-Encoding: chunked". produceBody is called for each chunk
+  // until it returns 0. Only one chunk is held in memory at a time.
+  bool sendChunkedRequest(HttpError &error,
+                          const char *method,
+                          const char *url,
+                          const char *headers[],
+                          ProduceBody produceBody,
+                          void *additionalParams);
+
   bool responsesPending() const { return !_pendingResponses.empty(); }
 
-  void processRequest();
+  // Process data arriving on the socket, waiting up to timeoutMs for it
+  // (-1 waits forever). With the default of 0 it returns immediately if
+  // there is nothing to read. Return false, with error set, if the
+  // connection failed or a response deadline has passed.
+  bool processRequest(HttpError &error, int timeoutMs = 0);
+
+  // Sleep in processRequest() until all responses are complete or timeoutMs
+  // passed (-1 waits forever). Return true if no responses are pending,
+  // false at the timeout (error cleared) or if it failed (error set).
+  bool waitForResponses(HttpError &error, int timeoutMs = -1);
+
+  // From a HeadersReady or ReceiveData callback: give up on response. It
+  // fails with an Aborted error, message formatted like printf(), reported
+  // by the call that was processing it (or passed to the EventLoop error
+  // handler), and the connection is cleaned up.
+  void failResponse(const HttpResponse *response, const char *format, ...);
+
+  // Deadline for each response, counted from when its request is started.
+  // When it passes the connection is cleaned up and a Timeout error
+  // reported (or passed to the EventLoop error handler). 0 disables it
+  // (default).
+  void setResponseTimeout(int timeoutMs) { _responseTimeout = timeoutMs; }
 
   void cleanUp();
 
@@ -89,22 +190,132 @@ public:
   // Look at the implementation of the sendRequest() method for an example.
   //**************************************************************************
 
-  void initSocket();
+  bool initSocket(HttpError &error);
 
   // Initiate an HTTP Request
   //   method     : GET, POST, HEAD, etc.
   //   url        : Path of URL, like "/fish/heads/yum.html"  
-  void initRequest(const char *method, const char *url);
+  bool initRequest(HttpError &error, const char *method, const char *url);
 
   // Add a name/value pair to the request Header. Call after initRequest().
-  void addHeader(const char *name, const char *value);  // value is char
-  void addHeader(const char *name, int numericValue);   // value is int
+  bool addHeader(HttpError &error, const char *name, const char *value);  // value is char
+  bool addHeader(HttpError &error, const char *name, int numericValue);   // value is int
+  bool addHeader(HttpError &error, const char *name, long long numericValue);
 
   // Send the Headers over the socket. Call after adding all the Headers.
-  void sendHeaders();
+  bool sendHeaders(HttpError &error);
+
+  // Send the Headers followed by the body in a single write.
+  bool sendHeaders(HttpError &error, const unsigned char *body, int sizeOfBody);
 
   // Send the data over the socket.
+  bool send(HttpError &error, const unsigned char *data, int sizeOfData);
+
+
+#ifndef HTTP_NO_EXCEPTIONS
+  // The calls above that throw HttpException instead.
+  void sendRequest(const char *method,
+                   const char *url,
+                   const char *headers[] = 0,
+                   const unsigned char *body = 0,
+                   int sizeOfBody = 0);
+
+  void sendFileRequest(const char *method,
+                       const char *url,
+                       const char *headers[],
+                       int fd,
+                       off_t offset,
+                       off_t length);
+
+  void sendChunkedRequest(const char *method,
+                          const char *url,
+                          const char *headers[],
+                          ProduceBody produceBody,
+                          void *additionalParams);
+
+  void processRequest(int timeoutMs = 0);
+  bool waitForResponses(int timeoutMs = -1);
+
+  void initSocket();
+  void initRequest(const char *method, const char *url);
+  void addHeader(const char *name, const char *value);
+  void addHeader(const char *name, int numericValue);
+  void addHeader(const char *name, long long numericValue);
+  void sendHeaders();
+  void sendHeaders(const unsigned char *body, int sizeOfBody);
   void send(const unsigned char *data, int sizeOfData);
+#endif
+
+  // Give up connecting after timeoutMs. -1 (default) leaves it to the kernel.
+  // When the host has several addresses they are raced, see Connector.
+  // A TLS handshake gets the same time again.
+  void setConnectTimeout(int timeoutMs) { _connectTimeout = timeoutMs; }
+
+  // Pipeline up to maxDepth requests on the connection (0 turns it off).
+  // Only idempotent requests (GET, HEAD, PUT, DELETE, OPTIONS, TRACE) share
+  // the pipeline, other requests wait until it has drained and hold back the
+  // ones after them until their response starts. Streamed bodies (file or
+  // chunked requests) can't be replayed, so they count as non-idempotent.
+  // Requests beyond the depth are queued and sent as responses arrive. If the
+  // connection drops, unanswered requests are replayed on a new connection.
+  //
+  // When off (the default) every request is sent right away and a dropped
+  // connection ends all pending responses.
+  void setPipelining(int maxDepth) { _pipelineDepth = maxDepth; }
+
+  // Largest single recv(), see InitialRecvSize.
+  void setMaxRecvSize(int bytes) { _maxReadSize = std::max(bytes, (int)InitialRecvSize); }
+
+  // Share idle keep-alive connections through the ConnectionPool (default).
+  void setConnectionPooling(bool pooling) { _pooling = pooling; }
+
+  // Ask for gzip or deflate compressed responses and decompress them before
+  // they reach the ReceiveData callback. Off by default (identity).
+  void setDecompression(bool decompress) { _decompress = decompress; }
+
+  // Connect with TLS (https). Off by default. Takes effect with the next
+  // connection; settings shared by all connections are in TlsContext.
+  void setTls(bool tls) { _tls = tls; }
+
+  // TLS state of the connection (ALPN, resumption), 0 if not connected
+  // with TLS.
+  const TlsConnection* getTls() const { return _tlsConnection; }
+
+  // Speak HTTP/2 (see Http2Connection). Off by default. Takes effect with
+  // the next connection: without TLS the server must know HTTP/2 is coming
+  // (h2c with prior knowledge); with TLS it is offered with ALPN and HTTP/1.1
+  // is used if the server doesn't take it. Requests then run at once as
+  // streams of one connection, so pipelining doesn't apply, and the
+  // connection isn't shared through the ConnectionPool. A request beyond
+  // the server's limit on streams waits for one of them to finish.
+  void setHttp2(bool http2) { _http2 = http2; }
+
+  // HTTP/2 state of the connection (streams), 0 if not speaking HTTP/2.
+  const Http2Connection* getHttp2() const { return _http2Connection; }
+
+  // Write response Bodies to fd (a file, pipe or socket) instead of passing
+  // them to the ReceiveData callback, for requests started from now on; -1
+  // (the default) goes back to the callback. Unless TLS, HTTP/2, chunking,
+  // decompression or caching is in the way, the Body goes from the socket
+  // to fd with splice() through a pipe, never through user space (not for
+  // an O_APPEND file). HeadersReady and ResponseComplete are still called.
+  void setBodyFile(int fd);
+
+  // Keep GET responses in the HttpCache and answer from it. Off by default.
+  // A fresh stored response goes through the callbacks from within
+  // sendRequest(), without touching the network; a stale one is revalidated
+  // and a 304 Not Modified replays it. Requests with their own conditional,
+  // Range or Cache-Control headers bypass the cache. The cache is private
+  // and shared by the process: see HttpCache.h before using it for more
+  // than one user.
+  void setCaching(bool caching) { _caching = caching; }
+
+  // Socket for the connection, or -1 if not connected.
+  int getSocket() const { return _socket; }
+
+  // Counters and latencies of the host, shared by every request to it.
+  // See HttpStats.
+  const HostStats& getStats() const { return *_stats; }
 
 
 protected:
@@ -112,6 +323,7 @@ protected:
   HeadersReady     _headersReady;
   ReceiveData      _receiveData;
   ResponseComplete _responseComplete;
+  ResponseFailed   _responseFailed;
 
   void *_additionalParams;
 
@@ -123,11 +335,115 @@ private:
   std::string _host;
   int _port;
   int _socket;
-
-  std::vector<std::string> _currRequest;
-
-  std::deque<HttpResponse*> _pendingResponses;
-
+  int _connectTimeout;
+
+  int _pipelineDepth;
+
+  RingBuffer _recvBuffer; // Received data not yet used by a response
+  int _readSize;          // Current recv() size
+  int _maxReadSize;
+
+  bool _pooling;  // Use the ConnectionPool
+  bool _reusable; // Connection can be pooled when cleaned up
+
+  bool _decompress; // See setDecompression()
+  bool _caching;    // See setCaching()
+
+  int _bodyFile;      // See setBodyFile()
+  bool _bodySplice;   // _bodyFile can take splice()
+  int _splicePipe[2]; // Between the socket and the body file
+  int _nonBlocking;   // Socket made non-blocking for splice(), -1 if none
+
+  bool _tls;                     // See setTls()
+  TlsConnection *_tlsConnection; // Set while connected with TLS
+  std::string _tlsBuffer;        // Joins small writes into one TLS record
+
+  bool _http2;                       // See setHttp2()
+  Http2Connection *_http2Connection; // Set while speaking HTTP/2
+  int _sendingStream;                // Stream of the request being sent
+
+  HostStats *_stats;
+  bool _connectedBefore; // A connection was opened, for reconnect counts
+  long long _resolved;   // Timestamps of a new connection, passed to the
+  long long _connected;  // response sent on it first. 0 when taken from
+  long long _secured;    // the pool.
+
+  std::string _requestHead; // Request line and headers being built
+
+  ResponseQueue _pendingResponses;
+  ResponseQueue _freeResponses; // For reuse, see acquireResponse()
+
+  EventLoop *_loop; // Set while registered with an EventLoop
+
+  int _responseTimeout;
+  TimerWheel *_timers; // Response deadlines when not in an EventLoop
+  bool _timedOut;
+  long long _waitDeadline; // End of the processRequest() wait, -1 if none
+
+  HttpError _error; // Why the call under way failed
+
+  // The work of the public calls. On failure these return false with
+  // _error set, for report() to pass on.
+  bool makeRequest(const char *method, const char *url, const char *headers[],
+                   const unsigned char *body, int sizeOfBody);
+  bool makeFileRequest(const char *method, const char *url, const char *headers[],
+                       int fd, off_t offset, off_t length);
+  bool makeChunkedRequest(const char *method, const char *url, const char *headers[],
+                          ProduceBody produceBody, void *additionalParams);
+  bool process(int timeoutMs);
+  bool openSocket();
+  bool startRequest(const char *method, const char *url);
+  bool appendHeader(const char *name, const char *value);
+  bool sendHead(const unsigned char *body, int sizeOfBody);
+  bool sendBody(const unsigned char *data, int sizeOfData);
+
+  bool fail(HttpError::Code code, const char *format, ...);
+  bool socketError(const char *context);
+  bool report(HttpError &error);
+  void abandon();
+
+  TimerWheel& timers();
+  void responseTimedOut();
+  bool checkTimeouts();
+  int waitReadable(int timeoutMs);
+
+  bool processEvents(bool peerClosed = false);
+  int receive(bool peerClosed);
+  int spliceBody(HttpResponse *response);
+  bool processBuffer();
+  void popResponse();
+  void removeResponse(HttpResponse *response);
+  HttpResponse* acquireResponse(const char *method);
+  void releaseResponse(HttpResponse *response);
+  bool useCache(HttpResponse *response);
+  void responseCompleted(const HttpResponse &response);
+  bool startSending(HttpResponse *response);
+  bool waitWritable();
+  bool waitReady(int fd, short events);
+  bool waitForStream();
+  bool sendHttp2(const unsigned char *data, int sizeOfData, bool last = false);
+  bool pipelining() const { return _pipelineDepth > 0 && !_http2; }
+
+  bool send(const unsigned char *data, int sizeOfData,
+            const unsigned char *moreData, int sizeOfMoreData,
+            int flags = 0);
+  int write(const unsigned char *data, int sizeOfData,
+            const unsigned char *moreData, int sizeOfMoreData,
+            int flags = 0);
+
+  int writeTls(const unsigned char *data, int sizeOfData,
+               const unsigned char *moreData, int sizeOfMoreData);
+
+  bool addHeaders(const char *headers[]);
+  bool sendFile(int fd, off_t offset, off_t length);
+  bool sendFileCopy(int fd, off_t offset, off_t length, bool regular);
+  bool inputReady(int fd);
+  bool startStreaming(HttpResponse *response);
+  bool waitPipelineDrained();
+
+  void closeSocket();
+  bool sendPending();
+  bool replay();
 };
 
 #endif 
@@ -6,14 +6,21 @@
 
 #include "HttpResponse.h"
 
+#include "ContentDecoder.h"
+#include "HttpCache.h"
 #include "HttpRequest.h"
 #include "HttpException.h"
+#include "HttpStats.h"
+#include "LineScanner.h"
 
-#include <algorithm>
+#include <cerrno>
+#include <climits>
 #include <cstdio>
 #include <cstring>
 #include <cstdarg>
 
+#include <unistd.h>
+
 
 HttpResponse::HttpResponse(const char *method, HttpRequest& request) :
   _state(StatusLine),
@@ -25,166 +32,326 @@ HttpResponse::HttpResponse(const char *method, HttpRequest& request) :
   _bytesRead(0),
   _contentLength(-1),  
   _chunked(false),
-  _chunkLength(0)
+  _chunkLength(0),
+  _bodyFile(-1),
+  _bodySplice(false),
+  _decoder(0),
+  _decoding(false),
+  _bytesDecoded(0),
+  _sent(false),
+  _streamed(false),
+  _started(false),
+  _replays(0),
+  _caching(false),
+  _cacheEntry(0),
+  _streamId(0),
+  _streamWindow(0),
+  _streamUnacked(0),
+  _streamRemaining(0),
+  _next(0)
 {
+  memset(&_timing, 0, sizeof(_timing));
 }
 
 
 //-----------------------------------------------------------------------------
-const char* HttpResponse::getHeader(const char *name) const
+HttpResponse::~HttpResponse()
 {
-  std::string keyName(name);
-  std::transform(keyName.begin(), keyName.end(), keyName.begin(), ::tolower);
+  delete _decoder;
+}
 
-  std::map<std::string, std::string>::const_iterator itr = _headers.find(keyName);
 
-  if (itr == _headers.end())
-  {
-    return 0;
-  }
-  else
-  {
-    return itr->second.c_str();
-  }
+//-----------------------------------------------------------------------------
+void HttpResponse::reset(const char *method)
+{
+  _state = StatusLine;
+  _method = method;
+  _status = 0;
+  _reason.clear();
+  _version = 0;
+  _versionStr.clear();
+  _headers.clear();
+  _autoClose = false;
+  _bytesRead = 0;
+  _contentLength = -1;
+  _chunked = false;
+  _chunkLength = 0;
+  _bodyFile = -1;
+  _bodySplice = false;
+  _decoding = false;
+  _bytesDecoded = 0;
+  _sent = false;
+  _streamed = false;
+  _started = false;
+  _replays = 0;
+  _caching = false;
+  _cacheEntry = 0;
+  _streamId = 0;
+  _streamWindow = 0;
+  _streamUnacked = 0;
+  _streamRemaining = 0;
+  _next = 0;
+
+  memset(&_timing, 0, sizeof(_timing));
+
+  dropRequestData();
 }
 
 
 //-----------------------------------------------------------------------------
 int HttpResponse::processResponse(const unsigned char *data, int sizeOfData)
 {
-  int byteCount = sizeOfData;
+  const char *c = (const char*)data;
+  const char *end = c + sizeOfData;
 
-  std::string singleLine;
+  if (sizeOfData > 0 && !_started)
+  {
+    _started = true;
+    _timing.received = HttpStats::now();
+  }
 
-  while (byteCount > 0 && _state != Complete)
+  while (c < end && _state != Complete && _state != Failed)
   {
-    if (_state == StatusLine    ||
-        _state == Header        ||
-        _state == ChunkLength   ||
-        _state == ChunkComplete ||
-        _state == Trailer)        
-    {
-      // Loop until we find a newline.
-      while (byteCount > 0)
-      {
-        char c = (char)*data++;
-        byteCount--;
-
-        if (c != '\n')
-        {
-          if (c != '\r')  //Ignore CR
-            singleLine += c;
-        }
-        else //newline
-        {
-          switch (_state)
-          {
-            case StatusLine:
-              processStatusLine(singleLine);
-              break;
-
-            case Header:
-              processHeader(singleLine);
-              break;
-
-            case ChunkLength:
-              processChunkLength(singleLine);
-              break;
-              
-            case ChunkComplete:
-              _state = ChunkLength;
-              break;
-
-            case Trailer:
-              processTrailer(singleLine);
-              break;
-
-            default:
-              break;
-          }
-          singleLine.clear();
-          break;
-        }
-      }
-    }
-    else if (_state == Body)
+    if (_state == Body)
     {
       int bytesProcessed = 0;
 
       if (_chunked)
       {
-        bytesProcessed = processChunkedData(data, byteCount);
+        bytesProcessed = processChunkedData((const unsigned char*)c, end - c);
       }
       else
       {
-        bytesProcessed = processData(data, byteCount);
+        bytesProcessed = processData((const unsigned char*)c, end - c);
+      }
+
+      c += bytesProcessed;
+      continue;
+    }
+
+    // StatusLine, Header, ChunkLength, ChunkComplete or Trailer:
+    // find the end of the line.
+    const char *newline = LineScanner::find(c, end, '\n');
+
+    if (newline == end)
+    {
+      // The line continues in data not received yet.
+      if (end - c > MaxLineLength)
+      {
+        fail(HttpError::Protocol, "Line too long in HTTP Response");
       }
 
-      data += bytesProcessed;
-      byteCount -= bytesProcessed;
+      break;
+    }
+
+    StringRef line(c, newline - c);
+
+    // Ignore CR
+    if (line.size > 0 && line.data[line.size - 1] == '\r')
+    {
+      line.size--;
+    }
+
+    c = newline + 1;
+
+    switch (_state)
+    {
+      case StatusLine:
+        processStatusLine(line);
+        break;
+
+      case Header:
+        processHeader(line);
+        break;
+
+      case ChunkLength:
+        processChunkLength(line);
+        break;
+
+      case ChunkComplete:
+        _state = ChunkLength;
+        break;
+
+      case Trailer:
+        processTrailer(line);
+        break;
+
+      default:
+        break;
     }
   }
 
-  return (sizeOfData - byteCount);
+  return (c - (const char*)data);
 }
 
 
 //-----------------------------------------------------------------------------
-void HttpResponse::connectionClosed()
+bool HttpResponse::connectionClosed()
 {
   if (_state == Complete)
-    return;
+    return true;
 
   if (_state == Body && !_chunked && _contentLength == -1)
+  {
+    complete();
+    return (_state == Complete);
+  }
+
+  return fail(HttpError::Closed, "Invalid State: in connectionClosed()");
+}
+
+
+//-----------------------------------------------------------------------------
+// HTTP/2: the header block of the response arrived. Informational (1xx)
+// responses are skipped as in processHeader().
+void HttpResponse::headersReceived(int status, bool endStream)
+{
+  if (!_started)
+  {
+    _started = true;
+    _timing.received = HttpStats::now();
+  }
+
+  if (status < 100 || status > 999)
+  {
+    fail(HttpError::Protocol, "Invalid HTTP Status: (%d)", status);
+    return;
+  }
+
+  _status = status;
+
+  if (_status < 200)
+  {
+    if (endStream)
+    {
+      fail(HttpError::Protocol, "HTTP/2 stream ended after status %d", _status);
+    }
+
+    _headers.clear();
+    return;
+  }
+
+  _version = 20;
+  _versionStr = "HTTP/2";
+  _reason.clear();
+
+  initBody();
+
+  if (endStream && _state != Failed)
+  {
+    endOfStream();
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpResponse::dataReceived(const unsigned char *data, int byteCount)
+{
+  if (_state == Body)
+  {
+    processData(data, byteCount);
+  }
+  else if (_state != Complete && _state != Failed)
+  {
+    fail(HttpError::Protocol, "HTTP/2: DATA before HEADERS");
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// HTTP/2: the server ended the stream, which ends a Body of unknown length.
+void HttpResponse::endOfStream()
+{
+  if (_state == Complete || _state == Failed)
+    return;
+
+  if (_state == Body && _contentLength == -1)
   {
     complete();
   }
   else
   {
-    throw HttpException("Invalid State: in connectionClosed()");
+    fail(HttpError::Protocol, "HTTP/2 stream ended early: %lld of %lld bytes", _bytesRead, _contentLength);
   }
 }
 
 
 //-----------------------------------------------------------------------------
-void HttpResponse::processStatusLine(std::string const &data)
+void HttpResponse::expired()
 {
-  const char *c = data.c_str();
+  _request.responseTimedOut();
+}
 
-  while (*c && *c == ' ') { c++; }  //Skip spaces
 
-  // Get Version
-  while (*c && *c != ' ')
+//-----------------------------------------------------------------------------
+bool HttpResponse::idempotent() const
+{
+  if (_streamed)
   {
-    _versionStr += *c++;
+    return false;
   }
 
-  while (*c && *c == ' ') { c++; }  //Skip spaces
+  return (_method == "GET"     ||
+          _method == "HEAD"    ||
+          _method == "PUT"     ||
+          _method == "DELETE"  ||
+          _method == "OPTIONS" ||
+          _method == "TRACE");
+}
 
-  // Get Status Code
-  std::string status;
 
-  while (*c && *c != ' ')
+//-----------------------------------------------------------------------------
+void HttpResponse::dropRequestData()
+{
+  if (_requestData.capacity() > (size_t)MaxKeptRequestData)
   {
-    status += *c++;
+    std::string().swap(_requestData);
   }
+  else
+  {
+    _requestData.clear();
+  }
+}
 
-  _status = atoi(status.c_str());
 
-  while (*c && *c == ' ') { c++; }  //Skip spaces
+//-----------------------------------------------------------------------------
+void HttpResponse::processStatusLine(StringRef const &data)
+{
+  const char *c = data.data;
+  const char *end = data.end();
 
-  // Get Reason Phrase
-  while (*c)
+  while (c < end && *c == ' ') { c++; }  //Skip spaces
+
+  // Get Version
+  const char *version = c;
+
+  while (c < end && *c != ' ') { c++; }
+
+  _versionStr.assign(version, c - version);
+
+  while (c < end && *c == ' ') { c++; }  //Skip spaces
+
+  // Get Status Code
+  _status = 0;
+
+  while (c < end && *c >= '0' && *c <= '9' && _status < 1000)
   {
-    _reason += *c++;
+    _status = _status * 10 + (*c++ - '0');
   }
 
+  while (c < end && *c != ' ') { c++; }
+  while (c < end && *c == ' ') { c++; }  //Skip spaces
+
+  // Get Reason Phrase
+  _reason.assign(c, end - c);
+
   if (_status < 100 || _status > 999)
   {
-    throw HttpException("Invalid HTTP Status: (%s)", data.c_str());
+    fail(HttpError::Protocol, "Invalid HTTP Status: (%.*s)", (int)data.size, data.data);
+    return;
   }
 
-  if (_versionStr == "HTTP:/1.0")
+  if (_versionStr == "HTTP/1.0")
   {
     _version = 10;
   }
@@ -194,23 +361,21 @@ void HttpResponse::processStatusLine(std::string const &data)
   }
   else
   {
-    throw HttpException("Invalid HTTP Version: (%s)", _versionStr.c_str());
+    fail(HttpError::Protocol, "Invalid HTTP Version: (%s)", _versionStr.c_str());
+    return;
   }
  
   // After processing the Status Line, move to the Header.
   _state = Header;
-  _currHeader.clear();
 }
 
 
 //-----------------------------------------------------------------------------
-void HttpResponse::processHeader(std::string const &data)
+void HttpResponse::processHeader(StringRef const &data)
 {
   // Done with Headers
   if (data.empty())
   {
-    addHeader();
-
     // Ignore HTTP Status Code 100-Continue.
     if (_status == Continue)
     {
@@ -224,71 +389,100 @@ void HttpResponse::processHeader(std::string const &data)
     return;
   }
 
-  const char *c = data.c_str();
+  const char *c = data.data;
+  const char *end = data.end();
 
   // If data starts with whitespace, add to previous header.
-  if (isspace(*c))
+  if (*c == ' ' || *c == '\t')
   {
-    c++;
-
-    while (*c && isspace(*c)) { c++; }  //Remove whitespace
+    while (c < end && (*c == ' ' || *c == '\t')) { c++; }  //Remove whitespace
 
-    _currHeader += ' ';
-    _currHeader += c;
+    _headers.appendToLast(c, end - c);
   }
   else
   {
-    addHeader();  //Add _currHeader to map and start a new _currHeader.
-    _currHeader = c;
+    addHeader(data);
   }
 }
 
 
 //-----------------------------------------------------------------------------
-void HttpResponse::processTrailer(std::string const &data)
+void HttpResponse::processTrailer(StringRef const &data)
 {
-  // Not processing trailing headers...
-  complete();
+  // Not processing trailing headers, done at the empty line.
+  if (data.empty())
+  {
+    complete();
+  }
 }
 
 
-//-----------------------------------------------------------------------------
-int HttpResponse::processData(const unsigned char *data, int byteCount)
-{
+//-----------------------------------------------------------------------------
+int HttpResponse::processData(const unsigned char *data, int byteCount)
+{
   int bytesProcessed = byteCount;
-
-  if (_contentLength != -1)
-  {
-    int remaining = _contentLength - _bytesRead;
+
+  if (_contentLength != -1)
+  {
+    long long remaining = _contentLength - _bytesRead;
 
     if (bytesProcessed > remaining)
-    {
+    {
       bytesProcessed = remaining;
-    }
-  }
-
-  // Callback to pass data to the caller
-  if (_request._receiveData)
-  {
-    (_request._receiveData)(this, _request._additionalParams, data, bytesProcessed);
-  }
-
-  _bytesRead += bytesProcessed;
-
+    }
+  }
+
+  if (!deliver(data, bytesProcessed))
+  {
+    return bytesProcessed;
+  }
+
+  _bytesRead += bytesProcessed;
+
   if (_contentLength != -1 && _bytesRead == _contentLength)
-  {
+  {
     complete();
-  }
+  }
 
-  return bytesProcessed;
+  return bytesProcessed;
 }
 
 
 //-----------------------------------------------------------------------------
-void HttpResponse::processChunkLength(std::string const &data)
+void HttpResponse::processChunkLength(StringRef const &data)
 {
-  _chunkLength = strtol(data.c_str(), NULL, 16);  // Hex
-  
+  const char *c = data.data;
+  const char *end = data.end();
+
+  _chunkLength = 0;
+
+  // Hex, up to any chunk extension
+  for (; c < end; c++)
+  {
+    int digit;
+
+    if (*c >= '0' && *c <= '9')      digit = *c - '0';
+    else if (*c >= 'a' && *c <= 'f') digit = *c - 'a' + 10;
+    else if (*c >= 'A' && *c <= 'F') digit = *c - 'A' + 10;
+    else break;
+
+    if (_chunkLength > (LLONG_MAX >> 4))
+    {
+      fail(HttpError::Protocol, "Invalid chunk length");
+      return;
+    }
+
+    _chunkLength = (_chunkLength << 4) | digit;
+  }
+
+  // At least one digit, then the end of the line, whitespace or a ';'
+  // starting an extension.
+  if (c == data.data || (c < end && *c != ';' && *c != ' ' && *c != '\t'))
+  {
+    fail(HttpError::Protocol, "Invalid chunk length");
+    return;
+  }
+
   if (_chunkLength == 0)
   {
     // Done with Body, move to Trailer.
@@ -308,13 +502,12 @@ int HttpResponse::processChunkedData(const unsigned char *data, int byteCount)
   
   if (bytesProcessed > _chunkLength)
   {
-    bytesProcessed = _chunkLength;
+    bytesProcessed = (int)_chunkLength;
   }
 
-  // Callback to pass data to the caller
-  if (_request._receiveData)
+  if (!deliver(data, bytesProcessed))
   {
-    (_request._receiveData)(this, _request._additionalParams, data, bytesProcessed);
+    return bytesProcessed;
   }
 
   _bytesRead += bytesProcessed;
@@ -330,14 +523,193 @@ int HttpResponse::processChunkedData(const unsigned char *data, int byteCount)
 }
 
 
+//-----------------------------------------------------------------------------
+bool HttpResponse::deliver(const unsigned char *data, int byteCount)
+{
+  if (!_decoding)
+  {
+    _bytesDecoded += byteCount;
+
+    if (_caching) capture(data, byteCount);
+
+    return pass(data, byteCount);
+  }
+
+  // Compressed data comes out in pieces of at most ContentDecoder::BufferSize.
+  if (!_decoder->input(data, byteCount, _request._error))
+  {
+    _state = Failed;
+    return false;
+  }
+
+  const unsigned char *decoded;
+  int decodedCount;
+
+  while ((decodedCount = _decoder->output(decoded, _request._error)) > 0)
+  {
+    _bytesDecoded += decodedCount;
+
+    if (_caching) capture(decoded, decodedCount);
+
+    if (!pass(decoded, decodedCount))
+    {
+      return false;
+    }
+  }
+
+  if (decodedCount < 0)
+  {
+    _state = Failed;
+    return false;
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Body data as the caller gets it: to the body file, or the callback.
+// Return false if that failed, or the callback gave up on the response.
+bool HttpResponse::pass(const unsigned char *data, int byteCount)
+{
+  if (_bodyFile < 0)
+  {
+    // Callback to pass data to the caller
+    if (_request._receiveData)
+    {
+      (_request._receiveData)(this, _request._additionalParams, data, byteCount);
+    }
+
+    return (_state != Failed);
+  }
+
+  while (byteCount > 0)
+  {
+    ssize_t written = ::write(_bodyFile, data, byteCount);
+
+    if (written < 0 && errno == EINTR)
+      continue;
+
+    if (written <= 0)
+    {
+      return fail(HttpError::System, "write() of body: %s", strerror(errno));
+    }
+
+    data += written;
+    byteCount -= written;
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Does the rest of the Body go to the body file as it comes from the
+// socket, with nothing to decode, decompress or keep on the way?
+bool HttpResponse::spliceable() const
+{
+  return (_bodySplice && _state == Body && !_chunked && !_decoding && !_caching && _version < 20);
+}
+
+
+//-----------------------------------------------------------------------------
+// HttpRequest moved byteCount bytes of the Body to the body file.
+void HttpResponse::spliced(int byteCount)
+{
+  _bytesRead += byteCount;
+  _bytesDecoded += byteCount;
+
+  if (_contentLength != -1 && _bytesRead == _contentLength)
+  {
+    complete();
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpResponse::capture(const unsigned char *data, int byteCount)
+{
+  if (_cacheBody.size() + byteCount > (size_t)HttpCache::instance().maxEntrySize())
+  {
+    stopCaching(); // Too large to keep
+    return;
+  }
+
+  _cacheBody.append((const char*)data, byteCount);
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpResponse::stopCaching()
+{
+  _caching = false;
+
+  if (_cacheBody.capacity() > (size_t)MaxKeptRequestData)
+  {
+    std::string().swap(_cacheBody);
+  }
+  else
+  {
+    _cacheBody.clear();
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+// Stand in for the response with a stored one: its status, headers and
+// Body reach the callbacks as if they had been received.
+void HttpResponse::replay(const CachedResponse &entry)
+{
+  stopCaching();
+
+  _status = entry.status;
+  _reason = entry.reason;
+  _headers.assign(entry.headers);
+
+  if (_version == 0)
+  {
+    _version = 11;
+    _versionStr = "HTTP/1.1";
+  }
+
+  _chunked = false;
+  _decoding = false;
+  _contentLength = entry.size;
+
+  _timing.headers = HttpStats::now();
+
+  if (_request._headersReady)
+  {
+    (_request._headersReady)(this, _request._additionalParams);
+  }
+
+  // Straight from memory or the mapping of the file, a recv() at a time
+  for (long long offset = 0; offset < entry.size && _state != Failed; offset += _request._maxReadSize)
+  {
+    deliver(entry.data + offset, std::min(entry.size - offset, (long long)_request._maxReadSize));
+  }
+
+  if (_state != Failed)
+  {
+    complete();
+  }
+}
+
+
 //-----------------------------------------------------------------------------
 // Is the server going to automatically close the connection?
 bool HttpResponse::isAutoClose()
 {
+  // HTTP/2: streams end, the connection stays.
+  if (_version >= 20)
+  {
+    return false;
+  }
+
   // HTTP/1.x: Header "connection: close" if server connection will close connection.
   if (_version == 11)
   {
-    const char *conn = getHeader("connection");
+    const char *conn = _headers.get(HeaderConnection);
 
     if (conn && 0 == strcasecmp(conn, "close"))
     {
@@ -350,7 +722,7 @@ bool HttpResponse::isAutoClose()
   }
 
   // HTTP/1.0: Header "keep-alive" if server will close connection.
-  if (getHeader("keep-alive"))
+  if (_headers.get(HeaderKeepAlive))
   {
     return false;
   }
@@ -360,39 +732,23 @@ bool HttpResponse::isAutoClose()
 
 
 //-----------------------------------------------------------------------------
-void HttpResponse::addHeader()
+void HttpResponse::addHeader(StringRef const &data)
 {
-  if (_currHeader.empty())
-  {
-    return;
-  }
-
-  const char *headerPair = _currHeader.c_str();
+  const char *end = data.end();
+  const char *colon = LineScanner::find(data.data, end, ':');
 
-  std::string name;
-  std::string value;
+  const char *value = colon;
 
-  // Read the header name (and ignore colon)
-  while (*headerPair && *headerPair != ':')
-  {
-    name += tolower(*headerPair++);
-  }
-
-  if (*headerPair) headerPair++;  // Skip the colon
+  if (value < end) value++;  // Skip the colon
 
   // Skip Tabs and Spaces
-  while (*headerPair && (*headerPair == '\t' || *headerPair == ' '))
+  while (value < end && (*value == '\t' || *value == ' '))
   {
-    headerPair++;
+    value++;
   }
 
-  // Read the value
-  value = headerPair;
-
-  // Add name/value to Header map.
-  _headers[name] = value;
-
-  _currHeader.clear();
+  // Name without the colon
+  _headers.add(data.data, colon - data.data, value, end - value);
 }
 
 
@@ -402,9 +758,24 @@ void HttpResponse::initBody()
   _autoClose = isAutoClose();
   _contentLength = -1;
 
-  const char *transferEncoding = getHeader("transfer-encoding");
+  // Revalidated: the stored response stands in for this one.
+  if (_status == NotModified && _cacheEntry)
+  {
+    HttpCache::instance().freshen(_cacheEntry, *this);
+    _request._stats->addRevalidated();
 
-  if (transferEncoding && 0 == strcasecmp(transferEncoding, "chunked"))
+    replay(*_cacheEntry);
+    return;
+  }
+
+  if (_caching && !HttpCache::storable(*this))
+  {
+    stopCaching();
+  }
+
+  const char *transferEncoding = _headers.get(HeaderTransferEncoding);
+
+  if (transferEncoding && 0 == strcasecmp(transferEncoding, "chunked") && _version < 20)
   {
     _chunked = true;
     _chunkLength = -1;
@@ -414,11 +785,19 @@ void HttpResponse::initBody()
     _chunked = false;
   }
 
-  const char *length = getHeader("content-length");
+  const char *length = _headers.get(HeaderContentLength);
 
   if (length && !_chunked)
   {
-    _contentLength = atoi(length);
+    long long value;
+
+    if (!HttpHeaders::parseLength(length, strlen(length), value))
+    {
+      fail(HttpError::Protocol, "Invalid Content-Length: (%s)", length);
+      return;
+    }
+
+    _contentLength = value;
   }
 
   // These situations have no Body.
@@ -431,21 +810,54 @@ void HttpResponse::initBody()
   }
 
   // If not chunked and no content-length, turn on _autoClose.
-  if (!_autoClose && !_chunked && _contentLength == -1)
+  // HTTP/2 ends the Body with the stream instead.
+  if (!_autoClose && !_chunked && _contentLength == -1 && _version < 20)
   {
     _autoClose = true;
   }
 
+  // Decompress the Body if it was asked for, see HttpRequest::setDecompression().
+  if (_request._decompress && _contentLength != 0)
+  {
+    ContentDecoder::Encoding encoding = ContentDecoder::encoding(_headers.get(HeaderContentEncoding));
+
+    if (encoding != ContentDecoder::Identity)
+    {
+      if (_decoder)
+      {
+        _decoder->reset(encoding);
+      }
+      else
+      {
+        _decoder = new ContentDecoder(encoding);
+      }
+
+      _decoding = true;
+    }
+  }
+
+  _timing.headers = HttpStats::now();
+
   // Callback to notify caller when Headers are ready
   if (_request._headersReady)
   {
     (_request._headersReady)(this, _request._additionalParams);
   }
 
+  // The callback gave up on it
+  if (_state == Failed)
+  {
+    return;
+  }
+
   if (_chunked)
   {
     _state = ChunkLength;
   }
+  else if (_contentLength == 0)
+  {
+    complete(); // No Body, don't wait for more data.
+  }
   else
   {
     _state = Body;
@@ -456,11 +868,45 @@ void HttpResponse::initBody()
 //-----------------------------------------------------------------------------
 void HttpResponse::complete()
 {
+  // The compressed data must end with the Body, or it was cut off.
+  if (_decoding && _bytesRead > 0 && !_decoder->finished())
+  {
+    fail(HttpError::Protocol, "Compressed Body ended early");
+    return;
+  }
+
   _state = Complete;
 
-  // Callback to notify caller when response is complete
+  if (_caching)
+  {
+    HttpCache::instance().store(_cacheKey, *this, _decoding, _cacheBody);
+    stopCaching();
+  }
+
+  _timing.complete = HttpStats::now();
+  _request.responseCompleted(*this);
+
+  // Callback to notify caller when response is complete
   if (_request._responseComplete)
   {
     (_request._responseComplete)(this, _request._additionalParams);
   }
 }
+
+
+//-----------------------------------------------------------------------------
+// Give up on the response. The error goes to the request, which cleans up
+// the connection. Return false.
+bool HttpResponse::fail(HttpError::Code code, const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+
+  _request._error.vset(code, format, ap);
+
+  va_end(ap);
+
+  _state = Failed;
+
+  return false;
+}
@@ -7,14 +7,26 @@
 #ifndef HTTP_RESPONSE_H
 #define HTTP_RESPONSE_H
 
-#include <map>
+#include "HttpException.h"
+#include "HttpHeaders.h"
+#include "LineScanner.h"
+#include "TimerWheel.h"
+
 #include <string>
 
+class ContentDecoder;
 class HttpRequest;
+struct CachedResponse;
+class ResponseQueue;
 
-class HttpResponse
+// The TimerWheel::Timer base tracks the response deadline,
+// see HttpRequest::setResponseTimeout().
+class HttpResponse : private TimerWheel::Timer
 {
   friend class HttpRequest;
+  friend class EventLoop;
+  friend class ResponseQueue;
+  friend class Http2Connection;
 
 public:
 
@@ -23,6 +35,13 @@ public:
   static const int NoContent   = 204;
   static const int NotModified = 304;
 
+  // Longest Status, Header or Chunk line accepted.
+  static const int MaxLineLength = 65536;
+
+  // A pipelined request buffer larger than this is freed once the
+  // response starts, smaller ones are kept for the next request.
+  static const int MaxKeptRequestData = 16384;
+
   // HTTP Status Code
   int getStatus() const { return _status; }
 
@@ -30,22 +49,64 @@ public:
   const char* getReason() const { return _reason.c_str(); }
 
   // Get value of a header name/value pair. Return 0 if name doesn't exist.
-  const char* getHeader(const char* name) const;
+  const char* getHeader(const char* name) const { return _headers.get(name); }
+
+  // The same for a standard name, e.g. getHeader(HeaderContentType).
+  const char* getHeader(HeaderId id) const { return _headers.get(id); }
+
+  // All the header name/value pairs
+  const HttpHeaders& getHeaders() const { return _headers; }
 
   bool completed() const { return (_state == Complete); }
 
   // Will the connection close when this response completes?
   bool autoClose() const { return _autoClose; }
 
+  // Body bytes received, as sent by the server.
+  long long getBodyBytes() const { return _bytesRead; }
+
+  // Length of the Body from Content-Length, -1 if not known.
+  long long getContentLength() const { return _contentLength; }
+
+  // Body bytes passed to the ReceiveData callback (or body file). Larger than
+  // getBodyBytes() when the body was decompressed, see
+  // HttpRequest::setDecompression().
+  long long getDecodedBytes() const { return _bytesDecoded; }
+
+  // When each phase of the request happened, in nanoseconds of
+  // HttpStats::now(). A phase that didn't happen is 0: resolved and
+  // connected are only set when the request opened a new connection.
+  struct Timing
+  {
+    long long start;     // Request started (initRequest())
+    long long resolved;  // Host name resolved
+    long long connected; // Connection established
+    long long secured;   // TLS handshake done
+    long long sent;      // First byte of the request sent
+    long long received;  // First byte of the response received
+    long long headers;   // Headers parsed
+    long long complete;  // Response complete
+  };
+
+  const Timing& getTiming() const { return _timing; }
+
 protected:
 
   HttpResponse(const char *method, HttpRequest &request);
 
+  ~HttpResponse();
+
+  // Start over for a new request. Memory is kept for reuse, see
+  // HttpRequest::acquireResponse().
+  void reset(const char *method);
+
   // Process an HTTP Response or a Chunk of an HTTP Response.
-  // Return the number of bytes used or 0 when complete.
+  // Return the number of bytes used. An incomplete line at the end of the
+  // data is not used; pass it again once more data has been appended.
   int processResponse(const unsigned char* data, int sizeOfData);
 
-  void connectionClosed();
+  // The connection closed. Return false if that cut the response short.
+  bool connectionClosed();
 
 private:
 
@@ -58,6 +119,7 @@ private:
     ChunkComplete, // Done with a Chunk
     Trailer,       // Getting trailer after a Body
     Complete,      // Done with this Response
+    Failed,        // Given up, see fail()
   } _state;
 
   HttpRequest& _request; // Corresponding HTTP Request
@@ -68,37 +130,191 @@ private:
   int _status;  // Status Code
   std::string _reason; // Reason Phrase
 
-  int _version; // 10: HTTP/1.0, 11: HTTP/1.x
+  int _version; // 10: HTTP/1.0, 11: HTTP/1.x, 20: HTTP/2
   std::string _versionStr;
 
   // Header name/value pairs
-  std::map<std::string, std::string> _headers;
-
-  // For Header processing
-  std::string _currHeader;
+  HttpHeaders _headers;
 
   // Command & Control
-  bool _autoClose;     // Will the connection be closed after the response?
-  int  _bytesRead;     // Bytes read from the Body
-  int  _contentLength; // Content length
-  bool _chunked;       // Chunked response?
-  int  _chunkLength;   // Length of current chunk
+  bool _autoClose;          // Will the connection be closed after the response?
+  long long _bytesRead;     // Bytes read from the Body
+  long long _contentLength; // Content length
+  bool _chunked;            // Chunked response?
+  long long _chunkLength;   // Length of current chunk
+
+  int _bodyFile;    // See HttpRequest::setBodyFile(), -1 if not used
+  bool _bodySplice; // It can take splice()
+
+  // Content-Encoding
+  ContentDecoder *_decoder; // Created by the first compressed Body, then reused
+  bool _decoding;           // Decompressing this Body
+  long long _bytesDecoded;  // Bytes passed to the caller
+
+  // Pipelining, see HttpRequest::setPipelining()
+  std::string _requestData; // Request kept for a replay until the response starts
+  bool _sent;               // Request was written to the connection
+  bool _streamed;           // Body came from a file or producer, not kept
+  bool _started;            // Response data has been received
+  int  _replays;            // Times the request was sent again
+
+  Timing _timing;
+
+  // HttpCache, see HttpRequest::setCaching()
+  bool _caching;               // Store the response when complete
+  std::string _cacheKey;
+  std::string _cacheBody;      // Body as passed to the caller, to store
+  CachedResponse *_cacheEntry; // Stale response being revalidated
+
+  // HTTP/2 stream, see Http2Connection
+  int _streamId;              // 0 when not open
+  int _streamWindow;          // Request body the server will take
+  int _streamUnacked;         // Received, not yet given back
+  long long _streamRemaining; // Request body to send, -1 until the last
+
+  HttpResponse *_next; // Link in a ResponseQueue
 
   // Methods
-  void processStatusLine(std::string const& data);
-  void processHeader(std::string const& data);
-  void processTrailer(std::string const& data);
+  void processStatusLine(StringRef const& data);
+  void processHeader(StringRef const& data);
+  void processTrailer(StringRef const& data);
   int  processData(const unsigned char* data, int byteCount);
 
   // Work with Chunks
-  void processChunkLength(std::string const& data);
+  void processChunkLength(StringRef const& data);
   int  processChunkedData(const unsigned char* data, int byteCount);
 
+  // Deadline passed before the response completed.
+  void expired();
+
+  // Can the request be repeated without changing the result? (RFC 9110)
+  // Never when its body was streamed, there is nothing to repeat.
+  bool idempotent() const;
+
+  // Too late to replay, let go of the request.
+  void dropRequestData();
+
+  // HTTP/2: the status and headers, Body data and the end of the stream.
+  void headersReceived(int status, bool endStream);
+  void dataReceived(const unsigned char* data, int byteCount);
+  void endOfStream();
+
+  // Pass Body data to the caller, decompressed if need be. Return false
+  // if the response failed.
+  bool deliver(const unsigned char* data, int byteCount);
+  bool pass(const unsigned char* data, int byteCount);
+
+  // Body file: can the Body go there from the socket with splice()?
+  bool spliceable() const;
+  void spliced(int byteCount);
+
+  // HttpCache: keep the Body for storing, or play a stored response.
+  void capture(const unsigned char* data, int byteCount);
+  void stopCaching();
+  void replay(const CachedResponse &entry);
+
   // Helpers
   bool isAutoClose();
-  void addHeader();
+  void addHeader(StringRef const& data);
   void initBody();
   void complete();
+  bool failed() const { return (_state == Failed); }
+  bool fail(HttpError::Code code, const char *format, ...);
+
+  HttpResponse(const HttpResponse&);
+  HttpResponse& operator=(const HttpResponse&);
+};
+
+
+// First-in first-out list of responses, linked through the responses
+// themselves so adding and removing never allocates.
+class ResponseQueue
+{
+public:
+
+  ResponseQueue() : _front(0), _back(0), _size(0) {}
+
+  bool empty() const { return _front == 0; }
+  int size() const { return _size; }
+
+  HttpResponse* front() const { return _front; }
+  HttpResponse* back() const { return _back; }
+
+  // The response after this one, or 0. To iterate:
+  //   for (HttpResponse *r = queue.front(); r; r = ResponseQueue::next(r))
+  static HttpResponse* next(const HttpResponse *response) { return response->_next; }
+
+  void push_back(HttpResponse *response)
+  {
+    response->_next = 0;
+
+    if (_back)
+    {
+      _back->_next = response;
+    }
+    else
+    {
+      _front = response;
+    }
+
+    _back = response;
+    _size++;
+  }
+
+  // Remove a response from anywhere in the queue. Responses on an HTTP/2
+  // connection complete in any order.
+  void remove(HttpResponse *response)
+  {
+    if (response == _front)
+    {
+      pop_front();
+      return;
+    }
+
+    HttpResponse *previous = _front;
+
+    while (previous->_next != response)
+    {
+      previous = previous->_next;
+    }
+
+    previous->_next = response->_next;
+
+    if (_back == response)
+    {
+      _back = previous;
+    }
+
+    response->_next = 0;
+    _size--;
+  }
+
+  HttpResponse* pop_front()
+  {
+    HttpResponse *response = _front;
+
+    _front = response->_next;
+    response->_next = 0;
+
+    if (!_front)
+    {
+      _back = 0;
+    }
+
+    _size--;
+
+    return response;
+  }
+
+
+private:
+
+  HttpResponse *_front;
+  HttpResponse *_back;
+  int _size;
+
+  ResponseQueue(const ResponseQueue&);
+  ResponseQueue& operator=(const ResponseQueue&);
 };
 
 #endif
@@ -0,0 +1,274 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Process-wide request statistics, kept per host:port.
+
+#include "HttpStats.h"
+
+#include <cstdio>
+
+
+//-----------------------------------------------------------------------------
+long long LatencyHistogram::mean() const
+{
+  long long n = count();
+
+  return (n > 0) ? __atomic_load_n(&_sum, __ATOMIC_RELAXED) / n : 0;
+}
+
+
+//-----------------------------------------------------------------------------
+long long LatencyHistogram::percentile(double percent) const
+{
+  long long n = count();
+
+  if (n == 0)
+  {
+    return 0;
+  }
+
+  // Rank of the value asked for, counting from 1
+  long long rank = (long long)(percent / 100.0 * n + 0.5);
+
+  if (rank < 1) rank = 1;
+  if (rank > n) rank = n;
+
+  long long seen = 0;
+
+  for (int i = 0; i < Buckets; i++)
+  {
+    seen += __atomic_load_n(&_counts[i], __ATOMIC_RELAXED);
+
+    if (seen >= rank)
+    {
+      long long value = highestValue(i);
+
+      return (value < max()) ? value : max();
+    }
+  }
+
+  return max();
+}
+
+
+//-----------------------------------------------------------------------------
+void LatencyHistogram::reset()
+{
+  for (int i = 0; i < Buckets; i++)
+  {
+    __atomic_store_n(&_counts[i], 0, __ATOMIC_RELAXED);
+  }
+
+  __atomic_store_n(&_count, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&_sum, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&_max, 0, __ATOMIC_RELAXED);
+}
+
+
+//-----------------------------------------------------------------------------
+long long LatencyHistogram::highestValue(int bucket)
+{
+  if (bucket < 2 * SubBuckets)
+  {
+    return bucket;
+  }
+
+  int shift = bucket / SubBuckets - 1;
+  long long mantissa = bucket - shift * SubBuckets;
+
+  return ((mantissa + 1) << shift) - 1;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+HostStats::HostStats(const std::string &name) :
+  _name(name)
+{
+  reset();
+}
+
+
+//-----------------------------------------------------------------------------
+void HostStats::reset()
+{
+  __atomic_store_n(&_requests, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&_errors, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&_timeouts, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&_connects, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&_reconnects, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&_reused, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&_cacheHits, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&_revalidated, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&_bytesIn, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&_bytesOut, 0, __ATOMIC_RELAXED);
+
+  _total.reset();
+  _firstByte.reset();
+  _connect.reset();
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+HttpStats& HttpStats::instance()
+{
+  static HttpStats stats;
+  return stats;
+}
+
+
+//-----------------------------------------------------------------------------
+HttpStats::HttpStats()
+{
+  pthread_mutex_init(&_mutex, 0);
+}
+
+
+//-----------------------------------------------------------------------------
+HttpStats::~HttpStats()
+{
+  std::map<std::string, HostStats*>::iterator itr;
+
+  for (itr = _hosts.begin(); itr != _hosts.end(); ++itr)
+  {
+    delete itr->second;
+  }
+
+  pthread_mutex_destroy(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+HostStats* HttpStats::host(const std::string &host, int port)
+{
+  std::string name = key(host, port);
+
+  pthread_mutex_lock(&_mutex);
+
+  HostStats *&stats = _hosts[name];
+
+  if (!stats)
+  {
+    stats = new HostStats(name);
+  }
+
+  HostStats *result = stats;
+
+  pthread_mutex_unlock(&_mutex);
+
+  return result;
+}
+
+
+//-----------------------------------------------------------------------------
+const HostStats* HttpStats::find(const std::string &host, int port)
+{
+  std::string name = key(host, port);
+
+  pthread_mutex_lock(&_mutex);
+
+  std::map<std::string, HostStats*>::iterator itr = _hosts.find(name);
+  const HostStats *result = (itr != _hosts.end()) ? itr->second : 0;
+
+  pthread_mutex_unlock(&_mutex);
+
+  return result;
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpStats::hosts(std::vector<const HostStats*> &list)
+{
+  list.clear();
+
+  pthread_mutex_lock(&_mutex);
+
+  std::map<std::string, HostStats*>::iterator itr;
+
+  for (itr = _hosts.begin(); itr != _hosts.end(); ++itr)
+  {
+    list.push_back(itr->second);
+  }
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+// For example:
+//
+//   www.hyperceptive.org:80 requests=120 errors=0 timeouts=0 connects=2 ...
+//     total_us count=120 mean=1840 p50=1599 p90=2559 p99=4351 p999=4351 max=4402
+//     first_byte_us ...
+//     connect_us ...
+std::string HttpStats::report()
+{
+  std::vector<const HostStats*> list;
+  hosts(list);
+
+  std::string text;
+  char line[512];
+
+  for (size_t i = 0; i < list.size(); i++)
+  {
+    const HostStats &stats = *list[i];
+
+    snprintf(line, sizeof(line),
+             "%s requests=%lld errors=%lld timeouts=%lld connects=%lld"
+             " reconnects=%lld reused=%lld cache_hits=%lld revalidated=%lld"
+             " bytes_in=%lld bytes_out=%lld\n",
+             stats.name().c_str(), stats.requests(), stats.errors(),
+             stats.timeouts(), stats.connects(), stats.reconnects(),
+             stats.reused(), stats.cacheHits(), stats.revalidated(),
+             stats.bytesIn(), stats.bytesOut());
+    text += line;
+
+    const char *names[] = { "total_us", "first_byte_us", "connect_us" };
+    const LatencyHistogram *histograms[] = { &stats.total(), &stats.firstByte(), &stats.connect() };
+
+    for (int h = 0; h < 3; h++)
+    {
+      const LatencyHistogram &histogram = *histograms[h];
+
+      snprintf(line, sizeof(line),
+               "  %s count=%lld mean=%lld p50=%lld p90=%lld p99=%lld p999=%lld max=%lld\n",
+               names[h], histogram.count(), histogram.mean(),
+               histogram.percentile(50.0), histogram.percentile(90.0),
+               histogram.percentile(99.0), histogram.percentile(99.9),
+               histogram.max());
+      text += line;
+    }
+  }
+
+  return text;
+}
+
+
+//-----------------------------------------------------------------------------
+void HttpStats::reset()
+{
+  pthread_mutex_lock(&_mutex);
+
+  std::map<std::string, HostStats*>::iterator itr;
+
+  for (itr = _hosts.begin(); itr != _hosts.end(); ++itr)
+  {
+    itr->second->reset();
+  }
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+std::string HttpStats::key(const std::string &host, int port)
+{
+  char portStr[16];
+  snprintf(portStr, sizeof(portStr), ":%d", port);
+
+  return host + portStr;
+}
@@ -0,0 +1,237 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Process-wide request statistics, kept per host:port.
+//
+// Every HttpRequest looks up the HostStats of its server once, when it is
+// constructed, and then only does relaxed atomic adds: recording costs a
+// few nanoseconds and never takes a lock. Latencies go into histograms
+// with logarithmic buckets (like HdrHistogram), so percentiles are exact
+// to about 3% over the whole range.
+//
+// Basic Usage:
+//
+//   std::string text = HttpStats::instance().report();
+//
+//   const HostStats *stats = HttpStats::instance().find("www.hyperceptive.org", 80);
+//
+//   if (stats)
+//   {
+//     printf("p99 %lld us\n", stats->total().percentile(99.0));
+//   }
+//
+// Timestamps of the phases of a single request are kept by its
+// HttpResponse, see HttpResponse::getTiming().
+//
+
+#ifndef HTTP_STATS_H
+#define HTTP_STATS_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <time.h>
+
+
+// Counts of values (microseconds) in buckets of logarithmically growing
+// width. The first 2 * SubBuckets values have a bucket each, after that
+// every power of two is split into SubBuckets buckets. May be recorded to
+// from several threads at once.
+class LatencyHistogram
+{
+public:
+
+  static const int SubBucketBits = 5;
+  static const int SubBuckets = 1 << SubBucketBits;
+
+  // Largest value told apart, larger ones are counted as this (38 hours).
+  static const long long MaxValue = (1LL << 37) - 1;
+
+  static const int Buckets = (37 - SubBucketBits + 1) * SubBuckets;
+
+
+  LatencyHistogram() { reset(); }
+
+  void record(long long value)
+  {
+    if (value < 0) value = 0;
+    if (value > MaxValue) value = MaxValue;
+
+    __atomic_fetch_add(&_counts[bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&_sum, value, __ATOMIC_RELAXED);
+
+    long long max = __atomic_load_n(&_max, __ATOMIC_RELAXED);
+
+    while (value > max &&
+           !__atomic_compare_exchange_n(&_max, &max, value, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+  }
+
+  long long count() const { return __atomic_load_n(&_count, __ATOMIC_RELAXED); }
+  long long max() const { return __atomic_load_n(&_max, __ATOMIC_RELAXED); }
+  long long mean() const;
+
+  // Value below which percent (0 - 100) of the recorded values fall.
+  // Return 0 if nothing was recorded.
+  long long percentile(double percent) const;
+
+  void reset();
+
+  // Bucket of a value, and the largest value in a bucket.
+  static int bucket(long long value)
+  {
+    if (value < 2 * SubBuckets)
+    {
+      return (int)value;
+    }
+
+    int shift = 63 - __builtin_clzll(value) - SubBucketBits;
+
+    return shift * SubBuckets + (int)(value >> shift);
+  }
+
+  static long long highestValue(int bucket);
+
+
+private:
+
+  long long _counts[Buckets];
+  long long _count;
+  long long _sum;
+  long long _max;
+
+  LatencyHistogram(const LatencyHistogram&);
+  LatencyHistogram& operator=(const LatencyHistogram&);
+};
+
+
+// Counters and latency histograms of one host:port.
+class HostStats
+{
+  friend class HttpStats;
+
+public:
+
+  // "host:port"
+  const std::string& name() const { return _name; }
+
+  long long requests()    const { return load(_requests); }     // Responses completed
+  long long errors()      const { return load(_errors); }       // Responses that failed
+  long long timeouts()    const { return load(_timeouts); }     // Response deadlines missed
+  long long connects()    const { return load(_connects); }     // New connections
+  long long reconnects()  const { return load(_reconnects); }   // New connections by a request that had one
+  long long reused()      const { return load(_reused); }       // Connections taken from the ConnectionPool
+  long long cacheHits()   const { return load(_cacheHits); }    // Fresh responses served by the HttpCache
+  long long revalidated() const { return load(_revalidated); }  // Stale ones the server confirmed (304)
+  long long bytesIn()     const { return load(_bytesIn); }
+  long long bytesOut()    const { return load(_bytesOut); }
+
+  // Microseconds from the start of the request to:
+  const LatencyHistogram& total() const { return _total; }         // completion
+  const LatencyHistogram& firstByte() const { return _firstByte; } // first response byte
+  const LatencyHistogram& connect() const { return _connect; }     // connected, new connections only
+
+  // Used by HttpRequest and HttpResponse
+  void addRequest()     { add(_requests, 1); }
+  void addError()       { add(_errors, 1); }
+  void addTimeout()     { add(_timeouts, 1); }
+  void addConnect()     { add(_connects, 1); }
+  void addReconnect()   { add(_reconnects, 1); }
+  void addReused()      { add(_reused, 1); }
+  void addCacheHit()    { add(_cacheHits, 1); }
+  void addRevalidated() { add(_revalidated, 1); }
+  void addBytesIn(long long bytes)  { add(_bytesIn, bytes); }
+  void addBytesOut(long long bytes) { add(_bytesOut, bytes); }
+
+  LatencyHistogram& total() { return _total; }
+  LatencyHistogram& firstByte() { return _firstByte; }
+  LatencyHistogram& connect() { return _connect; }
+
+
+private:
+
+  std::string _name;
+
+  long long _requests;
+  long long _errors;
+  long long _timeouts;
+  long long _connects;
+  long long _reconnects;
+  long long _reused;
+  long long _cacheHits;
+  long long _revalidated;
+  long long _bytesIn;
+  long long _bytesOut;
+
+  LatencyHistogram _total;
+  LatencyHistogram _firstByte;
+  LatencyHistogram _connect;
+
+  explicit HostStats(const std::string &name);
+
+  void reset();
+
+  static long long load(const long long &counter) { return __atomic_load_n(&counter, __ATOMIC_RELAXED); }
+  static void add(long long &counter, long long n) { __atomic_fetch_add(&counter, n, __ATOMIC_RELAXED); }
+
+  HostStats(const HostStats&);
+  HostStats& operator=(const HostStats&);
+};
+
+
+class HttpStats
+{
+public:
+
+  static HttpStats& instance();
+
+  // Monotonic clock in nanoseconds, used for all request timestamps.
+  static long long now()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+  // Statistics of host:port, created if need be. The object lives as long
+  // as the process, so the pointer can be kept.
+  HostStats* host(const std::string &host, int port);
+
+  // Statistics of host:port, or 0 if no request was made to it.
+  const HostStats* find(const std::string &host, int port);
+
+  // All hosts, ordered by name.
+  void hosts(std::vector<const HostStats*> &list);
+
+  // Counters and latency percentiles of every host as text, one host per
+  // line followed by a line per histogram.
+  std::string report();
+
+  // Zero all counters and histograms. Requests in progress while this runs
+  // may be counted either way.
+  void reset();
+
+
+private:
+
+  std::map<std::string, HostStats*> _hosts;
+
+  pthread_mutex_t _mutex;
+
+  HttpStats();
+  ~HttpStats();
+
+  static std::string key(const std::string &host, int port);
+
+  HttpStats(const HttpStats&);
+  HttpStats& operator=(const HttpStats&);
+};
+
+#endif
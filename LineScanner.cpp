@@ -0,0 +1,67 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Fast byte search used by HttpResponse.
+
+#include "LineScanner.h"
+
+#include <cstring>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+
+//-----------------------------------------------------------------------------
+const char* LineScanner::find(const char *begin, const char *end, char c)
+{
+  const char *p = begin;
+
+#if defined(__SSE2__)
+
+  const __m128i needle = _mm_set1_epi8(c);
+
+  while (end - p >= 16)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+
+    if (mask)
+    {
+      return p + __builtin_ctz(mask);
+    }
+
+    p += 16;
+  }
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+  const uint8x16_t needle = vdupq_n_u8((uint8_t)c);
+
+  while (end - p >= 16)
+  {
+    uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t*)p), needle);
+
+    // Narrow each byte of the compare result to a nibble of a 64-bit mask.
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+    uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+
+    if (mask)
+    {
+      return p + (__builtin_ctzll(mask) >> 2);
+    }
+
+    p += 16;
+  }
+
+#endif
+
+  // Remaining bytes (or everything, without SIMD)
+  const void *found = memchr(p, c, end - p);
+
+  return found ? (const char*)found : end;
+}
@@ -0,0 +1,36 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Fast byte search used by HttpResponse to split the receive buffer into
+// lines and headers into name/value, without copying.
+//
+// Uses SSE2 on x86 and NEON on ARM, 16 bytes at a time.
+
+#ifndef LINE_SCANNER_H
+#define LINE_SCANNER_H
+
+// A run of bytes inside a buffer owned by someone else.
+// Not NUL-terminated.
+struct StringRef
+{
+  const char *data;
+  int size;
+
+  StringRef() : data(0), size(0) {}
+  StringRef(const char *d, int n) : data(d), size(n) {}
+
+  bool empty() const { return size == 0; }
+  const char* end() const { return data + size; }
+};
+
+
+class LineScanner
+{
+public:
+
+  // Return a pointer to the first c in [begin, end), or end if there is none.
+  static const char* find(const char *begin, const char *end, char c);
+};
+
+#endif
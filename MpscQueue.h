@@ -0,0 +1,83 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Lock-free queue with many producers and a single consumer.
+//
+// Producers push with a compare-and-swap on the head of a list, the
+// consumer takes the whole list with one exchange and puts it back in
+// order. Nodes are intrusive: T needs a "T *next" member the queue may
+// overwrite.
+//
+// Basic Usage:
+//
+//   // Any thread
+//   if (queue.push(node))
+//   {
+//     ...queue was empty, wake the consumer...
+//   }
+//
+//   // Consumer thread
+//   for (Node *node = queue.popAll(); node; )
+//   {
+//     Node *next = node->next;
+//     ...use node...
+//     node = next;
+//   }
+//
+
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+template <class T>
+class MpscQueue
+{
+public:
+
+  MpscQueue() : _head(0) {}
+
+  // Add a node. Return true if the queue was empty.
+  bool push(T *node)
+  {
+    T *head = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+
+    do
+    {
+      node->next = head;
+    }
+    while (!__atomic_compare_exchange_n(&_head, &head, node, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return (head == 0);
+  }
+
+  // Remove all nodes. Return the oldest, linked by next to the newest.
+  // Only one thread may call this.
+  T* popAll()
+  {
+    T *node = __atomic_exchange_n(&_head, (T*)0, __ATOMIC_ACQUIRE);
+    T *ordered = 0;
+
+    while (node)
+    {
+      T *next = node->next;
+      node->next = ordered;
+      ordered = node;
+      node = next;
+    }
+
+    return ordered;
+  }
+
+  bool empty() const { return __atomic_load_n(&_head, __ATOMIC_ACQUIRE) == 0; }
+
+
+private:
+
+  T *_head; // Newest node
+
+  MpscQueue(const MpscQueue&);
+  MpscQueue& operator=(const MpscQueue&);
+};
+
+#endif
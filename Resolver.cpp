@@ -0,0 +1,340 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Caching DNS resolver used by HttpRequest::initSocket().
+
+#include "Resolver.h"
+
+#include "TimerWheel.h"
+
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+
+static const int DefaultTtl = 60000;
+static const int DefaultNegativeTtl = 5000;
+
+
+//-----------------------------------------------------------------------------
+void SocketAddress::setPort(int port)
+{
+  if (address.ss_family == AF_INET6)
+  {
+    ((struct sockaddr_in6*)&address)->sin6_port = htons(port);
+  }
+  else
+  {
+    ((struct sockaddr_in*)&address)->sin_port = htons(port);
+  }
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+Resolver& Resolver::instance()
+{
+  // Never destroyed: the helper thread may still be inside getaddrinfo()
+  // when the process exits.
+  static Resolver *resolver = new Resolver();
+  return *resolver;
+}
+
+
+//-----------------------------------------------------------------------------
+Resolver::Resolver() :
+  _threadStarted(false),
+  _ttl(DefaultTtl),
+  _negativeTtl(DefaultNegativeTtl)
+{
+  pthread_mutex_init(&_mutex, 0);
+  pthread_cond_init(&_resolvedCond, 0);
+  pthread_cond_init(&_jobsCond, 0);
+}
+
+
+//-----------------------------------------------------------------------------
+bool Resolver::resolve(const std::string &host, SocketAddressList &addresses)
+{
+  pthread_mutex_lock(&_mutex);
+
+  while (true)
+  {
+    Entry &entry = _cache[host];
+
+    // Fresh answer (or fresh failure)
+    if (entry.expires > TimerWheel::now())
+    {
+      addresses = entry.addresses;
+      break;
+    }
+
+    // Stale answer: use it, and refresh it in the background.
+    if (!entry.addresses.empty())
+    {
+      if (!entry.resolving)
+      {
+        entry.resolving = true;
+        queue(host, 0, 0);
+      }
+
+      addresses = entry.addresses;
+      break;
+    }
+
+    // Nothing usable: look it up, unless another thread already is.
+    if (!entry.resolving)
+    {
+      entry.resolving = true;
+      pthread_mutex_unlock(&_mutex);
+
+      update(host, addresses);
+      return !addresses.empty();
+    }
+
+    pthread_cond_wait(&_resolvedCond, &_mutex);
+  }
+
+  pthread_mutex_unlock(&_mutex);
+
+  return !addresses.empty();
+}
+
+
+//-----------------------------------------------------------------------------
+void Resolver::resolveAsync(const std::string &host, HostResolved resolved, void *additionalParams)
+{
+  pthread_mutex_lock(&_mutex);
+
+  Entry &entry = _cache[host];
+
+  if (entry.expires > TimerWheel::now())
+  {
+    SocketAddressList addresses = entry.addresses;
+    pthread_mutex_unlock(&_mutex);
+
+    (resolved)(host, addresses, additionalParams);
+    return;
+  }
+
+  if (!queue(host, resolved, additionalParams))
+  {
+    // No helper thread, resolve on this one.
+    pthread_mutex_unlock(&_mutex);
+
+    SocketAddressList addresses;
+    resolve(host, addresses);
+
+    (resolved)(host, addresses, additionalParams);
+    return;
+  }
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+void Resolver::prefetch(const std::string &host)
+{
+  pthread_mutex_lock(&_mutex);
+
+  Entry &entry = _cache[host];
+
+  if (entry.expires <= TimerWheel::now() && !entry.resolving)
+  {
+    entry.resolving = true;
+    queue(host, 0, 0);
+  }
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+void Resolver::setTtl(int ttlMs)
+{
+  pthread_mutex_lock(&_mutex);
+  _ttl = ttlMs;
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+void Resolver::setNegativeTtl(int ttlMs)
+{
+  pthread_mutex_lock(&_mutex);
+  _negativeTtl = ttlMs;
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+void Resolver::flush()
+{
+  pthread_mutex_lock(&_mutex);
+
+  std::map<std::string, Entry>::iterator itr = _cache.begin();
+
+  // Entries being resolved have threads waiting on them.
+  while (itr != _cache.end())
+  {
+    if (itr->second.resolving)
+    {
+      itr++;
+    }
+    else
+    {
+      _cache.erase(itr++);
+    }
+  }
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Queue a job for the helper thread. Called with the mutex held.
+// A job without a callback refreshes the cache entry, which the caller
+// has already marked as resolving.
+// Return false if the helper thread couldn't be started. The job is
+// dropped then, and a refresh is left to the next resolve().
+bool Resolver::queue(const std::string &host, HostResolved resolved, void *additionalParams)
+{
+  Job job;
+  job.host = host;
+  job.resolved = resolved;
+  job.additionalParams = additionalParams;
+
+  _jobs.push_back(job);
+
+  if (!_threadStarted)
+  {
+    if (pthread_create(&_thread, 0, threadMain, this) == 0)
+    {
+      pthread_detach(_thread);
+      _threadStarted = true;
+    }
+    else
+    {
+      _jobs.pop_back();
+
+      if (!resolved)
+      {
+        // Release threads waiting for this lookup, one of them will do it.
+        _cache[host].resolving = false;
+        pthread_cond_broadcast(&_resolvedCond);
+      }
+
+      return false;
+    }
+  }
+
+  pthread_cond_signal(&_jobsCond);
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Look up a host and store the answer in its (resolving) cache entry.
+// Called without the mutex held.
+void Resolver::update(const std::string &host, SocketAddressList &addresses)
+{
+  addresses.clear();
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo *result = 0;
+
+  if (getaddrinfo(host.c_str(), 0, &hints, &result) == 0)
+  {
+    // Keep getaddrinfo()'s (RFC 6724) order
+    for (struct addrinfo *ai = result; ai; ai = ai->ai_next)
+    {
+      if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+      {
+        continue;
+      }
+
+      SocketAddress address;
+      memset(&address.address, 0, sizeof(address.address));
+      memcpy(&address.address, ai->ai_addr, ai->ai_addrlen);
+      address.length = ai->ai_addrlen;
+
+      addresses.push_back(address);
+    }
+
+    freeaddrinfo(result);
+  }
+
+  pthread_mutex_lock(&_mutex);
+
+  Entry &entry = _cache[host];
+  long long now = TimerWheel::now();
+
+  if (!addresses.empty())
+  {
+    entry.addresses = addresses;
+    entry.expires = now + _ttl;
+  }
+  else
+  {
+    // Keep serving a previous answer until the next retry.
+    addresses = entry.addresses;
+    entry.expires = now + _negativeTtl;
+  }
+
+  entry.resolving = false;
+
+  pthread_cond_broadcast(&_resolvedCond);
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+void* Resolver::threadMain(void *resolver)
+{
+  ((Resolver*)resolver)->runJobs();
+  return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+void Resolver::runJobs()
+{
+  while (true)
+  {
+    pthread_mutex_lock(&_mutex);
+
+    while (_jobs.empty())
+    {
+      pthread_cond_wait(&_jobsCond, &_mutex);
+    }
+
+    Job job = _jobs.front();
+    _jobs.pop_front();
+
+    pthread_mutex_unlock(&_mutex);
+
+    SocketAddressList addresses;
+
+    if (job.resolved)
+    {
+      resolve(job.host, addresses);
+      (job.resolved)(job.host, addresses, job.additionalParams);
+    }
+    else
+    {
+      update(job.host, addresses);
+    }
+  }
+}
@@ -0,0 +1,117 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Caching DNS resolver used by HttpRequest::initSocket().
+//
+// Lookups go through getaddrinfo() (IPv6 and IPv4) and the results are
+// cached for a TTL. Threads asking for the same host while a lookup is
+// running wait for that lookup instead of starting their own, and an
+// expired entry keeps being served while it is refreshed in the background.
+// So a burst of reconnects costs at most one trip to DNS.
+//
+// Lookups for prefetch() and resolveAsync() run on a helper thread.
+//
+// The resolver is safe to use from several threads.
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/socket.h>
+
+
+// An IPv4 or IPv6 socket address.
+struct SocketAddress
+{
+  struct sockaddr_storage address;
+  socklen_t length;
+
+  int family() const { return address.ss_family; }
+
+  void setPort(int port);
+};
+
+typedef std::vector<SocketAddress> SocketAddressList;
+
+
+// Prototype for callback used by Resolver::resolveAsync().
+// addresses is empty if the host could not be resolved.
+typedef void (*HostResolved)(const std::string &host, const SocketAddressList &addresses, void *additionalParams);
+
+
+class Resolver
+{
+public:
+
+  static Resolver& instance();
+
+  // Resolve a hostname or IP address, from the cache when possible.
+  // Return false if it doesn't resolve to any address.
+  bool resolve(const std::string &host, SocketAddressList &addresses);
+
+  // Resolve on the helper thread. resolved is called on the helper thread,
+  // or right away by the calling thread when the answer is cached.
+  void resolveAsync(const std::string &host, HostResolved resolved, void *additionalParams);
+
+  // Warm the cache for a host that will be used soon.
+  void prefetch(const std::string &host);
+
+  // How long answers are cached. getaddrinfo() doesn't report the
+  // record TTL, so the same TTL applies to all hosts.
+  void setTtl(int ttlMs);
+
+  // How long a failed lookup is cached.
+  void setNegativeTtl(int ttlMs);
+
+  // Drop all cached answers.
+  void flush();
+
+
+private:
+
+  struct Entry
+  {
+    SocketAddressList addresses;
+    long long expires;  // TimerWheel::now() when the answer is stale
+    bool resolving;     // Lookup in progress
+  };
+
+  struct Job
+  {
+    std::string host;
+    HostResolved resolved;
+    void *additionalParams;
+  };
+
+  std::map<std::string, Entry> _cache;
+  std::deque<Job> _jobs;
+
+  pthread_mutex_t _mutex;
+  pthread_cond_t _resolvedCond; // Signalled when a lookup finishes
+  pthread_cond_t _jobsCond;     // Signalled when a job is queued
+
+  bool _threadStarted;
+  pthread_t _thread;
+
+  int _ttl;
+  int _negativeTtl;
+
+  Resolver();
+
+  bool queue(const std::string &host, HostResolved resolved, void *additionalParams);
+  void update(const std::string &host, SocketAddressList &addresses);
+
+  static void* threadMain(void *resolver);
+  void runJobs();
+
+  Resolver(const Resolver&);
+  Resolver& operator=(const Resolver&);
+};
+
+#endif
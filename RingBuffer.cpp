@@ -0,0 +1,146 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Byte ring buffer for the receive side of a connection.
+
+#include "RingBuffer.h"
+
+#include <cstring>
+
+
+//-----------------------------------------------------------------------------
+RingBuffer::RingBuffer(int capacity) :
+  _data(0),
+  _capacity(0),
+  _head(0),
+  _size(0)
+{
+  reserve(capacity);
+}
+
+
+//-----------------------------------------------------------------------------
+RingBuffer::~RingBuffer()
+{
+  delete[] _data;
+}
+
+
+//-----------------------------------------------------------------------------
+int RingBuffer::writable(unsigned char *&data)
+{
+  // Start over at the beginning when empty, it keeps the data contiguous.
+  if (_size == 0)
+  {
+    _head = 0;
+  }
+
+  int tail = (_head + _size) & (_capacity - 1);
+
+  data = _data + tail;
+
+  if (_size == _capacity)
+  {
+    return 0;
+  }
+
+  // Free space runs to the end of the storage, or up to the head.
+  if (tail >= _head)
+  {
+    return _capacity - tail;
+  }
+
+  return _head - tail;
+}
+
+
+//-----------------------------------------------------------------------------
+void RingBuffer::commit(int bytes)
+{
+  _size += bytes;
+}
+
+
+//-----------------------------------------------------------------------------
+int RingBuffer::readable(const unsigned char *&data) const
+{
+  data = _data + _head;
+
+  if (_head + _size > _capacity)
+  {
+    return _capacity - _head;
+  }
+
+  return _size;
+}
+
+
+//-----------------------------------------------------------------------------
+void RingBuffer::consume(int bytes)
+{
+  _head = (_head + bytes) & (_capacity - 1);
+  _size -= bytes;
+}
+
+
+//-----------------------------------------------------------------------------
+void RingBuffer::linearize()
+{
+  if (_head + _size <= _capacity)
+  {
+    return;
+  }
+
+  resize(_capacity);
+}
+
+
+//-----------------------------------------------------------------------------
+void RingBuffer::reserve(int bytes)
+{
+  int capacity = (_capacity > 0) ? _capacity : 1;
+
+  while (capacity < bytes)
+  {
+    capacity *= 2;
+  }
+
+  if (capacity != _capacity)
+  {
+    resize(capacity);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void RingBuffer::clear()
+{
+  _head = 0;
+  _size = 0;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Copy the data, in order, to the start of new storage.
+void RingBuffer::resize(int capacity)
+{
+  unsigned char *data = new unsigned char[capacity];
+
+  if (_size > 0)
+  {
+    const unsigned char *first;
+    int length = readable(first);
+
+    memcpy(data, first, length);
+    memcpy(data + length, _data, _size - length);
+  }
+
+  delete[] _data;
+
+  _data = data;
+  _capacity = capacity;
+  _head = 0;
+}
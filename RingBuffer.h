@@ -0,0 +1,62 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Byte ring buffer for the receive side of a connection.
+//
+// Data is read from the socket straight into the free space and handed to
+// the parser from the used space, without copying. Bytes the parser can't
+// use yet (the start of a line) simply stay in the buffer until more data
+// arrives.
+
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+class RingBuffer
+{
+public:
+
+  explicit RingBuffer(int capacity = 4096);
+
+  ~RingBuffer();
+
+  int size() const { return _size; }
+  int capacity() const { return _capacity; }
+  bool empty() const { return _size == 0; }
+
+  // Contiguous free space at the write end. Return its length.
+  int writable(unsigned char *&data);
+
+  // Mark bytes written into the space from writable() as used.
+  void commit(int bytes);
+
+  // Contiguous used space at the read end. Return its length, which can
+  // be less than size() when the data wraps around.
+  int readable(const unsigned char *&data) const;
+
+  // Drop bytes from the read end.
+  void consume(int bytes);
+
+  // Move the data so that readable() returns all of it.
+  void linearize();
+
+  // Make the capacity at least bytes (rounded up to a power of 2).
+  void reserve(int bytes);
+
+  void clear();
+
+
+private:
+
+  unsigned char *_data;
+  int _capacity; // Power of 2
+  int _head;     // Read position
+  int _size;     // Bytes used
+
+  void resize(int capacity);
+
+  RingBuffer(const RingBuffer&);
+  RingBuffer& operator=(const RingBuffer&);
+};
+
+#endif
@@ -0,0 +1,257 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Hashed timer wheel used to track response deadlines.
+
+#include "TimerWheel.h"
+
+#include <time.h>
+
+
+//-----------------------------------------------------------------------------
+TimerWheel::Timer::Timer() :
+  _wheel(0),
+  _prev(0),
+  _next(0),
+  _deadline(0),
+  _tick(0)
+{
+}
+
+
+//-----------------------------------------------------------------------------
+TimerWheel::Timer::~Timer()
+{
+  cancel();
+}
+
+
+//-----------------------------------------------------------------------------
+void TimerWheel::Timer::cancel()
+{
+  if (_wheel)
+  {
+    _wheel->cancel(*this);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+int TimerWheel::Timer::remaining() const
+{
+  if (!_wheel)
+  {
+    return -1;
+  }
+
+  long long ms = _deadline - TimerWheel::now();
+
+  return (ms > 0) ? (int)ms : 0;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+TimerWheel::TimerWheel(int resolutionMs) :
+  _resolution(resolutionMs > 0 ? resolutionMs : 1),
+  _count(0),
+  _expiring(0)
+{
+  _tick = now() / _resolution;
+
+  for (int i = 0; i < Slots; i++)
+  {
+    _slots[i] = 0;
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+TimerWheel::~TimerWheel()
+{
+  for (int i = 0; i < Slots; i++)
+  {
+    while (_slots[i])
+    {
+      cancel(*_slots[i]);
+    }
+  }
+
+  while (_expiring)
+  {
+    cancel(*_expiring);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void TimerWheel::schedule(Timer &timer, int timeoutMs)
+{
+  if (timer._wheel)
+  {
+    timer._wheel->cancel(timer);
+  }
+
+  timer._deadline = now() + timeoutMs;
+
+  // Round up, and never schedule into a tick that was already processed.
+  timer._tick = (timer._deadline + _resolution - 1) / _resolution;
+
+  if (timer._tick <= _tick)
+  {
+    timer._tick = _tick + 1;
+  }
+
+  Timer *&slot = _slots[timer._tick % Slots];
+
+  timer._wheel = this;
+  timer._prev = 0;
+  timer._next = slot;
+
+  if (slot)
+  {
+    slot->_prev = &timer;
+  }
+
+  slot = &timer;
+  _count++;
+}
+
+
+//-----------------------------------------------------------------------------
+void TimerWheel::cancel(Timer &timer)
+{
+  if (timer._wheel != this)
+  {
+    return;
+  }
+
+  if (timer._prev)
+  {
+    timer._prev->_next = timer._next;
+  }
+  else if (timer._tick < 0)
+  {
+    _expiring = timer._next;
+  }
+  else
+  {
+    _slots[timer._tick % Slots] = timer._next;
+  }
+
+  if (timer._next)
+  {
+    timer._next->_prev = timer._prev;
+  }
+
+  timer._wheel = 0;
+  timer._prev = 0;
+  timer._next = 0;
+  _count--;
+}
+
+
+//-----------------------------------------------------------------------------
+int TimerWheel::advance()
+{
+  long long currentTick = now() / _resolution;
+
+  if (currentTick <= _tick)
+  {
+    return 0;
+  }
+
+  // Every slot is visited at most once, however long it has been.
+  long long steps = currentTick - _tick;
+
+  if (steps > Slots)
+  {
+    steps = Slots;
+  }
+
+  int expiredCount = 0;
+
+  for (long long i = 1; i <= steps; i++)
+  {
+    int slot = (int)((_tick + i) % Slots);
+
+    Timer *timer = _slots[slot];
+
+    // Move the due timers to _expiring in one pass. Timers due in a later
+    // revolution of the wheel stay where they are.
+    while (timer)
+    {
+      Timer *next = timer->_next;
+
+      if (timer->_tick <= currentTick)
+      {
+        cancel(*timer);
+
+        timer->_wheel = this;
+        timer->_tick = -1;
+        timer->_next = _expiring;
+
+        if (_expiring)
+        {
+          _expiring->_prev = timer;
+        }
+
+        _expiring = timer;
+        _count++;
+      }
+
+      timer = next;
+    }
+
+    // They are still scheduled, so expired() may cancel or reschedule any of
+    // them.
+    while (_expiring)
+    {
+      timer = _expiring;
+
+      cancel(*timer);
+      timer->expired();
+      expiredCount++;
+    }
+  }
+
+  _tick = currentTick;
+
+  return expiredCount;
+}
+
+
+//-----------------------------------------------------------------------------
+int TimerWheel::nextTimeout() const
+{
+  if (_count == 0)
+  {
+    return -1;
+  }
+
+  long long ms = now();
+
+  for (int i = 1; i <= Slots; i++)
+  {
+    if (_slots[(_tick + i) % Slots])
+    {
+      long long wait = (_tick + i) * _resolution - ms;
+
+      return (wait > 0) ? (int)wait : 0;
+    }
+  }
+
+  return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+long long TimerWheel::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
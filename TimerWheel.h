@@ -0,0 +1,97 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Hashed timer wheel used to track response deadlines.
+//
+// Timers are intrusive, so scheduling and cancelling a timer is O(1) and
+// never allocates. Expiry work is proportional to the number of ticks that
+// passed, not to the number of timers outstanding.
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+class TimerWheel
+{
+public:
+
+  static const int Slots = 256;
+
+
+  // Derive from Timer and implement expired() to be notified.
+  class Timer
+  {
+    friend class TimerWheel;
+
+  public:
+
+    Timer();
+
+    // A scheduled timer is cancelled when it is destroyed.
+    virtual ~Timer();
+
+    bool scheduled() const { return _wheel != 0; }
+
+    // Unschedule the timer, if it is scheduled.
+    void cancel();
+
+    // Milliseconds until this timer expires, or -1 if it isn't scheduled.
+    int remaining() const;
+
+  protected:
+
+    // Called once by TimerWheel::advance() after the deadline passed.
+    // The timer is no longer scheduled at this point.
+    virtual void expired() = 0;
+
+  private:
+
+    TimerWheel *_wheel; // Wheel this timer is scheduled on
+    Timer *_prev;
+    Timer *_next;
+    long long _deadline; // Monotonic time in ms
+    long long _tick;     // Tick when the timer is due, -1 while expiring
+
+    Timer(const Timer&);
+    Timer& operator=(const Timer&);
+  };
+
+
+  // resolutionMs is the length of a tick; deadlines are rounded up to it.
+  explicit TimerWheel(int resolutionMs = 10);
+
+  ~TimerWheel();
+
+  // Schedule (or reschedule) a timer to expire timeoutMs from now.
+  void schedule(Timer &timer, int timeoutMs);
+
+  void cancel(Timer &timer);
+
+  // Expire all timers whose deadline has passed.
+  // Return the number of timers expired.
+  int advance();
+
+  // Milliseconds until the next timer may expire, or -1 if none are scheduled.
+  // Suitable as the timeout of poll() or epoll_wait().
+  int nextTimeout() const;
+
+  bool empty() const { return _count == 0; }
+
+  // Current monotonic time in milliseconds.
+  static long long now();
+
+
+private:
+
+  int _resolution;
+  long long _tick; // Last tick processed by advance()
+  int _count;      // Timers scheduled
+
+  Timer *_slots[Slots];
+  Timer *_expiring; // Due timers advance() is about to fire
+
+  TimerWheel(const TimerWheel&);
+  TimerWheel& operator=(const TimerWheel&);
+};
+
+#endif
@@ -0,0 +1,706 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// TLS (OpenSSL) on top of a connected socket.
+
+#include "TlsConnection.h"
+
+#include "HttpException.h"
+#include "TimerWheel.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+
+//-----------------------------------------------------------------------------
+// Last OpenSSL error as text.
+static const char* tlsError()
+{
+  static __thread char text[256];
+
+  unsigned long error = ERR_get_error();
+
+  if (error == 0)
+  {
+    return (errno != 0) ? strerror(errno) : "connection closed";
+  }
+
+  ERR_error_string_n(error, text, sizeof(text));
+  return text;
+}
+
+
+//*********************************************
+// Socket BIO
+//
+// OpenSSL's own socket BIO writes with write(), which raises SIGPIPE when
+// the server has gone. This one sends with MSG_NOSIGNAL like the rest of
+// HttpRequest.
+//*********************************************
+
+//-----------------------------------------------------------------------------
+static int bioWrite(BIO *bio, const char *data, int size)
+{
+  int fd = (int)(intptr_t)BIO_get_data(bio);
+
+  int n = ::send(fd, data, size, MSG_NOSIGNAL);
+
+  BIO_clear_retry_flags(bio);
+
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+  {
+    BIO_set_retry_write(bio);
+  }
+
+  return n;
+}
+
+
+//-----------------------------------------------------------------------------
+static int bioRead(BIO *bio, char *data, int size)
+{
+  int fd = (int)(intptr_t)BIO_get_data(bio);
+
+  int n = ::recv(fd, data, size, 0);
+
+  BIO_clear_retry_flags(bio);
+
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+  {
+    BIO_set_retry_read(bio);
+  }
+  else if (n == 0)
+  {
+    BIO_set_flags(bio, BIO_FLAGS_IN_EOF);
+  }
+
+  return n;
+}
+
+
+//-----------------------------------------------------------------------------
+static long bioCtrl(BIO *bio, int command, long number, void *pointer)
+{
+  switch (command)
+  {
+    case BIO_CTRL_FLUSH:
+      return 1;
+
+    case BIO_CTRL_EOF:
+      return BIO_test_flags(bio, BIO_FLAGS_IN_EOF) ? 1 : 0;
+
+    default:
+      return 0;
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+static int bioCreate(BIO *bio)
+{
+  BIO_set_init(bio, 1);
+  return 1;
+}
+
+
+// Set up by the TlsContext constructor
+static BIO_METHOD *bioMethod = 0;
+
+
+
+
+//-----------------------------------------------------------------------------
+TlsContext& TlsContext::instance()
+{
+  static TlsContext context;
+  return context;
+}
+
+
+//-----------------------------------------------------------------------------
+TlsContext::TlsContext() :
+  _verifyPeer(true),
+  _caching(true)
+{
+  pthread_mutex_init(&_mutex, 0);
+
+  // Objects freed by other statics (pooled connections) may outlive an
+  // atexit() cleanup, so leave OpenSSL alone at exit.
+  OPENSSL_init_ssl(OPENSSL_INIT_NO_ATEXIT, 0);
+
+  bioMethod = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "HttpRequest socket");
+
+  BIO_meth_set_write(bioMethod, bioWrite);
+  BIO_meth_set_read(bioMethod, bioRead);
+  BIO_meth_set_ctrl(bioMethod, bioCtrl);
+  BIO_meth_set_create(bioMethod, bioCreate);
+
+  _ctx = SSL_CTX_new(TLS_client_method());
+
+  // Every SSL_new() fails and says why.
+  if (!_ctx)
+  {
+    return;
+  }
+
+  SSL_CTX_set_min_proto_version(_ctx, TLS1_2_VERSION);
+  SSL_CTX_set_default_verify_paths(_ctx);
+  SSL_CTX_set_verify(_ctx, SSL_VERIFY_PEER, 0);
+
+  // Partial writes: write() keeps track of what was sent.
+  SSL_CTX_set_mode(_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  // Many servers close without close_notify; treat it like a TCP close so
+  // close-delimited bodies end the same way as without TLS.
+  SSL_CTX_set_options(_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+  // Sessions are kept here, by host:port, not in OpenSSL's cache which
+  // knows nothing about hosts.
+  SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(_ctx, newSession);
+
+  const char *alpn[] = { "http/1.1", 0 };
+  HttpError error;
+  setAlpn(error, alpn);
+}
+
+
+//-----------------------------------------------------------------------------
+TlsContext::~TlsContext()
+{
+  clearSessions();
+
+  SSL_CTX_free(_ctx);
+  pthread_mutex_destroy(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+void TlsContext::setVerifyPeer(bool verify)
+{
+  pthread_mutex_lock(&_mutex);
+
+  _verifyPeer = verify;
+
+  if (_ctx)
+  {
+    SSL_CTX_set_verify(_ctx, verify ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, 0);
+  }
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+bool TlsContext::setCaFile(HttpError &error, const char *path)
+{
+  pthread_mutex_lock(&_mutex);
+
+  int r = _ctx ? SSL_CTX_load_verify_locations(_ctx, path, 0) : 0;
+
+  pthread_mutex_unlock(&_mutex);
+
+  if (r != 1)
+  {
+    return error.set(HttpError::Tls, "setCaFile(%s): %s", path, tlsError());
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+bool TlsContext::setAlpn(HttpError &error, const char *protocols[])
+{
+  std::vector<unsigned char> list;
+
+  if (!alpnList(protocols, list))
+  {
+    return error.set(HttpError::Usage, "setAlpn(): invalid protocol name");
+  }
+
+  pthread_mutex_lock(&_mutex);
+
+  if (_ctx)
+  {
+    SSL_CTX_set_alpn_protos(_ctx, list.empty() ? 0 : &list[0], list.size());
+  }
+
+  pthread_mutex_unlock(&_mutex);
+
+  return true;
+}
+
+
+#ifndef HTTP_NO_EXCEPTIONS
+
+//-----------------------------------------------------------------------------
+void TlsContext::setCaFile(const char *path)
+{
+  HttpError error;
+
+  if (!setCaFile(error, path))
+  {
+    throw HttpException(error);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void TlsContext::setAlpn(const char *protocols[])
+{
+  HttpError error;
+
+  if (!setAlpn(error, protocols))
+  {
+    throw HttpException(error);
+  }
+}
+
+#endif
+
+
+//-----------------------------------------------------------------------------
+// ALPN wire format: each name preceded by its length. Return false if a
+// name is empty or too long.
+bool TlsContext::alpnList(const char *protocols[], std::vector<unsigned char> &list)
+{
+  for (const char **itr = protocols; itr && *itr; itr++)
+  {
+    size_t length = strlen(*itr);
+
+    if (length == 0 || length > 255)
+    {
+      return false;
+    }
+
+    list.push_back((unsigned char)length);
+    list.insert(list.end(), *itr, *itr + length);
+  }
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+void TlsContext::setSessionCaching(bool caching)
+{
+  pthread_mutex_lock(&_mutex);
+  _caching = caching;
+  pthread_mutex_unlock(&_mutex);
+
+  if (!caching)
+  {
+    clearSessions();
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void TlsContext::clearSessions()
+{
+  pthread_mutex_lock(&_mutex);
+
+  std::map<std::string, SessionList>::iterator itr;
+
+  for (itr = _sessions.begin(); itr != _sessions.end(); ++itr)
+  {
+    for (size_t i = 0; i < itr->second.size(); i++)
+    {
+      SSL_SESSION_free(itr->second[i]);
+    }
+  }
+
+  _sessions.clear();
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+int TlsContext::sessionCount()
+{
+  pthread_mutex_lock(&_mutex);
+  int count = (int)_sessions.size();
+  pthread_mutex_unlock(&_mutex);
+
+  return count;
+}
+
+
+//-----------------------------------------------------------------------------
+// Session to resume for host:port, 0 if none. The caller frees it.
+// A TLS 1.3 ticket is given out once, a TLS 1.2 session until replaced.
+SSL_SESSION* TlsContext::session(const std::string &key)
+{
+  SSL_SESSION *session = 0;
+
+  pthread_mutex_lock(&_mutex);
+
+  std::map<std::string, SessionList>::iterator itr = _sessions.find(key);
+
+  if (_caching && itr != _sessions.end())
+  {
+    SessionList &list = itr->second;
+
+    session = list.back();
+
+    if (SSL_SESSION_get_protocol_version(session) >= TLS1_3_VERSION)
+    {
+      list.pop_back();
+
+      if (list.empty())
+      {
+        _sessions.erase(itr);
+      }
+    }
+    else
+    {
+      SSL_SESSION_up_ref(session);
+    }
+  }
+
+  pthread_mutex_unlock(&_mutex);
+
+  return session;
+}
+
+
+//-----------------------------------------------------------------------------
+// Takes over session.
+void TlsContext::storeSession(const std::string &key, SSL_SESSION *session)
+{
+  pthread_mutex_lock(&_mutex);
+
+  SessionList &list = _sessions[key];
+
+  // A TLS 1.2 session replaces the ones before it
+  if (SSL_SESSION_get_protocol_version(session) < TLS1_3_VERSION)
+  {
+    while (!list.empty())
+    {
+      SSL_SESSION_free(list.front());
+      list.pop_front();
+    }
+  }
+
+  list.push_back(session);
+
+  if ((int)list.size() > MaxSessionsPerHost)
+  {
+    SSL_SESSION_free(list.front());
+    list.pop_front();
+  }
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+// Called by OpenSSL when the server hands out a session: after the
+// handshake for TLS 1.2, and with each ticket for TLS 1.3.
+int TlsContext::newSession(SSL *ssl, SSL_SESSION *session)
+{
+  const std::string *key = (const std::string*)SSL_get_app_data(ssl);
+  TlsContext &context = instance();
+
+  if (!key || !context._caching || !SSL_SESSION_is_resumable(session))
+  {
+    return 0;
+  }
+
+  context.storeSession(*key, session);
+  return 1;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+TlsConnection::TlsConnection(int socket, const std::string &host, int port, const char *protocols[]) :
+  _ssl(0),
+  _socket(socket),
+  _resumed(false)
+{
+  char portStr[16];
+  snprintf(portStr, sizeof(portStr), ":%d", port);
+
+  _key = host + portStr;
+
+  TlsContext &context = TlsContext::instance();
+
+  _ssl = SSL_new(context._ctx);
+
+  // handshake() tells
+  if (!_ssl)
+  {
+    return;
+  }
+
+  BIO *bio = BIO_new(bioMethod);
+  BIO_set_data(bio, (void*)(intptr_t)socket);
+  SSL_set_bio(_ssl, bio, bio);
+
+  SSL_set_app_data(_ssl, &_key);
+
+  std::vector<unsigned char> list;
+
+  if (protocols && *protocols && TlsContext::alpnList(protocols, list))
+  {
+    SSL_set_alpn_protos(_ssl, &list[0], list.size());
+  }
+
+  unsigned char address[16];
+  bool literal = (inet_pton(AF_INET, host.c_str(), address) == 1 ||
+                  inet_pton(AF_INET6, host.c_str(), address) == 1);
+
+  // Server Name Indication is for host names only
+  if (!literal)
+  {
+    SSL_set_tlsext_host_name(_ssl, host.c_str());
+  }
+
+  if (context._verifyPeer)
+  {
+    X509_VERIFY_PARAM *param = SSL_get0_param(_ssl);
+
+    if (literal)
+    {
+      X509_VERIFY_PARAM_set1_ip_asc(param, host.c_str());
+    }
+    else
+    {
+      X509_VERIFY_PARAM_set1_host(param, host.c_str(), 0);
+    }
+  }
+
+  SSL_SESSION *session = context.session(_key);
+
+  if (session)
+  {
+    SSL_set_session(_ssl, session);
+    SSL_SESSION_free(session);
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+TlsConnection::~TlsConnection()
+{
+  if (!_ssl)
+  {
+    return;
+  }
+
+  // One try only: the socket is non-blocking and about to be closed.
+  SSL_shutdown(_ssl);
+  ERR_clear_error();
+
+  SSL_free(_ssl);
+}
+
+
+//-----------------------------------------------------------------------------
+int TlsConnection::read(unsigned char *data, int size, HttpError &error)
+{
+  while (true)
+  {
+    ERR_clear_error();
+    errno = 0;
+
+    int n = SSL_read(_ssl, data, size);
+
+    if (n > 0)
+    {
+      return n;
+    }
+
+    int sslError = SSL_get_error(_ssl, n);
+
+    switch (sslError)
+    {
+      case SSL_ERROR_WANT_READ:
+        errno = EAGAIN;
+        return -1;
+
+      // Rare (TLS 1.3 key update): the reply has to go out first.
+      case SSL_ERROR_WANT_WRITE:
+        if (!wait(sslError, -1, error))
+        {
+          errno = EPROTO;
+          return -1;
+        }
+        continue;
+
+      case SSL_ERROR_ZERO_RETURN:
+        return 0;
+
+      case SSL_ERROR_SYSCALL:
+        if (errno == 0) return 0;
+        return -1;
+
+      default:
+        error.set(HttpError::Tls, "SSL_read(): %s", tlsError());
+        errno = EPROTO;
+        return -1;
+    }
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+int TlsConnection::write(const unsigned char *data, int size, HttpError &error)
+{
+  while (size > 0)
+  {
+    ERR_clear_error();
+    errno = 0;
+
+    int n = SSL_write(_ssl, data, size);
+
+    if (n > 0)
+    {
+      data += n;
+      size -= n;
+      continue;
+    }
+
+    int sslError = SSL_get_error(_ssl, n);
+
+    switch (sslError)
+    {
+      case SSL_ERROR_WANT_READ:
+      case SSL_ERROR_WANT_WRITE:
+        if (!wait(sslError, -1, error)) return -1;
+        break;
+
+      case SSL_ERROR_ZERO_RETURN:
+        errno = EPIPE;
+        return 0;
+
+      case SSL_ERROR_SYSCALL:
+        if (errno == EPIPE || errno == ECONNRESET) return 0;
+        if (errno == 0) { errno = EPIPE; return 0; }
+        error.set(HttpError::System, "SSL_write(): %s", strerror(errno));
+        return -1;
+
+      default:
+        error.set(HttpError::Tls, "SSL_write(): %s", tlsError());
+        return -1;
+    }
+  }
+
+  return 1;
+}
+
+
+//-----------------------------------------------------------------------------
+const char* TlsConnection::version() const
+{
+  return SSL_get_version(_ssl);
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+bool TlsConnection::handshake(int timeoutMs, HttpError &error)
+{
+  if (!_ssl)
+  {
+    return error.set(HttpError::Tls, "SSL_new(): %s", tlsError());
+  }
+
+  long long deadline = TimerWheel::now() + timeoutMs;
+
+  while (true)
+  {
+    ERR_clear_error();
+    errno = 0;
+
+    int r = SSL_connect(_ssl);
+
+    if (r == 1)
+    {
+      break;
+    }
+
+    int sslError = SSL_get_error(_ssl, r);
+
+    if (sslError == SSL_ERROR_WANT_READ || sslError == SSL_ERROR_WANT_WRITE)
+    {
+      int wait = -1;
+
+      if (timeoutMs >= 0)
+      {
+        long long remaining = deadline - TimerWheel::now();
+
+        if (remaining <= 0)
+        {
+          return error.set(HttpError::Timeout, "TLS handshake timed out: %s", _key.c_str());
+        }
+
+        wait = (int)remaining;
+      }
+
+      if (!this->wait(sslError, wait, error))
+      {
+        return false;
+      }
+
+      continue;
+    }
+
+    long result = SSL_get_verify_result(_ssl);
+
+    if (result != X509_V_OK)
+    {
+      return error.set(HttpError::Tls, "TLS certificate of %s not trusted: %s",
+                       _key.c_str(), X509_verify_cert_error_string(result));
+    }
+
+    return error.set(HttpError::Tls, "TLS handshake with %s failed: %s", _key.c_str(), tlsError());
+  }
+
+  _resumed = (SSL_session_reused(_ssl) == 1);
+
+  const unsigned char *alpn = 0;
+  unsigned int length = 0;
+  SSL_get0_alpn_selected(_ssl, &alpn, &length);
+
+  _alpn.assign((const char*)alpn, alpn ? length : 0);
+
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Wait until the socket is ready for what OpenSSL asked for, or timeoutMs
+// passed. Return false, with error set, if poll() fails.
+bool TlsConnection::wait(int sslError, int timeoutMs, HttpError &error)
+{
+  struct pollfd pfd;
+  pfd.fd = _socket;
+  pfd.events = (sslError == SSL_ERROR_WANT_WRITE) ? POLLOUT : POLLIN;
+  pfd.revents = 0;
+
+  if (poll(&pfd, 1, timeoutMs) < 0 && errno != EINTR)
+  {
+    return error.set(HttpError::System, "poll(): %s", strerror(errno));
+  }
+
+  return true;
+}
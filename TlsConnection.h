@@ -0,0 +1,158 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// TLS (OpenSSL) on top of a connected socket, see HttpRequest::setTls().
+//
+// TlsContext holds the settings shared by all connections and caches the
+// sessions (TLS 1.3 tickets) handed out by each host:port, so a new
+// connection to a host seen before resumes one and skips the full
+// handshake. TLS 1.3 tickets are used once each (RFC 8446, appendix C.4);
+// servers hand out a few with every connection.
+//
+// Basic Usage:
+//
+//   TlsContext::instance().setCaFile("my-ca.pem"); // Optional
+//
+//   HttpRequest request("www.hyperceptive.org", 443);
+//   request.setTls(true);
+//   request.sendRequest("GET", "/");
+//
+//   request.getTls()->alpn();    // "http/1.1"
+//   request.getTls()->resumed(); // Handshake skipped?
+//
+
+#ifndef TLS_CONNECTION_H
+#define TLS_CONNECTION_H
+
+#include "HttpException.h"
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_session_st SSL_SESSION;
+
+
+class TlsContext
+{
+  friend class TlsConnection;
+
+public:
+
+  // Sessions kept per host:port, the oldest are dropped.
+  static const int MaxSessionsPerHost = 4;
+
+
+  static TlsContext& instance();
+
+  // Check the server certificate and host name (default). Turn off only
+  // for testing, setCaFile() is the way to trust a self-signed certificate.
+  void setVerifyPeer(bool verify);
+
+  // Trust the certificates in a PEM file in addition to the system ones.
+  bool setCaFile(HttpError &error, const char *path);
+
+  // Protocols offered with ALPN, in order of preference. Array terminated
+  // by NULL (0). Default is "http/1.1".
+  bool setAlpn(HttpError &error, const char *protocols[]);
+
+#ifndef HTTP_NO_EXCEPTIONS
+  // The same, throwing HttpException.
+  void setCaFile(const char *path);
+  void setAlpn(const char *protocols[]);
+#endif
+
+  // Resume sessions of earlier connections (default).
+  void setSessionCaching(bool caching);
+
+  // Forget all cached sessions.
+  void clearSessions();
+
+  // Number of hosts with a cached session.
+  int sessionCount();
+
+
+private:
+
+  SSL_CTX *_ctx;
+  bool _verifyPeer;
+  bool _caching;
+
+  typedef std::deque<SSL_SESSION*> SessionList;
+
+  std::map<std::string, SessionList> _sessions; // By host:port, newest last
+
+  pthread_mutex_t _mutex;
+
+  TlsContext();
+  ~TlsContext();
+
+  SSL_SESSION* session(const std::string &key);
+  void storeSession(const std::string &key, SSL_SESSION *session);
+
+  static int newSession(SSL *ssl, SSL_SESSION *session);
+  static bool alpnList(const char *protocols[], std::vector<unsigned char> &list);
+
+  TlsContext(const TlsContext&);
+  TlsContext& operator=(const TlsContext&);
+};
+
+
+class TlsConnection
+{
+public:
+
+  // TLS on a connected non-blocking socket, which still belongs to the
+  // caller. protocols, if given, are offered with ALPN instead of those of
+  // TlsContext::setAlpn().
+  TlsConnection(int socket, const std::string &host, int port, const char *protocols[] = 0);
+
+  // Send close_notify, if it can go out right away.
+  ~TlsConnection();
+
+  // Handshake with the server, giving up after timeoutMs (-1 waits
+  // forever). Return false, with error set, if it fails.
+  bool handshake(int timeoutMs, HttpError &error);
+
+  // Read up to size bytes. Return the number read, 0 if the server closed
+  // the connection, or -1 with errno set: EAGAIN if there is nothing to
+  // read for now, EPROTO (with error set) if TLS failed.
+  int read(unsigned char *data, int size, HttpError &error);
+
+  // Write all the data, waiting for the socket as need be. Return 1, 0
+  // (with errno set) if the server closed the connection, or -1 with
+  // error set if it failed.
+  int write(const unsigned char *data, int size, HttpError &error);
+
+  // Protocol agreed with ALPN, "" if none.
+  const char* alpn() const { return _alpn.c_str(); }
+
+  // Was an earlier session resumed?
+  bool resumed() const { return _resumed; }
+
+  // "TLSv1.3", "TLSv1.2", ...
+  const char* version() const;
+
+
+private:
+
+  SSL *_ssl;
+  int _socket;
+  std::string _key; // host:port, for the session cache
+
+  std::string _alpn;
+  bool _resumed;
+
+  bool wait(int sslError, int timeoutMs, HttpError &error);
+
+  TlsConnection(const TlsConnection&);
+  TlsConnection& operator=(const TlsConnection&);
+};
+
+#endif
@@ -0,0 +1,282 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Benchmarks, run against LoopbackServer so no network is involved.
+//
+// Micro:  HttpResponse::processResponse() parsing throughput, and
+//         building plus sending a request with sendRequest().
+// Macro:  requests/sec and p50/p99 latency of whole requests through an
+//         EventLoop, at several concurrency levels.
+//
+// Usage: bench [seconds per macro benchmark]
+
+#include "LoopbackServer.h"
+
+#include "EventLoop.h"
+#include "HttpException.h"
+#include "HttpRequest.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+
+//-----------------------------------------------------------------------------
+static long long nowMicros()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+//*********************************************
+// Parsing
+//*********************************************
+
+// Gives the benchmark access to the parser.
+class ParseBench : public HttpResponse
+{
+public:
+
+  explicit ParseBench(HttpRequest &request) : HttpResponse("GET", request) {}
+
+  using HttpResponse::processResponse;
+  using HttpResponse::reset;
+};
+
+long long bodyBytes = 0;
+
+void countData(const HttpResponse *response, void *additionalParams, const unsigned char *data, int sizeOfData)
+{
+  bodyBytes += sizeOfData;
+}
+
+void benchParse(const char *path, double seconds)
+{
+  std::string data = LoopbackServer::build(path).data;
+
+  HttpRequest request("127.0.0.1", 0);
+  request.initCallbacks(0, countData, 0, 0);
+
+  ParseBench response(request);
+
+  long long count = 0;
+  long long start = nowMicros();
+  long long end = start + (long long)(seconds * 1000000);
+  long long now = start;
+
+  while (now < end)
+  {
+    for (int i = 0; i < 256; i++)
+    {
+      response.reset("GET");
+
+      int used = response.processResponse((const unsigned char*)data.data(), data.size());
+
+      if (used != (int)data.size() || !response.completed())
+      {
+        throw HttpException("benchParse(): %s not parsed", path);
+      }
+    }
+
+    count += 256;
+    now = nowMicros();
+  }
+
+  double elapsed = (now - start) / 1000000.0;
+
+  printf("parse     %-16s %10.0f responses/s %9.1f MB/s\n",
+         path, count / elapsed, count * data.size() / elapsed / 1000000.0);
+}
+
+
+//*********************************************
+// Request serialization
+//*********************************************
+
+void benchSerialize(int port, double seconds)
+{
+  static const char *headers[] =
+  {
+    "User-Agent", "httprequest-bench/1.0",
+    "Accept", "*/*",
+    "Accept-Language", "en-US,en;q=0.8",
+    "Cache-Control", "no-cache",
+    "Cookie", "session=8c2f1e0a9b7d4c3e; theme=dark",
+    "Referer", "http://127.0.0.1/index.html",
+    "X-Request-Id", "0f3c9a4e-2b1d-4f6a-9c8e-7d5b3a1f0e2c",
+    "X-Forwarded-For", "10.1.2.3",
+    0
+  };
+
+  // Small batches: the responses are read between them, untimed.
+  const int Batch = 16;
+
+  HttpRequest request("127.0.0.1", port);
+  request.initCallbacks(0, countData, 0, 0);
+
+  long long count = 0;
+  long long timed = 0;
+  long long limit = (long long)(seconds * 1000000);
+
+  while (timed < limit)
+  {
+    long long start = nowMicros();
+
+    for (int i = 0; i < Batch; i++)
+    {
+      request.sendRequest("GET", "/empty?id=1234567890&format=json", headers);
+    }
+
+    timed += nowMicros() - start;
+    count += Batch;
+
+    request.waitForResponses();
+  }
+
+  double elapsed = timed / 1000000.0;
+
+  printf("serialize %-16s %10.0f requests/s  %9.0f ns/request\n",
+         "8 headers", count / elapsed, elapsed * 1e9 / count);
+}
+
+
+//*********************************************
+// Whole requests
+//*********************************************
+
+struct Client
+{
+  HttpRequest *request;
+  long long started; // When the request in flight was sent
+};
+
+std::vector<int> latencies; // Microseconds
+int errors = 0;
+
+void clientComplete(const HttpResponse *response, void *additionalParams)
+{
+  Client *client = (Client*)additionalParams;
+
+  latencies.push_back((int)(nowMicros() - client->started));
+}
+
+void clientError(HttpRequest *request, const HttpException &e, void *additionalParams)
+{
+  errors++;
+}
+
+void benchRequests(int port, const char *path, int concurrency, double seconds)
+{
+  EventLoop loop;
+  loop.initErrorHandler(clientError, 0);
+
+  std::vector<Client> clients(concurrency);
+
+  for (int i = 0; i < concurrency; i++)
+  {
+    clients[i].request = new HttpRequest("127.0.0.1", port);
+    clients[i].request->initCallbacks(0, countData, clientComplete, &clients[i]);
+    loop.add(*clients[i].request);
+  }
+
+  latencies.clear();
+  errors = 0;
+
+  long long start = nowMicros();
+  long long end = start + (long long)(seconds * 1000000);
+  long long now = start;
+
+  while (now < end || loop.responsesPending())
+  {
+    // Keep one request in flight per client until time is up.
+    for (int i = 0; now < end && i < concurrency; i++)
+    {
+      if (clients[i].request->responsesPending()) continue;
+
+      try
+      {
+        clients[i].started = now;
+        clients[i].request->sendRequest("GET", path);
+      }
+      catch (HttpException &e)
+      {
+        clients[i].request->cleanUp();
+        errors++;
+      }
+    }
+
+    loop.run(10);
+    now = nowMicros();
+  }
+
+  double elapsed = (now - start) / 1000000.0;
+
+  for (int i = 0; i < concurrency; i++)
+  {
+    delete clients[i].request;
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+
+  int p50 = 0;
+  int p99 = 0;
+
+  if (!latencies.empty())
+  {
+    p50 = latencies[latencies.size() / 2];
+    p99 = latencies[latencies.size() * 99 / 100];
+  }
+
+  printf("requests  %-16s c=%-4d %10.0f requests/s  p50 %6d us  p99 %6d us  errors %d\n",
+         path, concurrency, latencies.size() / elapsed, p50, p99, errors);
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  double seconds = (argc > 1) ? atof(argv[1]) : 1.0;
+
+  static const char *parsePaths[] = { "/empty", "/fixed/1024", "/fixed/65536", "/chunked/65536", 0 };
+  static const char *requestPaths[] = { "/fixed/1024", "/fixed/65536", "/chunked/65536", "/close/1024", 0 };
+  static const int concurrency[] = { 1, 8, 64, 0 };
+
+  latencies.reserve(1 << 20);
+
+  try
+  {
+    LoopbackServer server;
+
+    for (int i = 0; parsePaths[i]; i++)
+    {
+      benchParse(parsePaths[i], seconds / 2);
+    }
+
+    benchSerialize(server.port(), seconds / 2);
+
+    for (int i = 0; requestPaths[i]; i++)
+    {
+      for (int j = 0; concurrency[j]; j++)
+      {
+        benchRequests(server.port(), requestPaths[i], concurrency[j], seconds);
+      }
+    }
+  }
+  catch (HttpException &e)
+  {
+    printf("Error: %s\n", e.message());
+    return 1;
+  }
+
+  return 0;
+}
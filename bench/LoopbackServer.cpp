@@ -0,0 +1,377 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Minimal HTTP/1.1 server on 127.0.0.1 for the benchmarks.
+
+#include "LoopbackServer.h"
+
+#include "HttpException.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+// Typical headers of a real server, so parsing has something to do.
+static const char *CommonHeaders =
+  "Server: LoopbackServer/1.0\r\n"
+  "Date: Tue, 15 Oct 2013 08:12:31 GMT\r\n"
+  "Content-Type: application/octet-stream\r\n"
+  "Cache-Control: private, max-age=0\r\n"
+  "ETag: \"5d8c72a5edda8d6a\"\r\n"
+  "Last-Modified: Mon, 14 Oct 2013 21:40:02 GMT\r\n"
+  "Vary: Accept-Encoding\r\n"
+  "X-Request-Id: 0f3c9a4e-2b1d-4f6a-9c8e-7d5b3a1f0e2c\r\n";
+
+
+//-----------------------------------------------------------------------------
+LoopbackServer::LoopbackServer() :
+  _port(0)
+{
+  _listen = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  int on = 1;
+  setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+
+  socklen_t length = sizeof(address);
+
+  if (bind(_listen, (sockaddr*)&address, sizeof(address)) < 0 ||
+      listen(_listen, 1024) < 0 ||
+      getsockname(_listen, (sockaddr*)&address, &length) < 0)
+  {
+    throw HttpException("LoopbackServer: %s", strerror(errno));
+  }
+
+  _port = ntohs(address.sin_port);
+
+  _epoll = epoll_create1(EPOLL_CLOEXEC);
+  _wakeup = eventfd(0, EFD_CLOEXEC);
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+
+  ev.data.fd = _listen;
+  epoll_ctl(_epoll, EPOLL_CTL_ADD, _listen, &ev);
+
+  ev.data.fd = _wakeup;
+  epoll_ctl(_epoll, EPOLL_CTL_ADD, _wakeup, &ev);
+
+  pthread_create(&_thread, 0, threadMain, this);
+}
+
+
+//-----------------------------------------------------------------------------
+LoopbackServer::~LoopbackServer()
+{
+  uint64_t one = 1;
+  ssize_t r = ::write(_wakeup, &one, sizeof(one));
+  (void)r;
+
+  pthread_join(_thread, 0);
+
+  while (!_connections.empty())
+  {
+    close(*_connections.begin()->second);
+  }
+
+  ::close(_wakeup);
+  ::close(_epoll);
+  ::close(_listen);
+}
+
+
+//-----------------------------------------------------------------------------
+void* LoopbackServer::threadMain(void *server)
+{
+  ((LoopbackServer*)server)->run();
+  return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+void LoopbackServer::run()
+{
+  struct epoll_event events[64];
+
+  while (true)
+  {
+    int n = epoll_wait(_epoll, events, 64, -1);
+
+    for (int i = 0; i < n; i++)
+    {
+      int fd = events[i].data.fd;
+
+      if (fd == _wakeup)
+      {
+        return;
+      }
+
+      if (fd == _listen)
+      {
+        accept();
+        continue;
+      }
+
+      std::map<int, Connection*>::iterator itr = _connections.find(fd);
+
+      if (itr == _connections.end())
+      {
+        continue;
+      }
+
+      Connection &connection = *itr->second;
+
+      if (events[i].events & EPOLLOUT)
+      {
+        if (!flush(connection)) continue;
+      }
+
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      {
+        readable(connection);
+      }
+    }
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+void LoopbackServer::accept()
+{
+  int s = ::accept4(_listen, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+  if (s < 0)
+  {
+    return;
+  }
+
+  int on = 1;
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  Connection *connection = new Connection;
+  connection->socket = s;
+  connection->sent = 0;
+  connection->closing = false;
+
+  _connections[s] = connection;
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = s;
+
+  epoll_ctl(_epoll, EPOLL_CTL_ADD, s, &ev);
+}
+
+
+//-----------------------------------------------------------------------------
+void LoopbackServer::readable(Connection &connection)
+{
+  char buffer[16384];
+
+  while (true)
+  {
+    ssize_t n = recv(connection.socket, buffer, sizeof(buffer), 0);
+
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+    {
+      close(connection);
+      return;
+    }
+
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    connection.in.append(buffer, n);
+  }
+
+  // Answer every complete request head, in order.
+  size_t start = 0;
+  size_t end;
+
+  while (!connection.closing &&
+         (end = connection.in.find("\r\n\r\n", start)) != std::string::npos)
+  {
+    size_t pathStart = connection.in.find(' ', start) + 1;
+    size_t pathEnd = connection.in.find(' ', pathStart);
+
+    const Response &r = response(connection.in.substr(pathStart, pathEnd - pathStart));
+
+    connection.out += r.data;
+    connection.closing = r.close;
+
+    start = end + 4;
+  }
+
+  connection.in.erase(0, start);
+
+  flush(connection);
+}
+
+
+//-----------------------------------------------------------------------------
+// Send what can be sent. Return false if the connection was closed.
+bool LoopbackServer::flush(Connection &connection)
+{
+  while (connection.sent < connection.out.size())
+  {
+    ssize_t n = send(connection.socket, connection.out.data() + connection.sent,
+                     connection.out.size() - connection.sent, MSG_NOSIGNAL);
+
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+
+      if (errno == EAGAIN)
+      {
+        // Wait until it can be written
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.fd = connection.socket;
+
+        epoll_ctl(_epoll, EPOLL_CTL_MOD, connection.socket, &ev);
+        return true;
+      }
+
+      close(connection);
+      return false;
+    }
+
+    connection.sent += n;
+  }
+
+  connection.out.clear();
+  connection.sent = 0;
+
+  if (connection.closing)
+  {
+    close(connection);
+    return false;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = connection.socket;
+
+  epoll_ctl(_epoll, EPOLL_CTL_MOD, connection.socket, &ev);
+  return true;
+}
+
+
+//-----------------------------------------------------------------------------
+void LoopbackServer::close(Connection &connection)
+{
+  epoll_ctl(_epoll, EPOLL_CTL_DEL, connection.socket, 0);
+  ::close(connection.socket);
+
+  _connections.erase(connection.socket);
+  delete &connection;
+}
+
+
+//-----------------------------------------------------------------------------
+const LoopbackServer::Response& LoopbackServer::response(const std::string &path)
+{
+  std::map<std::string, Response>::iterator itr = _responses.find(path);
+
+  if (itr == _responses.end())
+  {
+    itr = _responses.insert(std::make_pair(path, build(path))).first;
+  }
+
+  return itr->second;
+}
+
+
+//-----------------------------------------------------------------------------
+LoopbackServer::Response LoopbackServer::build(const std::string &path)
+{
+  Response r;
+  r.close = false;
+
+  char line[128];
+  int size = 0;
+
+  size_t slash = path.find('/', 1);
+
+  if (slash != std::string::npos)
+  {
+    size = atoi(path.c_str() + slash + 1);
+  }
+
+  std::string body(size, 'x');
+  std::string kind = path.substr(0, slash);
+
+  if (kind == "/empty")
+  {
+    r.data = "HTTP/1.1 204 No Content\r\n";
+    r.data += CommonHeaders;
+    r.data += "\r\n";
+  }
+  else if (kind == "/fixed")
+  {
+    snprintf(line, sizeof(line), "Content-Length: %d\r\n", size);
+
+    r.data = "HTTP/1.1 200 OK\r\n";
+    r.data += CommonHeaders;
+    r.data += line;
+    r.data += "\r\n";
+    r.data += body;
+  }
+  else if (kind == "/chunked")
+  {
+    r.data = "HTTP/1.1 200 OK\r\n";
+    r.data += CommonHeaders;
+    r.data += "Transfer-Encoding: chunked\r\n\r\n";
+
+    for (int i = 0; i < size; i += ChunkSize)
+    {
+      int length = (size - i < ChunkSize) ? size - i : ChunkSize;
+
+      snprintf(line, sizeof(line), "%x\r\n", length);
+
+      r.data += line;
+      r.data.append(body, i, length);
+      r.data += "\r\n";
+    }
+
+    r.data += "0\r\n\r\n";
+  }
+  else if (kind == "/close")
+  {
+    r.data = "HTTP/1.1 200 OK\r\n";
+    r.data += CommonHeaders;
+    r.data += "Connection: close\r\n\r\n";
+    r.data += body;
+    r.close = true;
+  }
+  else
+  {
+    r.data = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+  }
+
+  return r;
+}
@@ -0,0 +1,85 @@
+// Copyright (c) 2013 Matt Hill
+// Use of this source code is governed by The MIT License
+// that can be found in the LICENSE file.
+//
+// Minimal HTTP/1.1 server on 127.0.0.1 for the benchmarks.
+//
+// Runs on its own thread with epoll. Responses are built once per path and
+// then copied out as-is, so the server costs as little as possible:
+//
+//   /fixed/N    N byte body with Content-Length (keep-alive)
+//   /chunked/N  N byte body in 4 KB chunks (keep-alive)
+//   /close/N    N byte body ended by closing the connection
+//   /empty      204 No Content
+//
+// Pipelined requests are answered in order. Request bodies are not
+// supported.
+
+#ifndef LOOPBACK_SERVER_H
+#define LOOPBACK_SERVER_H
+
+#include <map>
+#include <string>
+
+#include <pthread.h>
+
+
+class LoopbackServer
+{
+public:
+
+  static const int ChunkSize = 4096;
+
+  // Listen on an ephemeral port and start serving.
+  LoopbackServer();
+
+  ~LoopbackServer();
+
+  int port() const { return _port; }
+
+  struct Response
+  {
+    std::string data;
+    bool close; // Connection closes after it
+  };
+
+  // The response served for path.
+  static Response build(const std::string &path);
+
+
+private:
+
+  struct Connection
+  {
+    int socket;
+    std::string in;  // Received, not yet answered
+    std::string out; // Responses not yet sent
+    size_t sent;     // Bytes of out already sent
+    bool closing;    // Close once out has been sent
+  };
+
+  int _listen;
+  int _port;
+  int _epoll;
+  int _wakeup; // eventfd to stop the thread
+
+  pthread_t _thread;
+
+  std::map<int, Connection*> _connections;
+  std::map<std::string, Response> _responses; // By path
+
+  static void* threadMain(void *server);
+
+  void run();
+  void accept();
+  void readable(Connection &connection);
+  bool flush(Connection &connection);
+  void close(Connection &connection);
+
+  const Response& response(const std::string &path);
+
+  LoopbackServer(const LoopbackServer&);
+  LoopbackServer& operator=(const LoopbackServer&);
+};
+
+#endif
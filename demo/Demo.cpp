@@ -4,6 +4,7 @@
 
 #include "HttpRequest.h"
 #include "HttpException.h"
+#include "EventLoop.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -47,10 +48,7 @@ void demoGet()
   request.initCallbacks(headersReady, receiveData, responseComplete, 0);
   request.sendRequest("GET", "/", 0, 0, 0);
 
-  while(request.responsesPending())
-  {
-    request.processRequest();
-  }
+  request.waitForResponses();
 }
 
 
@@ -71,10 +69,28 @@ void demoPost()
   request.initCallbacks(headersReady, receiveData, responseComplete, 0);
   request.sendRequest("POST", "/cdipProxy.php", headers, (const unsigned char*)body, strlen(body));
 
-  while(request.responsesPending())
-  {
-    request.processRequest();
-  }
+  request.waitForResponses();
+}
+
+
+void demoEventLoop()
+{
+  printf("\n----------------------- EventLoop Requests ----------------------\n");
+  EventLoop loop;
+
+  HttpRequest first("hyperceptive.org", 80);
+  HttpRequest second("codebones.com", 80);
+
+  first.initCallbacks(headersReady, receiveData, responseComplete, 0);
+  second.initCallbacks(headersReady, receiveData, responseComplete, 0);
+
+  loop.add(first);
+  loop.add(second);
+
+  first.sendRequest("GET", "/", 0, 0, 0);
+  second.sendRequest("GET", "/", 0, 0, 0);
+
+  loop.runUntilComplete();
 }
 
 
@@ -85,6 +101,7 @@ int main(int argc, char *argv[])
   {
     demoGet();
     demoPost();
+    demoEventLoop();
   }
   catch(HttpException &e)
   {